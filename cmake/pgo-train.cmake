@@ -0,0 +1,61 @@
+# Trains the instrumented libraries of an ENABLE_PGO build. Runs vni_bench
+# over synthetic projects of every switch mode with the load options, input
+# formats and output paths hosts use, then merges the Clang profile for the
+# optimized build. The training says nothing about the gain, compare
+# vni-replay latencies of a trained and a plain build for that.
+#
+#   cmake -DBENCH=vni_bench -DPROFILE_DIR=DIR -DWORK_DIR=DIR -DSTAMP=FILE
+#         [-DLLVM_PROFDATA=llvm-profdata] -P pgo-train.cmake
+#
+# Skips training if STAMP is newer than BENCH.
+
+foreach(var BENCH PROFILE_DIR WORK_DIR STAMP)
+  if(NOT ${var})
+    message(FATAL_ERROR "pgo-train.cmake: ${var} is not set")
+  endif()
+endforeach()
+
+if(EXISTS ${STAMP} AND ${STAMP} IS_NEWER_THAN ${BENCH})
+  message(STATUS "PGO profile is up to date")
+  return()
+endif()
+
+# Counters of a previous training would add up with this one.
+file(GLOB stale ${PROFILE_DIR}/*.gcda ${PROFILE_DIR}/*.profraw
+  ${PROFILE_DIR}/*.profdata)
+if(stale)
+  file(REMOVE ${stale})
+endif()
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+set(common --frames 600 --warmup 50 --load-runs 2 --dir ${WORK_DIR}
+  --out ${WORK_DIR}/train.jsonl)
+set(runs
+  # Every mode at the common sizes, with and without masks.
+  "--size 128x32,192x64,256x64 --masks 0,8"
+  # Projects as they are shipped: compressed frames, decoded on demand.
+  "--compress --frame-cache 262144 --double --scaler 1 --bitplanes --masks 0,3"
+  "--compress --prune --orphans 8 --dedup --repeat-planes 50 --overlay-area 25 \
+--lcm-layers 3 --scaler 2 --input planes"
+  "--input packed --reload-every 100 --size 192x64 --masks 0,8"
+  # Frames smaller than the standard size, allocator hooks.
+  "--size 128x16 --memory-budget 0 --replace-cache 1048576 --masks 3"
+  "--crc"
+)
+foreach(run IN LISTS runs)
+  message(STATUS "PGO training: vni_bench ${run}")
+  separate_arguments(args UNIX_COMMAND "${run}")
+  execute_process(COMMAND ${BENCH} ${common} ${args}
+    OUTPUT_QUIET
+    COMMAND_ERROR_IS_FATAL ANY)
+endforeach()
+
+if(LLVM_PROFDATA)
+  file(GLOB raw ${PROFILE_DIR}/*.profraw)
+  execute_process(
+    COMMAND ${LLVM_PROFDATA} merge -output=${PROFILE_DIR}/vni.profdata ${raw}
+    COMMAND_ERROR_IS_FATAL ANY)
+endif()
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(TOUCH ${STAMP})
@@ -1,11 +1,16 @@
 #include "vni.h"
 
 #include <algorithm>
+#include <array>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
-#include <sstream>
+#include <new>
+#include <optional>
+#include <type_traits>
 
 #include "FrameUtil.h"
+#include "vni_crc32.h"
 #include "vni_heatshrink.h"
 #include "vni_internal.h"
 
@@ -48,11 +53,84 @@ std::vector<uint8_t> read_bytes_required(std::istream& in, size_t len) {
 
 uint8_t reverse_bits(uint8_t a) { return FrameUtil::Helper::ReverseByte(a); }
 
-Palette* find_palette(PalFile* pal, uint16_t palette_index) {
+// VNI files store planes and masks most significant bit first.
+void reverse_bytes(uint8_t* data, size_t size) {
+  for (uint8_t* b = data; b != data + size; b++) {
+    *b = reverse_bits(*b);
+  }
+}
+
+// Adds the time of its scope to *ns, if ns is set.
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(uint64_t* ns) : ns_(ns) {
+    if (ns_) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  ~PhaseTimer() {
+    if (ns_) {
+      *ns_ += static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_)
+              .count());
+    }
+  }
+
+  PhaseTimer(const PhaseTimer&) = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+ private:
+  uint64_t* ns_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// The counter of a LoadProfile phase, or null when not profiling.
+uint64_t* phase(LoadProfile* profile, uint64_t LoadProfile::*field) {
+  return profile ? &(profile->*field) : nullptr;
+}
+
+// Byte sources for read_frame_planes, so decompressed frames are parsed in
+// place instead of being copied into a stream first.
+class StreamSource {
+ public:
+  explicit StreamSource(std::istream& in) : in_(in) {}
+
+  int get() { return in_.get(); }
+  bool read(uint8_t* out, size_t len) {
+    in_.read(reinterpret_cast<char*>(out), static_cast<std::streamsize>(len));
+    return static_cast<size_t>(in_.gcount()) == len;
+  }
+
+ private:
+  std::istream& in_;
+};
+
+class MemorySource {
+ public:
+  MemorySource(const uint8_t* data, size_t len) : data_(data), len_(len) {}
+
+  int get() { return pos_ < len_ ? data_[pos_++] : -1; }
+  bool read(uint8_t* out, size_t len) {
+    if (len_ - pos_ < len) {
+      return false;
+    }
+    std::copy(data_ + pos_, data_ + pos_ + len, out);
+    pos_ += len;
+    return true;
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t len_;
+  size_t pos_ = 0;
+};
+
+const Palette* find_palette(const PalFile* pal, uint16_t palette_index) {
   if (!pal) {
     return nullptr;
   }
-  for (auto& palette : pal->palettes) {
+  for (const auto& palette : pal->palettes) {
     if (palette.index == palette_index) {
       return &palette;
     }
@@ -60,12 +138,13 @@ Palette* find_palette(PalFile* pal, uint16_t palette_index) {
   return nullptr;
 }
 
-std::vector<uint8_t> expand_palette(const Palette& palette, size_t colors) {
-  std::vector<uint8_t> out;
-  out.resize(colors * 3, 0);
+void expand_palette(const Palette& palette, size_t colors,
+                    HookVector<uint8_t>* out_buffer) {
+  HookVector<uint8_t>& out = *out_buffer;
+  out.assign(colors * 3, 0);
   size_t available = palette.colors.size() / 3;
   if (available == 0) {
-    return out;
+    return;
   }
   for (size_t i = 0; i < colors; i++) {
     size_t src = std::min(i, available - 1);
@@ -73,7 +152,6 @@ std::vector<uint8_t> expand_palette(const Palette& palette, size_t colors) {
     out[i * 3 + 1] = palette.colors[src * 3 + 1];
     out[i * 3 + 2] = palette.colors[src * 3 + 2];
   }
-  return out;
 }
 
 std::vector<std::vector<uint8_t>> split_planes(const uint8_t* frame,
@@ -94,12 +172,83 @@ std::vector<std::vector<uint8_t>> split_planes(const uint8_t* frame,
   return planes;
 }
 
-std::vector<uint8_t> join_planes(
-    const std::vector<std::vector<uint8_t>>& planes, const Dimensions& dim) {
-  size_t surface = static_cast<size_t>(dim.width) * dim.height;
-  std::vector<uint8_t> data(surface, 0);
+// Copies bitlen planes of plane_size bytes held back to back.
+std::vector<std::vector<uint8_t>> copy_planes(const uint8_t* data,
+                                              size_t plane_size,
+                                              uint8_t bitlen) {
+  std::vector<std::vector<uint8_t>> planes;
+  planes.reserve(bitlen);
+  for (uint8_t i = 0; i < bitlen; i++) {
+    planes.emplace_back(data + i * plane_size, data + (i + 1) * plane_size);
+  }
+  return planes;
+}
+
+// Splits surface pixels packed bitlen (1, 2 or 4) bits each, the first
+// pixel of a byte in its least significant bits, into planes. Every 8
+// pixels give one byte of each plane, gathered from every bitlen-th bit.
+std::vector<std::vector<uint8_t>> split_packed(const uint8_t* pixels,
+                                               size_t surface,
+                                               uint8_t bitlen) {
+  size_t plane_size = surface / 8;
+  if (bitlen == 1) {
+    return copy_planes(pixels, plane_size, 1);
+  }
+  std::vector<std::vector<uint8_t>> planes(bitlen,
+                                           std::vector<uint8_t>(plane_size));
+  for (size_t g = 0; g < plane_size; g++) {
+    if (bitlen == 2) {
+      uint32_t x = pixels[2 * g] | (uint32_t{pixels[2 * g + 1]} << 8);
+      for (int p = 0; p < 2; p++) {
+        uint32_t v = (x >> p) & 0x5555;
+        v = (v | (v >> 1)) & 0x3333;
+        v = (v | (v >> 2)) & 0x0f0f;
+        v = (v | (v >> 4)) & 0x00ff;
+        planes[p][g] = static_cast<uint8_t>(v);
+      }
+    } else {
+      const uint8_t* in = pixels + 4 * g;
+      uint32_t x = in[0] | (uint32_t{in[1]} << 8) | (uint32_t{in[2]} << 16) |
+                   (uint32_t{in[3]} << 24);
+      for (int p = 0; p < 4; p++) {
+        uint32_t v = (x >> p) & 0x11111111;
+        v = (v | (v >> 3)) & 0x03030303;
+        v = (v | (v >> 6)) & 0x000f000f;
+        v = (v | (v >> 12)) & 0x000000ff;
+        planes[p][g] = static_cast<uint8_t>(v);
+      }
+    }
+  }
+  return planes;
+}
+
+// Indexed pixels of planes or packed input, for recording and padding.
+std::vector<uint8_t> join_plane_data(const uint8_t* planes,
+                                            const Dimensions& dim,
+                                            uint8_t bitlen) {
+  std::vector<uint8_t> pixels(dim.surface());
+  FrameUtil::Helper::Join(pixels.data(), static_cast<uint16_t>(dim.width),
+                          static_cast<uint16_t>(dim.height), bitlen, planes);
+  return pixels;
+}
+
+std::vector<uint8_t> unpack_pixels(const uint8_t* data, size_t surface,
+                                          uint8_t bitlen) {
+  std::vector<uint8_t> pixels(surface);
+  const uint8_t mask = static_cast<uint8_t>((1u << bitlen) - 1);
+  for (size_t i = 0; i < surface; i++) {
+    size_t bit = i * bitlen;
+    pixels[i] = static_cast<uint8_t>((data[bit / 8] >> (bit % 8)) & mask);
+  }
+  return pixels;
+}
+
+// Joins planes into the dim.surface() pixels at data.
+void join_planes_to(const std::vector<std::vector<uint8_t>>& planes,
+                    const Dimensions& dim, uint8_t* data) {
   if (planes.empty()) {
-    return data;
+    std::fill_n(data, dim.surface(), 0);
+    return;
   }
   size_t plane_size = planes[0].size();
   std::vector<uint8_t> packed(planes.size() * plane_size, 0);
@@ -107,10 +256,15 @@ std::vector<uint8_t> join_planes(
     std::copy(planes[i].begin(), planes[i].end(),
               packed.begin() + i * plane_size);
   }
-  FrameUtil::Helper::Join(data.data(), static_cast<uint16_t>(dim.width),
+  FrameUtil::Helper::Join(data, static_cast<uint16_t>(dim.width),
                           static_cast<uint16_t>(dim.height),
                           static_cast<uint8_t>(planes.size()), packed.data());
+}
 
+std::vector<uint8_t> join_planes(
+    const std::vector<std::vector<uint8_t>>& planes, const Dimensions& dim) {
+  std::vector<uint8_t> data(dim.surface());
+  join_planes_to(planes, dim, data.data());
   return data;
 }
 
@@ -134,35 +288,322 @@ std::vector<uint8_t> scale2x_indexed(const std::vector<uint8_t>& data,
   return out;
 }
 
-void clear_plane(std::vector<uint8_t>& plane) {
-  FrameUtil::Helper::ClearPlane(plane.data(), plane.size());
+// Every bit of a byte doubled into two adjacent bits. Plane bytes hold the
+// leftmost pixel in the lowest bit, so this doubles 8 pixels horizontally.
+constexpr std::array<uint16_t, 256> make_double_bits() {
+  std::array<uint16_t, 256> table{};
+  for (uint32_t v = 0; v < 256; v++) {
+    uint32_t doubled = 0;
+    for (uint32_t bit = 0; bit < 8; bit++) {
+      if (v & (1u << bit)) {
+        doubled |= 3u << (bit * 2);
+      }
+    }
+    table[v] = static_cast<uint16_t>(doubled);
+  }
+  return table;
+}
+
+constexpr std::array<uint16_t, 256> kDoubleBits = make_double_bits();
+
+// Planes can be scaled without joining them when their rows are whole bytes.
+bool planes_scalable(const std::vector<std::vector<uint8_t>>& planes,
+                     const Dimensions& dim) {
+  if (dim.width % 8 != 0) {
+    return false;
+  }
+  for (const auto& plane : planes) {
+    if (plane.size() != dim.surface() / 8) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Sizes out to count planes of size bytes, reusing its buffers. The scalers
+// overwrite every byte.
+void resize_planes(std::vector<std::vector<uint8_t>>* out, size_t count,
+                   size_t size) {
+  out->resize(count);
+  for (auto& plane : *out) {
+    plane.resize(size);
+  }
+}
+
+void scale_double_planes(const std::vector<std::vector<uint8_t>>& planes,
+                         const Dimensions& dim,
+                         std::vector<std::vector<uint8_t>>* out) {
+  size_t row_bytes = dim.width / 8;
+  resize_planes(out, planes.size(), row_bytes * 2 * dim.height * 2);
+  for (size_t p = 0; p < planes.size(); p++) {
+    const uint8_t* src = planes[p].data();
+    uint8_t* dst = (*out)[p].data();
+    for (uint32_t y = 0; y < dim.height; y++) {
+      for (size_t i = 0; i < row_bytes; i++) {
+        uint16_t doubled = kDoubleBits[src[i]];
+        dst[i * 2] = static_cast<uint8_t>(doubled);
+        dst[i * 2 + 1] = static_cast<uint8_t>(doubled >> 8);
+      }
+      std::memcpy(dst + row_bytes * 2, dst, row_bytes * 2);
+      src += row_bytes;
+      dst += row_bytes * 4;
+    }
+  }
+}
+
+// Up to 8 bytes of a plane row starting at byte i, as one little-endian word.
+uint64_t load_row_bits(const uint8_t* row, size_t i, size_t n) {
+  uint64_t bits = 0;
+  for (size_t k = 0; k < n; k++) {
+    bits |= static_cast<uint64_t>(row[i + k]) << (k * 8);
+  }
+  return bits;
 }
 
-void or_plane(const std::vector<uint8_t>& src, std::vector<uint8_t>& dest) {
-  size_t count = std::min(src.size(), dest.size());
-  FrameUtil::Helper::OrPlane(src.data(), dest.data(), count);
+// The pixels left and right of the n * 8 pixels in bits, edge pixels being
+// their own neighbours as in Scale2XIndexed.
+uint64_t left_bits(const uint8_t* row, size_t i, uint64_t bits) {
+  uint64_t carry = i > 0 ? row[i - 1] >> 7 : bits & 1;
+  return (bits << 1) | carry;
 }
 
-std::vector<uint8_t> combine_plane_with_mask(
-    const std::vector<uint8_t>& base, const std::vector<uint8_t>& overlay,
-    const std::vector<uint8_t>& mask) {
-  size_t count = std::min({base.size(), overlay.size(), mask.size()});
-  std::vector<uint8_t> out(count, 0);
-  FrameUtil::Helper::CombinePlaneWithMask(base.data(), overlay.data(),
-                                          mask.data(), out.data(), count);
-  return out;
+uint64_t right_bits(const uint8_t* row, size_t row_bytes, size_t i, size_t n,
+                    uint64_t bits) {
+  size_t last = n * 8 - 1;
+  uint64_t carry = i + n < row_bytes ? row[i + n] & 1 : (bits >> last) & 1;
+  return (bits >> 1) | (carry << last);
+}
+
+// Interleaves the n low bytes of even and odd into 2 * n output bytes, bit k
+// of even going to pixel 2k and bit k of odd to pixel 2k + 1.
+void store_interleaved(uint8_t* dst, uint64_t even, uint64_t odd, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    uint16_t bits = static_cast<uint16_t>(
+        (kDoubleBits[(even >> (k * 8)) & 0xff] & 0x5555) |
+        (kDoubleBits[(odd >> (k * 8)) & 0xff] & 0xaaaa));
+    dst[k * 2] = static_cast<uint8_t>(bits);
+    dst[k * 2 + 1] = static_cast<uint8_t>(bits >> 8);
+  }
+}
+
+// Scale2x on bitplanes, 64 pixels at a time. A pixel equals a neighbour when
+// all of its plane bits do, so the rule of Scale2XIndexed becomes a set of
+// selection masks shared by all planes.
+void scale2x_planes(const std::vector<std::vector<uint8_t>>& planes,
+                    const Dimensions& dim,
+                    std::vector<std::vector<uint8_t>>* out) {
+  size_t row_bytes = dim.width / 8;
+  resize_planes(out, planes.size(), row_bytes * 2 * dim.height * 2);
+  for (uint32_t y = 0; y < dim.height; y++) {
+    size_t row = y * row_bytes;
+    size_t above = y > 0 ? row - row_bytes : row;
+    size_t below = y + 1 < dim.height ? row + row_bytes : row;
+    for (size_t i = 0; i < row_bytes; i += 8) {
+      size_t n = std::min<size_t>(8, row_bytes - i);
+      uint64_t eq_db = ~0ull, eq_bf = ~0ull, eq_dh = ~0ull, eq_hf = ~0ull;
+      uint64_t eq_bh = ~0ull, eq_df = ~0ull;
+      for (const auto& plane : planes) {
+        const uint8_t* e_row = plane.data() + row;
+        uint64_t e = load_row_bits(e_row, i, n);
+        uint64_t b = load_row_bits(plane.data() + above, i, n);
+        uint64_t h = load_row_bits(plane.data() + below, i, n);
+        uint64_t d = left_bits(e_row, i, e);
+        uint64_t f = right_bits(e_row, row_bytes, i, n, e);
+        eq_db &= ~(d ^ b);
+        eq_bf &= ~(b ^ f);
+        eq_dh &= ~(d ^ h);
+        eq_hf &= ~(h ^ f);
+        eq_bh &= ~(b ^ h);
+        eq_df &= ~(d ^ f);
+      }
+      uint64_t active = ~eq_bh & ~eq_df;
+      uint64_t sel0 = active & eq_db;
+      uint64_t sel1 = active & eq_bf;
+      uint64_t sel2 = active & eq_dh;
+      uint64_t sel3 = active & eq_hf;
+      for (size_t p = 0; p < planes.size(); p++) {
+        const uint8_t* e_row = planes[p].data() + row;
+        uint64_t e = load_row_bits(e_row, i, n);
+        uint64_t d = left_bits(e_row, i, e);
+        uint64_t f = right_bits(e_row, row_bytes, i, n, e);
+        uint64_t e0 = (sel0 & d) | (~sel0 & e);
+        uint64_t e1 = (sel1 & f) | (~sel1 & e);
+        uint64_t e2 = (sel2 & d) | (~sel2 & e);
+        uint64_t e3 = (sel3 & f) | (~sel3 & e);
+        uint8_t* dst = (*out)[p].data() + y * row_bytes * 4 + i * 2;
+        store_interleaved(dst, e0, e1, n);
+        store_interleaved(dst + row_bytes * 2, e2, e3, n);
+      }
+    }
+  }
+}
+
+// Doubles planes of dim into out with scale2x or plain pixel doubling,
+// staying in the plane domain unless the rows are not byte aligned.
+void scale_planes(const std::vector<std::vector<uint8_t>>& planes,
+                  const Dimensions& dim, bool scale2x,
+                  std::vector<std::vector<uint8_t>>* out) {
+  if (planes_scalable(planes, dim)) {
+    if (scale2x) {
+      scale2x_planes(planes, dim, out);
+    } else {
+      scale_double_planes(planes, dim, out);
+    }
+    return;
+  }
+  auto indexed = join_planes(planes, dim);
+  auto scaled = scale2x ? scale2x_indexed(indexed, dim)
+                        : scale_double_indexed(indexed, dim);
+  *out = split_planes(scaled.data(), dim.width * 2, dim.height * 2,
+                      static_cast<uint8_t>(planes.size()));
+}
+
+// Word-wide plane operations of the LCM compositor. Loads and stores go
+// through memcpy, so arena planes need no particular alignment, and compile
+// to plain 64-bit (or vectorized) accesses.
+uint64_t load_word(const uint8_t* p) {
+  uint64_t word;
+  std::memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+void store_word(uint8_t* p, uint64_t word) {
+  std::memcpy(p, &word, sizeof(word));
+}
+
+void or_words(uint8_t* dest, const uint8_t* src, size_t size) {
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    store_word(dest + i, load_word(dest + i) | load_word(src + i));
+  }
+  for (; i < size; i++) {
+    dest[i] |= src[i];
+  }
+}
+
+// dest = src padded with zeros to dest_size, src may be null.
+void copy_words(uint8_t* dest, size_t dest_size, const uint8_t* src,
+                size_t size) {
+  size = src ? std::min(size, dest_size) : 0;
+  if (size > 0) {
+    std::memcpy(dest, src, size);
+  }
+  std::memset(dest + size, 0, dest_size - size);
+}
+
+// Sparse planes: a u16 run count, the runs as pairs of u16 first word and
+// word count, then the words of all runs. Word k holds bytes 8k..8k+7 of
+// the plane, a last partial word is zero padded.
+uint64_t plane_word(const uint8_t* plane, size_t size, size_t k) {
+  if (k * 8 + 8 <= size) {
+    return load_word(plane + k * 8);
+  }
+  uint64_t word = 0;
+  std::memcpy(&word, plane + k * 8, size - k * 8);
+  return word;
+}
+
+size_t count_nonzero_words(const uint8_t* plane, size_t size) {
+  size_t count = 0;
+  for (size_t k = 0; k * 8 < size; k++) {
+    count += plane_word(plane, size, k) != 0;
+  }
+  return count;
+}
+
+void put_u16(std::vector<uint8_t>& out, size_t v) {
+  uint16_t u = static_cast<uint16_t>(v);
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(&u);
+  out.insert(out.end(), p, p + 2);
+}
+
+uint16_t get_u16(const uint8_t* p) {
+  uint16_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+void append_sparse(std::vector<uint8_t>& out, const uint8_t* plane,
+                   size_t size) {
+  size_t header = out.size();
+  put_u16(out, 0);
+  size_t words = (size + 7) / 8;
+  std::vector<uint64_t> data;
+  size_t runs = 0;
+  for (size_t k = 0; k < words;) {
+    if (plane_word(plane, size, k) == 0) {
+      k++;
+      continue;
+    }
+    size_t first = k;
+    for (; k < words && plane_word(plane, size, k) != 0; k++) {
+      data.push_back(plane_word(plane, size, k));
+    }
+    put_u16(out, first);
+    put_u16(out, k - first);
+    runs++;
+  }
+  uint16_t count = static_cast<uint16_t>(runs);
+  std::memcpy(out.data() + header, &count, sizeof(count));
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data());
+  out.insert(out.end(), bytes, bytes + data.size() * 8);
+}
+
+// ORs the first size bytes of a sparse plane into dest, or only skips it if
+// dest is null. Returns the end of the sparse plane.
+const uint8_t* or_sparse(uint8_t* dest, const uint8_t* sparse, size_t size) {
+  size_t runs = get_u16(sparse);
+  const uint8_t* run = sparse + 2;
+  const uint8_t* words = run + runs * 4;
+  for (size_t r = 0; r < runs; r++, run += 4) {
+    size_t k = get_u16(run);
+    size_t count = get_u16(run + 2);
+    for (size_t j = 0; dest && j < count; j++, k++) {
+      const uint8_t* word = words + j * 8;
+      if (k * 8 + 8 <= size) {
+        store_word(dest + k * 8, load_word(dest + k * 8) | load_word(word));
+      } else {
+        for (size_t b = k * 8; b < size; b++) {
+          dest[b] |= word[b - k * 8];
+        }
+        break;
+      }
+    }
+    words += count * 8;
+  }
+  return words;
+}
+
+// out = overlay where mask is set, base elsewhere.
+void combine_words(uint8_t* out, const uint8_t* base, const uint8_t* overlay,
+                   const uint8_t* mask, size_t size) {
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t m = load_word(mask + i);
+    store_word(out + i,
+               (m & load_word(overlay + i)) | (~m & load_word(base + i)));
+  }
+  for (; i < size; i++) {
+    out[i] = static_cast<uint8_t>((mask[i] & overlay[i]) |
+                                  (~mask[i] & base[i]));
+  }
 }
 
 uint32_t checksum_plane(const std::vector<uint8_t>& plane, bool reverse) {
-  return FrameUtil::Helper::Checksum(plane.data(), plane.size(), reverse);
+  return crc32(plane.data(), plane.size(), reverse);
+}
+
+uint32_t checksum_plane_with_mask(const std::vector<uint8_t>& plane,
+                                  const uint8_t* mask, size_t mask_size,
+                                  bool reverse) {
+  size_t count = std::min(plane.size(), mask_size);
+  return crc32_masked(plane.data(), mask, count, reverse);
 }
 
 uint32_t checksum_plane_with_mask(const std::vector<uint8_t>& plane,
                                   const std::vector<uint8_t>& mask,
                                   bool reverse) {
-  size_t count = std::min(plane.size(), mask.size());
-  return FrameUtil::Helper::ChecksumWithMask(plane.data(), mask.data(), count,
-                                             reverse);
+  return checksum_plane_with_mask(plane, mask.data(), mask.size(), reverse);
 }
 
 int64_t now_ms() {
@@ -173,9 +614,199 @@ int64_t now_ms() {
 
 }  // namespace
 
-uint32_t Context::tick() const { return static_cast<uint32_t>(now_ms()); }
+const char* switch_mode_name(SwitchMode mode) {
+  switch (mode) {
+    case SwitchMode::Palette:
+      return "Palette";
+    case SwitchMode::Replace:
+      return "Replace";
+    case SwitchMode::ColorMask:
+      return "ColorMask";
+    case SwitchMode::Event:
+      return "Event";
+    case SwitchMode::Follow:
+      return "Follow";
+    case SwitchMode::LayeredColorMask:
+      return "LayeredColorMask";
+    case SwitchMode::FollowReplace:
+      return "FollowReplace";
+    case SwitchMode::MaskedReplace:
+      return "MaskedReplace";
+  }
+  return "unknown";
+}
+
+int64_t Context::now() const {
+  return clock ? clock(clock_user_data) : now_ms();
+}
+
+uint32_t Context::tick() const { return static_cast<uint32_t>(now()); }
+
+uint32_t FrameSeq::allocate(size_t size) {
+  size_t offset = (arena.size() + 7) & ~size_t{7};
+  arena.resize(offset + size);
+  return static_cast<uint32_t>(offset);
+}
+
+const uint8_t* FrameSeq::planes(const AnimationFrame& frame,
+                                FrameCache* cache) const {
+  if (frame.sparse) {
+    return nullptr;
+  }
+  if (!is_shared(frame)) {
+    return block(frame, cache);
+  }
+  size_t count = frame.plane_count + (frame.has_mask ? 1u : 0u);
+  if (count == 0) {
+    return nullptr;
+  }
+  const uint32_t* slot = slots.data() + frame.slot_index;
+  for (size_t i = 1; i < count; i++) {
+    if (slot[i] != slot[0] + i * frame.plane_size) {
+      return nullptr;
+    }
+  }
+  return store->data(slot[0]);
+}
+
+uint32_t PlaneStore::intern(const uint8_t* data, size_t size) {
+  uint32_t key = crc32(data, size, false);
+  auto range = index_.equal_range(key);
+  refs_++;
+  ref_bytes_ += size;
+  for (auto it = range.first; it != range.second; ++it) {
+    const Entry& entry = it->second;
+    if (entry.size == size &&
+        std::equal(data, data + size, arena_.data() + entry.offset)) {
+      return entry.offset;
+    }
+  }
+  // Planes of a frame are interned in order, so a frame with no shared
+  // planes keeps them back to back.
+  size_t offset = (arena_.size() + 7) & ~size_t{7};
+  arena_.resize(offset + size);
+  std::copy_n(data, size, arena_.begin() + offset);
+  index_.emplace(key, Entry{static_cast<uint32_t>(offset),
+                            static_cast<uint32_t>(size)});
+  planes_++;
+  return static_cast<uint32_t>(offset);
+}
+
+void PlaneStore::tally_memory(HeapTally* tally) const {
+  tally->add(arena_);
+  if (!index_.empty()) {
+    tally->add_block(index_.bucket_count() * sizeof(void*));
+  }
+  for (size_t i = 0; i < index_.size(); i++) {
+    tally->add_block(sizeof(decltype(index_)::value_type) +
+                     2 * sizeof(void*));
+  }
+}
+
+void PlaneStore::seal() {
+  arena_.shrink_to_fit();
+  decltype(index_)(index_.get_allocator()).swap(index_);
+}
+
+// Moves the planes and mask of a frame decoded into the arena to the plane
+// store, leaving only its markers.
+static void share_frame(PlaneStore* store, FrameSeq* seq,
+                        AnimationFrame* frame) {
+  const uint8_t* block = seq->arena.data() + frame->data_offset;
+  size_t count = frame->plane_count + (frame->has_mask ? 1u : 0u);
+  frame->slot_index = static_cast<uint32_t>(seq->slots.size());
+  for (size_t i = 0; i < count; i++) {
+    seq->slots.push_back(
+        store->intern(block + i * frame->plane_size, frame->plane_size));
+  }
+  std::copy_n(seq->arena.begin() + frame->data_offset + count *
+                                                         frame->plane_size,
+              frame->plane_count, seq->arena.begin() + frame->data_offset);
+  seq->arena.resize(frame->data_offset + frame->plane_count);
+}
+
+// At most one in kSparseMaxDensity words of a sparse frame are non-zero.
+constexpr size_t kSparseMaxDensity = 4;
+
+// Rewrites a frame decoded into the arena as a sparse frame if few enough
+// of its words are set.
+static bool make_sparse(FrameSeq* seq, AnimationFrame* frame,
+                        std::vector<uint8_t>* scratch) {
+  size_t count = frame->plane_count + (frame->has_mask ? 1u : 0u);
+  size_t size = frame->plane_size;
+  if (count == 0 || size == 0) {
+    return false;
+  }
+  const uint8_t* block = seq->arena.data() + frame->data_offset;
+  size_t nonzero = 0;
+  for (size_t i = 0; i < count; i++) {
+    nonzero += count_nonzero_words(block + i * size, size);
+  }
+  if (nonzero * kSparseMaxDensity > count * ((size + 7) / 8)) {
+    return false;
+  }
+  const uint8_t* markers = block + count * size;
+  scratch->assign(markers, markers + frame->plane_count);
+  for (size_t i = 0; i < count; i++) {
+    append_sparse(*scratch, block + i * size, size);
+  }
+  seq->arena.resize(frame->data_offset + scratch->size());
+  std::copy(scratch->begin(), scratch->end(),
+            seq->arena.begin() + frame->data_offset);
+  frame->sparse = true;
+  return true;
+}
+
+// Moves a frame just decoded into the arena to its final representation.
+static void store_frame(VniFile* vni, PlaneStore* store, bool overlay,
+                        FrameSeq* seq, AnimationFrame* frame,
+                        std::vector<uint8_t>* scratch) {
+  size_t dense = frame->block_size();
+  if (overlay && make_sparse(seq, frame, scratch)) {
+    vni->sparse_frames++;
+    vni->sparse_bytes_saved +=
+        dense - (seq->arena.size() - frame->data_offset);
+  } else if (store) {
+    share_frame(store, seq, frame);
+  }
+}
+
+void FrameSeq::add_frame(AnimationFrame frame,
+                         const std::vector<std::vector<uint8_t>>& planes,
+                         const std::vector<uint8_t>& markers,
+                         const std::vector<uint8_t>& mask) {
+  frame.plane_count = static_cast<uint8_t>(planes.size());
+  frame.plane_size = static_cast<uint16_t>(
+      planes.empty() ? mask.size() : planes[0].size());
+  frame.has_mask = !mask.empty();
+  size_t slots = planes.size() + (frame.has_mask ? 1 : 0);
+  frame.data_offset = allocate(slots * frame.plane_size + planes.size());
+  uint8_t* out = arena.data() + frame.data_offset;
+  for (const auto& plane : planes) {
+    std::copy_n(plane.begin(), std::min(plane.size(), size_t{frame.plane_size}),
+                out);
+    out += frame.plane_size;
+  }
+  if (frame.has_mask) {
+    std::copy_n(mask.begin(), std::min(mask.size(), size_t{frame.plane_size}),
+                out);
+    out += frame.plane_size;
+  }
+  for (size_t i = 0; i < planes.size(); i++) {
+    out[i] = i < markers.size() ? markers[i] : static_cast<uint8_t>(i);
+  }
+  frames.push_back(frame);
+}
+
+void FrameSeq::add_mask(const std::vector<uint8_t>& mask) {
+  ArenaSpan span;
+  span.size = static_cast<uint32_t>(mask.size());
+  span.offset = allocate(mask.size());
+  std::copy(mask.begin(), mask.end(), arena.begin() + span.offset);
+  masks.push_back(span);
+}
 
-static bool read_pal_file(std::istream& in, PalFile* pal) {
+bool read_pal_file(std::istream& in, PalFile* pal) {
   pal->version = static_cast<uint8_t>(in.get());
   if (!in.good()) {
     return false;
@@ -250,8 +881,146 @@ static bool read_pal_file(std::istream& in, PalFile* pal) {
   return true;
 }
 
-static bool read_vni_frame_seq(std::istream& in, int file_version,
-                               FrameSeq* seq) {
+// Reads the bit_length entries of a frame into block, which has room for
+// bit_length * (plane_size + 1) bytes, and lays them out as described at
+// AnimationFrame. Sets plane_count and has_mask of frame.
+template <typename Source>
+static bool read_frame_block(Source& reader, AnimationFrame* frame,
+                             uint8_t* block, LoadProfile* profile) {
+  const size_t plane_size = frame->plane_size;
+  size_t last = frame->bit_length > 0 ? frame->bit_length - 1 : 0;
+  // The mask is read into the last slot and ends up right behind the planes.
+  uint8_t* mask_slot = block + last * plane_size;
+  uint8_t markers[256];
+  frame->plane_count = 0;
+  frame->has_mask = false;
+  for (uint8_t p = 0; p < frame->bit_length; p++) {
+    int marker = reader.get();
+    if (marker == std::char_traits<char>::eof()) {
+      return false;
+    }
+    uint8_t* dest = mask_slot;
+    if (marker == kMaskMarker) {
+      frame->has_mask = true;
+    } else {
+      markers[frame->plane_count] = static_cast<uint8_t>(marker);
+      dest = block + frame->plane_count * plane_size;
+      frame->plane_count++;
+    }
+    if (!reader.read(dest, plane_size)) {
+      return false;
+    }
+  }
+  uint8_t* tail = block + frame->plane_count * plane_size;
+  if (frame->has_mask) {
+    // More than one mask entry leaves a gap between planes and mask.
+    if (tail != mask_slot) {
+      std::copy_n(mask_slot, plane_size, tail);
+    }
+    tail += plane_size;
+  }
+  {
+    PhaseTimer timer(phase(profile, &LoadProfile::reverse_ns));
+    reverse_bytes(block, static_cast<size_t>(tail - block));
+  }
+  std::copy_n(markers, frame->plane_count, tail);
+  return true;
+}
+
+static bool decode_frame_block(const uint8_t* data, size_t len,
+                               AnimationFrame* frame,
+                               std::vector<uint8_t>* scratch, uint8_t* block,
+                               LoadProfile* profile) {
+  {
+    PhaseTimer timer(phase(profile, &LoadProfile::decompress_ns));
+    if (!heatshrink_decompress(data, len, kHeatshrinkWindow,
+                               kHeatshrinkLookahead, scratch)) {
+      return false;
+    }
+  }
+  if (profile) {
+    profile->sequences.back().decompressed_bytes += scratch->size();
+  }
+  MemorySource reader(scratch->data(), scratch->size());
+  return read_frame_block(reader, frame, block, profile);
+}
+
+void FrameCache::tally_memory(HeapTally* tally) const {
+  // List nodes hold two pointers besides the entry, hash nodes a next
+  // pointer and the cached hash.
+  for (const auto& entry : lru_) {
+    tally->add_block(sizeof(Entry) + 2 * sizeof(void*));
+    tally->add(entry.block);
+  }
+  if (!index_.empty()) {
+    tally->add_block(index_.bucket_count() * sizeof(void*));
+  }
+  for (size_t i = 0; i < index_.size(); i++) {
+    tally->add_block(sizeof(decltype(index_)::value_type) +
+                     2 * sizeof(void*));
+  }
+  tally->add(scratch_);
+  tally->add(spare_);
+}
+
+void FrameCache::set_budget(size_t bytes) {
+  budget_ = bytes;
+  evict(lru_.empty() ? 0 : 1);
+}
+
+void FrameCache::evict(size_t keep) {
+  while (bytes_ > budget_ && lru_.size() > keep) {
+    Entry& victim = lru_.back();
+    bytes_ -= victim.block.size();
+    index_.erase(victim.frame);
+    spare_ = std::move(victim.block);
+    lru_.pop_back();
+    evictions_++;
+  }
+}
+
+const uint8_t* FrameCache::get(const FrameSeq& seq,
+                               const AnimationFrame& frame) {
+  auto it = index_.find(&frame);
+  if (it != index_.end()) {
+    hits_++;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return lru_.front().block.data();
+  }
+  misses_++;
+  // Reuse the buffer of the last evicted frame, blocks of one project are
+  // mostly the same size.
+  HookVector<uint8_t> block = std::move(spare_);
+  block.resize(static_cast<size_t>(frame.bit_length) *
+               (frame.plane_size + 1));
+  AnimationFrame decoded = frame;
+  if (!decode_frame_block(seq.arena.data() + frame.data_offset,
+                          frame.stored_size, &decoded, &scratch_, block.data(),
+                          nullptr)) {
+    // Validated at load, so this only happens on memory corruption.
+    std::fill(block.begin(), block.end(), 0);
+  }
+  block.resize(frame.block_size());
+  bytes_ += block.size();
+  lru_.push_front(Entry{&frame, std::move(block)});
+  index_.emplace(&frame, lru_.begin());
+  evict(1);
+  return lru_.front().block.data();
+}
+
+// Reads a sequence of vni. Its frames are interned into the plane store of
+// vni if share is set, or stored sparse where possible if overlay is set.
+static bool read_vni_frame_seq(std::istream& in, VniFile* vni,
+                               const VniReadOptions& options, bool share,
+                               bool overlay, FrameSeq* seq) {
+  const int file_version = vni->version;
+  PlaneStore* store = share ? vni->plane_store.get() : nullptr;
+  LoadProfile* profile = options.profile;
+  SequenceLoadProfile* seq_profile =
+      profile ? &profile->sequences.back() : nullptr;
+  seq->store = store;
+  std::optional<PhaseTimer> header_timer;
+  header_timer.emplace(phase(profile, &LoadProfile::header_ns));
   uint16_t name_len = read_u16_be(in);
   if (name_len > 0) {
     auto name_bytes = read_bytes(in, name_len);
@@ -261,68 +1030,118 @@ static bool read_vni_frame_seq(std::istream& in, int file_version,
     seq->name = "<undefined>";
   }
 
-  read_u16_be(in);  // cycles
-  read_u16_be(in);  // hold cycles
-  read_u16_be(in);  // clock from
-  in.get();         // clock small
-  in.get();         // clock in front
-  read_u16_be(in);  // clock offset x
-  read_u16_be(in);  // clock offset y
-  read_u16_be(in);  // refresh delay
-  in.get();         // type
-  in.get();         // fsk
+  // The header fields from cycles on, in the layout of the current version,
+  // see FrameSeq::header.
+  HookVector<uint8_t>* header = options.keep_header ? &seq->header : nullptr;
+  auto keep = [header](uint32_t value, int bytes) {
+    for (int shift = (bytes - 1) * 8; header && shift >= 0; shift -= 8) {
+      header->push_back(static_cast<uint8_t>(value >> shift));
+    }
+  };
+  auto keep_bytes = [header](const uint8_t* bytes, size_t len) {
+    if (header) {
+      header->insert(header->end(), bytes, bytes + len);
+    }
+  };
+
+  keep(read_u16_be(in), 2);  // cycles
+  keep(read_u16_be(in), 2);  // hold cycles
+  keep(read_u16_be(in), 2);  // clock from
+  keep(in.get(), 1);         // clock small
+  keep(in.get(), 1);         // clock in front
+  keep(read_u16_be(in), 2);  // clock offset x
+  keep(read_u16_be(in), 2);  // clock offset y
+  keep(read_u16_be(in), 2);  // refresh delay
+  keep(in.get(), 1);         // type
+  keep(in.get(), 1);         // fsk
 
   int num_frames = static_cast<int16_t>(read_u16_be(in));
   if (num_frames < 0) {
     num_frames += 65536;
   }
+  keep(static_cast<uint32_t>(num_frames), 2);
 
   if (file_version >= 2) {
-    read_u16_be(in);
+    keep(read_u16_be(in), 2);  // palette index
     uint16_t num_colors = read_u16_be(in);
+    keep(num_colors, 2);
     if (num_colors > 0) {
-      read_bytes(in, static_cast<size_t>(num_colors) * 3);
+      auto colors = read_bytes(in, static_cast<size_t>(num_colors) * 3);
+      keep_bytes(colors.data(), colors.size());
     }
+  } else {
+    keep(0, 4);
   }
-  if (file_version >= 3) {
-    in.get();  // edit mode
-  }
+  keep(file_version >= 3 ? in.get() : 0, 1);  // edit mode
   if (file_version >= 4) {
     seq->size.width = read_u16_be(in);
     seq->size.height = read_u16_be(in);
   } else {
     seq->size = Dimensions(kDefaultWidth, kDefaultHeight);
   }
+  keep(seq->size.width, 2);
+  keep(seq->size.height, 2);
   if (file_version >= 5) {
     uint16_t num_masks = read_u16_be(in);
+    keep(num_masks, 2);
     seq->masks.clear();
     seq->masks.reserve(num_masks);
     for (uint16_t i = 0; i < num_masks; i++) {
-      in.get();  // locked
-      uint16_t size = read_u16_be(in);
-      auto mask = read_bytes_required(in, size);
-      if (mask.empty()) {
+      keep(in.get(), 1);  // locked
+      ArenaSpan span;
+      span.size = read_u16_be(in);
+      span.offset = seq->allocate(span.size);
+      uint8_t* mask = seq->arena.data() + span.offset;
+      if (span.size == 0 || !StreamSource(in).read(mask, span.size)) {
         return false;
       }
-      for (auto& b : mask) {
-        b = reverse_bits(b);
-      }
-      seq->masks.push_back(std::move(mask));
+      keep(span.size, 2);
+      keep_bytes(mask, span.size);
+      seq->masks.push_back(span);
     }
+  } else {
+    keep(0, 2);
   }
   if (file_version >= 6) {
-    in.get();  // compiled animation
+    keep(in.get(), 1);  // compiled animation
     uint16_t size = read_u16_be(in);
+    keep(size, 2);
     if (size > 0) {
-      read_bytes(in, size);
+      auto compiled = read_bytes(in, size);
+      keep_bytes(compiled.data(), compiled.size());
+    }
+    keep(read_u32_be(in), 4);  // start frame
+  } else {
+    keep(0, 1);
+    keep(0, 2);
+    keep(0, 4);
+  }
+  header_timer.reset();
+
+  if (!seq->masks.empty()) {
+    {
+      PhaseTimer timer(phase(profile, &LoadProfile::reverse_ns));
+      for (const ArenaSpan& span : seq->masks) {
+        reverse_bytes(seq->arena.data() + span.offset, span.size);
+      }
+    }
+    if (store) {
+      // The masks are the only thing in the arena so far.
+      PhaseTimer timer(phase(profile, &LoadProfile::store_ns));
+      for (ArenaSpan& span : seq->masks) {
+        span.offset = store->intern(seq->arena.data() + span.offset, span.size);
+      }
+      seq->arena.clear();
     }
-    read_u32_be(in);  // start frame
   }
 
   seq->frames.clear();
   seq->frames.reserve(num_frames);
   seq->animation_duration = 0;
 
+  std::vector<uint8_t> compressed_bytes;
+  std::vector<uint8_t> decompressed;
+  std::vector<uint8_t> scratch;
   for (int i = 0; i < num_frames; i++) {
     AnimationFrame frame;
     frame.time = seq->animation_duration;
@@ -332,148 +1151,293 @@ static bool read_vni_frame_seq(std::istream& in, int file_version,
       frame.hash = read_u32_be(in);
     }
     frame.bit_length = static_cast<uint8_t>(in.get());
+    if (frame.bit_length == 0) {
+      plane_size = 0;
+    } else if (plane_size <= 0) {
+      return false;
+    }
+    frame.plane_size = static_cast<uint16_t>(plane_size);
 
     bool compressed = false;
     if (file_version >= 3) {
       compressed = in.get() != 0;
     }
 
-    auto read_planes = [&](std::istream& reader) -> bool {
-      frame.planes.clear();
-      frame.planes.reserve(frame.bit_length);
-      for (uint8_t p = 0; p < frame.bit_length; p++) {
-        int marker = reader.get();
-        if (marker == std::char_traits<char>::eof()) {
-          return false;
-        }
-        if (marker == 0x6d) {
-          frame.mask = read_bytes_required(reader, plane_size);
-          if (frame.mask.empty()) {
-            return false;
-          }
-          for (auto& b : frame.mask) {
-            b = reverse_bits(b);
-          }
-        } else {
-          AnimationPlane plane;
-          plane.marker = static_cast<uint8_t>(marker);
-          plane.plane = read_bytes_required(reader, plane_size);
-          if (plane.plane.empty()) {
-            return false;
-          }
-          for (auto& b : plane.plane) {
-            b = reverse_bits(b);
-          }
-          frame.planes.push_back(std::move(plane));
-        }
-      }
-      return true;
-    };
-
+    // Room for every entry as a plane plus the markers, the unused tail is
+    // trimmed once the layout is known.
+    size_t max_block = static_cast<size_t>(frame.bit_length) *
+                       (frame.plane_size + 1);
     if (!compressed) {
-      if (!read_planes(in)) {
+      frame.data_offset = seq->allocate(max_block);
+      StreamSource reader(in);
+      if (!read_frame_block(reader, &frame,
+                            seq->arena.data() + frame.data_offset, profile)) {
         return false;
       }
+      if (seq_profile) {
+        seq_profile->compressed_bytes += max_block;
+        seq_profile->decompressed_bytes += max_block;
+      }
+      seq->arena.resize(frame.data_offset + frame.block_size());
+      PhaseTimer timer(phase(profile, &LoadProfile::store_ns));
+      store_frame(vni, store, overlay, seq, &frame, &scratch);
     } else {
       uint32_t compressed_size = read_u32_be(in);
-      auto compressed_bytes = read_bytes_required(in, compressed_size);
-      std::vector<uint8_t> decompressed;
-      if (!heatshrink_decompress(compressed_bytes.data(),
-                                 compressed_bytes.size(), 10, 5,
-                                 &decompressed)) {
+      compressed_bytes.resize(compressed_size);
+      if (!StreamSource(in).read(compressed_bytes.data(), compressed_size)) {
         return false;
       }
-      std::stringstream reader(std::string(
-          reinterpret_cast<char*>(decompressed.data()), decompressed.size()));
-      if (!read_planes(reader)) {
-        return false;
+      if (seq_profile) {
+        seq_profile->compressed_bytes += compressed_size;
+        seq_profile->compressed_frames++;
+      }
+      if (options.keep_compressed && compressed_size > 0) {
+        // Decode once to validate the frame and learn its layout.
+        scratch.resize(max_block);
+        if (!decode_frame_block(compressed_bytes.data(), compressed_size,
+                                &frame, &decompressed, scratch.data(),
+                                profile)) {
+          return false;
+        }
+        frame.stored_size = compressed_size;
+        frame.data_offset = seq->allocate(compressed_size);
+        std::copy(compressed_bytes.begin(), compressed_bytes.end(),
+                  seq->arena.begin() + frame.data_offset);
+      } else {
+        frame.data_offset = seq->allocate(max_block);
+        if (!decode_frame_block(compressed_bytes.data(), compressed_size,
+                                &frame, &decompressed,
+                                seq->arena.data() + frame.data_offset,
+                                profile)) {
+          return false;
+        }
+        seq->arena.resize(frame.data_offset + frame.block_size());
+        PhaseTimer timer(phase(profile, &LoadProfile::store_ns));
+        store_frame(vni, store, overlay, seq, &frame, &scratch);
       }
     }
-    seq->frames.push_back(std::move(frame));
-    seq->animation_duration += seq->frames.back().delay;
+    seq->frames.push_back(frame);
+    seq->animation_duration += frame.delay;
   }
+  seq->arena.shrink_to_fit();
+  seq->slots.shrink_to_fit();
 
   return true;
 }
 
-static bool read_vni_file(std::istream& in, VniFile* vni) {
-  auto header = read_bytes(in, 4);
-  if (header.size() != 4 ||
-      std::string(reinterpret_cast<char*>(header.data()), 4) != "VPIN") {
+// Whether the sequence offsets of a version 2+ header can be trusted for
+// seeking: ascending, starting right after the header and within the file.
+static bool index_is_valid(std::istream& in,
+                           const std::vector<uint32_t>& index) {
+  if (index.empty()) {
     return false;
   }
-  vni->version = static_cast<uint16_t>(read_u16_be(in));
-  uint16_t num_animations = read_u16_be(in);
-  if (vni->version >= 2) {
+  std::streampos pos = in.tellg();
+  in.seekg(0, std::ios::end);
+  std::streampos end = in.tellg();
+  in.seekg(pos);
+  if (pos < 0 || end < 0 || index.front() != static_cast<uint32_t>(pos)) {
+    return false;
+  }
+  for (size_t i = 1; i < index.size(); i++) {
+    if (index[i] <= index[i - 1]) {
+      return false;
+    }
+  }
+  return index.back() < static_cast<uint64_t>(end);
+}
+
+bool read_vni_file(std::istream& in, VniFile* vni,
+                   const VniReadOptions& options) {
+  LoadProfile* profile = options.profile;
+  PhaseTimer total_timer(phase(profile, &LoadProfile::total_ns));
+  std::optional<PhaseTimer> header_timer;
+  header_timer.emplace(phase(profile, &LoadProfile::header_ns));
+  auto header = read_bytes(in, 4);
+  if (header.size() != 4 ||
+      std::string(reinterpret_cast<char*>(header.data()), 4) != "VPIN") {
+    return false;
+  }
+  vni->version = static_cast<uint16_t>(read_u16_be(in));
+  uint16_t num_animations = read_u16_be(in);
+  std::vector<uint32_t> index;
+  if (vni->version >= 2) {
+    index.reserve(num_animations);
     for (uint16_t i = 0; i < num_animations; i++) {
-      read_u32_be(in);
+      index.push_back(read_u32_be(in));
     }
   }
+  bool seekable = options.prune_unreachable && index_is_valid(in, index);
   vni->animations.clear();
+  vni->keep_compressed = options.keep_compressed;
+  vni->frame_cache_bytes = options.frame_cache_bytes;
+  vni->plane_store.reset();
+  if (options.dedup_planes) {
+    vni->plane_store = std::make_unique<PlaneStore>(options.memory);
+  }
   vni->animations.reserve(num_animations);
+  vni->pruned_sequences = 0;
+  vni->pruned_bytes = 0;
+  vni->sparse_frames = 0;
+  vni->sparse_bytes_saved = 0;
   uint32_t max_w = 0;
   uint32_t max_h = 0;
+  header_timer.reset();
   for (uint16_t i = 0; i < num_animations; i++) {
-    FrameSeq seq;
+    FrameSeq seq(options.memory);
     seq.offset = static_cast<uint32_t>(in.tellg());
-    if (!read_vni_frame_seq(in, vni->version, &seq)) {
+    SequenceLoadProfile* seq_profile = nullptr;
+    if (profile) {
+      profile->sequences.emplace_back();
+      seq_profile = &profile->sequences.back();
+      seq_profile->offset = seq.offset;
+    }
+    PhaseTimer seq_timer(seq_profile ? &seq_profile->load_ns : nullptr);
+    bool reachable =
+        !options.prune_unreachable ||
+        std::binary_search(options.reachable.begin(), options.reachable.end(),
+                           seq.offset);
+    bool overlay = std::binary_search(options.overlays.begin(),
+                                      options.overlays.end(), seq.offset);
+    if (!reachable && seekable) {
+      // The index gives where the next sequence starts, the last one runs
+      // to the end of the file.
+      in.seekg(0, std::ios::end);
+      uint32_t end = i + 1 < num_animations
+                         ? index[i + 1]
+                         : static_cast<uint32_t>(in.tellg());
+      in.seekg(end);
+      vni->pruned_sequences++;
+      vni->pruned_bytes += end - seq.offset;
+      if (seq_profile) {
+        seq_profile->file_bytes = end - seq.offset;
+        seq_profile->pruned = true;
+      }
+      continue;
+    }
+    if (!read_vni_frame_seq(in, vni, options, reachable, overlay, &seq)) {
       return false;
     }
+    if (seq_profile) {
+      seq_profile->file_bytes =
+          static_cast<uint32_t>(in.tellg()) - seq.offset;
+      seq_profile->pruned = !reachable;
+    }
+    if (!reachable) {
+      // Without an index the sequence has to be parsed to find its end.
+      vni->pruned_sequences++;
+      vni->pruned_bytes += static_cast<uint32_t>(in.tellg()) - seq.offset;
+      continue;
+    }
     max_w = std::max(max_w, seq.size.width);
     max_h = std::max(max_h, seq.size.height);
     vni->animations.push_back(std::move(seq));
   }
   vni->dimensions = Dimensions(max_w, max_h);
+  if (vni->plane_store) {
+    vni->plane_store->seal();
+  }
   return true;
 }
 
-static FrameSeq* find_animation(VniFile* vni, uint32_t offset) {
-  if (!vni) {
-    return nullptr;
-  }
-  for (auto& seq : vni->animations) {
-    if (seq.offset == offset) {
-      return &seq;
+static SequenceState* find_sequence(Context* ctx, uint32_t offset) {
+  for (auto& state : ctx->sequences) {
+    if (state.seq->offset == offset) {
+      return &state;
     }
   }
   return nullptr;
 }
 
-static Mapping* find_mapping(PalFile* pal, const std::vector<uint8_t>& plane,
-                             bool reverse, uint32_t* no_mask_crc) {
+// Starts a new input plane for mask_checksum().
+static void next_mask_plane(Context* ctx) {
+  if (++ctx->mask_epoch == 0) {
+    std::fill(ctx->mask_crc_epoch.begin(), ctx->mask_crc_epoch.end(), 0);
+    ctx->mask_epoch = 1;
+  }
+}
+
+static uint32_t mask_checksum(Context* ctx, const std::vector<uint8_t>& plane,
+                              size_t mask, bool reverse) {
+  if (ctx->mask_crc_epoch[mask] != ctx->mask_epoch) {
+    ctx->mask_crc[mask] =
+        checksum_plane_with_mask(plane, ctx->pal->masks[mask], reverse);
+    ctx->mask_crc_epoch[mask] = ctx->mask_epoch;
+    VNI_STATS_INC(ctx, masked_checksums);
+  }
+  return ctx->mask_crc[mask];
+}
+
+static void record_mask_hit(Context* ctx, size_t mask) {
+  uint64_t hits = ++ctx->mask_hits[mask];
+  size_t rank = ctx->mask_rank[mask];
+  while (rank > 0 && ctx->mask_hits[ctx->mask_order[rank - 1]] < hits) {
+    uint16_t other = ctx->mask_order[rank - 1];
+    ctx->mask_order[rank] = other;
+    ctx->mask_rank[other] = static_cast<uint16_t>(rank);
+    rank--;
+  }
+  ctx->mask_order[rank] = static_cast<uint16_t>(mask);
+  ctx->mask_rank[mask] = static_cast<uint16_t>(rank);
+}
+
+static void reset_mask_order(Context* ctx) {
+  size_t count = ctx->pal ? ctx->pal->masks.size() : 0;
+  ctx->mask_crc.assign(count, 0);
+  ctx->mask_crc_epoch.assign(count, 0);
+  ctx->mask_epoch = 0;
+  ctx->mask_order.resize(count);
+  ctx->mask_rank.resize(count);
+  for (size_t i = 0; i < count; i++) {
+    ctx->mask_order[i] = static_cast<uint16_t>(i);
+    ctx->mask_rank[i] = static_cast<uint16_t>(i);
+  }
+  ctx->mask_hits.assign(count, 0);
+}
+
+// The first mask in file order whose checksum has a mapping wins. Probing
+// hot masks first can't save work here: a hit on mask k still needs masks
+// 0..k-1 to miss, and a miss needs all of them.
+static const Mapping* find_mapping(Context* ctx,
+                                   const std::vector<uint8_t>& plane,
+                                   bool reverse, uint32_t* no_mask_crc) {
+  const PalFile* pal = ctx->pal.get();
   if (!pal) {
     return nullptr;
   }
+  VNI_SPAN(ctx, FindMapping);
+  VNI_STATS_INC(ctx, mapping_lookups);
   uint32_t checksum = checksum_plane(plane, reverse);
   if (no_mask_crc) {
     *no_mask_crc = checksum;
   }
   auto it = pal->mappings.find(checksum);
   if (it != pal->mappings.end()) {
+    VNI_STATS_INC(ctx, mapping_hits);
     return &it->second;
   }
-  if (pal->masks.empty()) {
-    return nullptr;
-  }
-  for (const auto& mask : pal->masks) {
-    checksum = checksum_plane_with_mask(plane, mask, reverse);
-    it = pal->mappings.find(checksum);
+  for (size_t k = 0; k < pal->masks.size(); k++) {
+    it = pal->mappings.find(mask_checksum(ctx, plane, k, reverse));
     if (it != pal->mappings.end()) {
+      VNI_STATS_INC(ctx, mapping_hits);
+      record_mask_hit(ctx, k);
       return &it->second;
     }
   }
+  VNI_STATS_INC(ctx, mapping_misses);
   return nullptr;
 }
 
 static std::vector<std::vector<uint8_t>> render_color_mask(
-    const FrameSeq& seq, const std::vector<std::vector<uint8_t>>& vpm_frame,
-    uint32_t frame_index) {
+    const SequenceState& state,
+    const std::vector<std::vector<uint8_t>>& vpm_frame, uint32_t frame_index) {
+  const FrameSeq& seq = *state.seq;
   std::vector<std::vector<uint8_t>> out;
   if (seq.frames.empty()) {
     return out;
   }
   const auto& frame = seq.frames[frame_index];
-  size_t frame_count = frame.planes.size();
+  size_t frame_count = frame.plane_count;
   out.resize(frame_count);
   if (frame_count < 4) {
     return vpm_frame;
@@ -483,252 +1447,519 @@ static std::vector<std::vector<uint8_t>> render_color_mask(
       out[i] = vpm_frame[i];
     }
     for (size_t i = vpm_frame.size() - 2; i < frame_count; i++) {
-      out[i] = frame.planes[i].plane;
+      const uint8_t* plane = state.plane(frame, i);
+      out[i].assign(plane, plane + frame.plane_size);
     }
   } else {
     for (size_t i = 0; i < vpm_frame.size(); i++) {
       out[i] = vpm_frame[i];
     }
     for (size_t i = vpm_frame.size(); i < frame_count; i++) {
-      out[i] = frame.planes[i].plane;
+      const uint8_t* plane = state.plane(frame, i);
+      out[i].assign(plane, plane + frame.plane_size);
     }
   }
   return out;
 }
 
-static std::vector<std::vector<uint8_t>> render_lcm(
-    FrameSeq& seq, const Dimensions& dim,
-    std::vector<std::vector<uint8_t>> planes, ScalerMode scaler_mode) {
-  size_t num_planes = seq.lcm_buffer_planes.size();
-  std::vector<std::vector<uint8_t>> outplanes(num_planes);
+// Sets the layout once the buffer is allocated, reserve() leaves it
+// unchanged when it throws, so a bad_alloc keeps the two consistent.
+static void start_lcm(SequenceState& state) {
+  const FrameSeq& seq = *state.seq;
+  size_t planes = seq.frames.empty() ? 0 : seq.frames[0].plane_count;
+  size_t plane_size = seq.size.surface() / 8;
+  size_t stride_words = (plane_size + 7) / 8;
+  size_t buffers = planes;
+  if (state.switch_mode == SwitchMode::MaskedReplace) {
+    buffers++;
+  }
+  state.lcm_buffer.reserve(stride_words * buffers);
+  state.lcm_buffer.assign(stride_words * buffers, 0);
+  state.lcm_planes = planes;
+  state.lcm_plane_size = plane_size;
+  state.lcm_stride = stride_words * 8;
+}
 
-  if (seq.switch_mode == SwitchMode::LayeredColorMask) {
-    for (size_t i = 0; i < planes.size() && i < num_planes; i++) {
-      outplanes[i] = planes[i];
-    }
-    for (size_t i = planes.size(); i < num_planes; i++) {
-      outplanes[i] = seq.lcm_buffer_planes[i];
-    }
-    return outplanes;
+static void start_replace(SequenceState& state, int64_t now) {
+  state.last_tick = now;
+  state.timer = 0;
+}
+
+static void start_enhance(SequenceState& state, int64_t now) {
+  state.last_tick = now;
+  state.timer = 0;
+}
+
+static void initialize_frame(SequenceState& state) {
+  const FrameSeq& seq = *state.seq;
+  if (state.frame_index < seq.frames.size()) {
+    state.timer += static_cast<int64_t>(seq.frames[state.frame_index].delay);
   }
+}
 
-  if (seq.switch_mode == SwitchMode::MaskedReplace) {
-    if (!planes.empty() &&
-        seq.lcm_buffer_planes[0].size() == planes[0].size() * 4) {
-      auto indexed = join_planes(planes, dim);
-      Dimensions scaled(dim.width * 2, dim.height * 2);
-      auto scaled_data = (scaler_mode == ScalerMode::Scale2x)
-                             ? scale2x_indexed(indexed, dim)
-                             : scale_double_indexed(indexed, dim);
-      planes = split_planes(scaled_data.data(), scaled.width, scaled.height,
-                            static_cast<uint8_t>(planes.size()));
+static std::vector<std::vector<uint8_t>> frame_planes(
+    const SequenceState& state, const AnimationFrame& frame) {
+  std::vector<std::vector<uint8_t>> planes;
+  planes.reserve(frame.plane_count);
+  for (size_t i = 0; i < frame.plane_count; i++) {
+    const uint8_t* plane = state.plane(frame, i);
+    planes.emplace_back(plane, plane + frame.plane_size);
+  }
+  return planes;
+}
+
+static Dimensions output_dimensions(size_t plane_size, const Dimensions& dim) {
+  if (plane_size == dim.surface() / 2) {
+    return Dimensions(dim.width * 2, dim.height * 2);
+  }
+  return dim;
+}
+
+// Replace frames don't depend on the input, so with a replace cache they
+// are joined once and later outputs just point at the joined pixels.
+static bool output_cached_replace(Context* ctx, SequenceState& state,
+                                  const Dimensions& dim) {
+  const FrameSeq& seq = *state.seq;
+  if (ctx->replace_cache_limit == 0 || state.frame_index >= seq.frames.size()) {
+    return false;
+  }
+  const auto& frame = seq.frames[state.frame_index];
+  Dimensions out_dim = output_dimensions(
+      frame.plane_count > 0 ? frame.plane_size : 0, dim);
+  size_t surface = out_dim.surface();
+  if (state.joined.empty()) {
+    size_t bytes = seq.frames.size() * surface;
+    if (ctx->replace_cache_bytes + bytes > ctx->replace_cache_limit) {
+      return false;
     }
-    for (size_t i = 0; i < num_planes; i++) {
-      if (i < planes.size()) {
-        outplanes[i] = combine_plane_with_mask(seq.lcm_buffer_planes[i],
-                                               planes[i], seq.replace_mask);
-      } else {
-        outplanes[i] = seq.lcm_buffer_planes[i];
-      }
+    try {
+      state.joined.resize(bytes);
+    } catch (const std::bad_alloc&) {
+      // Over the memory budget, the cache is optional.
+      return false;
     }
-    return outplanes;
+    state.joined_ready.assign(seq.frames.size(), false);
+    state.joined_dim = out_dim;
+    ctx->replace_cache_bytes += bytes;
+  } else if (state.joined_dim.width != out_dim.width ||
+             state.joined_dim.height != out_dim.height) {
+    return false;
   }
 
-  return planes;
+  uint8_t* pixels = state.joined.data() + state.frame_index * surface;
+  if (state.joined_ready[state.frame_index]) {
+    VNI_STATS_INC(ctx, replace_cache_hits);
+  } else {
+    VNI_STATS_STAGE(ctx, join);
+    VNI_SPAN(ctx, Join);
+    join_planes_to(frame_planes(state, frame), out_dim, pixels);
+    state.joined_ready[state.frame_index] = true;
+  }
+  ctx->output.shared = pixels;
+  ctx->output.shared_planes = nullptr;
+  ctx->output.dimensions = out_dim;
+  ctx->output.bitlen = frame.plane_count;
+  ctx->output.has_frame = true;
+  return true;
 }
 
-static void start_lcm(FrameSeq& seq) {
-  seq.lcm_buffer_planes.clear();
-  if (seq.frames.empty()) {
-    return;
+// Copies output that points into project data into the output buffers, so
+// that data can be released.
+static void detach_output(Context* ctx) {
+  OutputFrame& output = ctx->output;
+  if (output.shared) {
+    output.data.assign(output.shared,
+                       output.shared + output.dimensions.surface());
+    output.shared = nullptr;
+  }
+  if (output.shared_planes) {
+    output.planes.assign(
+        output.shared_planes,
+        output.shared_planes + output.bitlen * output.plane_size);
+    output.shared_planes = nullptr;
   }
-  size_t plane_count = seq.frames[0].planes.size();
-  for (size_t i = 0; i < plane_count; i++) {
-    seq.lcm_buffer_planes.emplace_back(
-        FrameUtil::Helper::NewPlane(static_cast<uint16_t>(seq.size.width),
-                                    static_cast<uint16_t>(seq.size.height)));
+}
+
+// Stores the final planes of a frame in the output format of the context.
+static void store_output(Context* ctx,
+                         const std::vector<std::vector<uint8_t>>& planes,
+                         const Dimensions& out_dim) {
+  OutputFrame& output = ctx->output;
+  {
+    VNI_STATS_STAGE(ctx, join);
+    VNI_SPAN(ctx, Join);
+    if (ctx->output_mode == OutputMode::Bitplanes) {
+      size_t plane_size = out_dim.surface() / 8;
+      output.planes.assign(planes.size() * plane_size, 0);
+      for (size_t i = 0; i < planes.size(); i++) {
+        std::copy_n(planes[i].begin(), std::min(planes[i].size(), plane_size),
+                    output.planes.begin() + i * plane_size);
+      }
+      output.plane_size = plane_size;
+    } else {
+      output.data.resize(out_dim.surface());
+      join_planes_to(planes, out_dim, output.data.data());
+    }
   }
-  for (auto& plane : seq.lcm_buffer_planes) {
-    clear_plane(plane);
+  output.shared = nullptr;
+  output.shared_planes = nullptr;
+  output.dimensions = out_dim;
+  output.bitlen = static_cast<uint8_t>(planes.size());
+  output.has_frame = true;
+}
+
+// In bitplane mode a Replace frame is output straight from its stored
+// planes, which already have the output layout.
+static bool output_stored_planes(Context* ctx, const SequenceState& state,
+                                 const Dimensions& dim) {
+  const FrameSeq& seq = *state.seq;
+  if (ctx->output_mode != OutputMode::Bitplanes ||
+      state.frame_index >= seq.frames.size()) {
+    return false;
   }
-  if (seq.switch_mode == SwitchMode::MaskedReplace) {
-    seq.replace_mask =
-        FrameUtil::Helper::NewPlane(static_cast<uint16_t>(seq.size.width),
-                                    static_cast<uint16_t>(seq.size.height));
+  const auto& frame = seq.frames[state.frame_index];
+  Dimensions out_dim = output_dimensions(
+      frame.plane_count > 0 ? frame.plane_size : 0, dim);
+  if (frame.plane_size != out_dim.surface() / 8) {
+    return false;
   }
+  const uint8_t* planes = state.planes(frame);
+  if (!planes) {
+    return false;
+  }
+  ctx->output.shared = nullptr;
+  ctx->output.shared_planes = planes;
+  ctx->output.plane_size = frame.plane_size;
+  ctx->output.dimensions = out_dim;
+  ctx->output.bitlen = frame.plane_count;
+  ctx->output.has_frame = true;
+  return true;
 }
 
-static void start_replace(FrameSeq& seq) {
-  seq.last_tick = now_ms();
-  seq.timer = 0;
+// Finishes an output whose planes were written to output.planes at a
+// stride of out_dim.surface() / 8.
+static void finish_output_planes(Context* ctx, uint8_t bitlen,
+                                 const Dimensions& out_dim) {
+  OutputFrame& output = ctx->output;
+  if (ctx->output_mode == OutputMode::Indexed) {
+    VNI_STATS_STAGE(ctx, join);
+    VNI_SPAN(ctx, Join);
+    output.data.assign(out_dim.surface(), 0);
+    if (bitlen > 0) {
+      FrameUtil::Helper::Join(output.data.data(),
+                              static_cast<uint16_t>(out_dim.width),
+                              static_cast<uint16_t>(out_dim.height), bitlen,
+                              output.planes.data());
+    }
+  }
+  output.plane_size = out_dim.surface() / 8;
+  output.shared = nullptr;
+  output.shared_planes = nullptr;
+  output.dimensions = out_dim;
+  output.bitlen = bitlen;
+  output.has_frame = true;
 }
 
-static void start_enhance(FrameSeq& seq) {
-  seq.last_tick = now_ms();
-  seq.timer = 0;
+// Composes LayeredColorMask and MaskedReplace frames from the input planes
+// and the LCM buffers straight into the output planes.
+static void compose_lcm(Context* ctx, SequenceState& state,
+                        const Dimensions& dim,
+                        const std::vector<std::vector<uint8_t>>& input) {
+  bool masked = state.switch_mode == SwitchMode::MaskedReplace;
+  bool scale = masked && !input.empty() &&
+               state.lcm_plane_size == input[0].size() * 4;
+  if (scale) {
+    VNI_SPAN(ctx, Scale);
+    scale_planes(input, dim, ctx->scaler_mode == ScalerMode::Scale2x,
+                 &ctx->scaled_planes);
+  }
+  const auto& planes = scale ? ctx->scaled_planes : input;
+
+  size_t count = state.lcm_planes;
+  size_t first_size = state.lcm_plane_size;
+  if (count == 0) {
+    first_size = 0;
+  } else if (!planes.empty()) {
+    first_size = masked ? std::min(first_size, planes[0].size())
+                        : planes[0].size();
+  }
+  Dimensions out_dim = output_dimensions(first_size, dim);
+  size_t stride = out_dim.surface() / 8;
+  OutputFrame& output = ctx->output;
+  output.planes.resize(count * stride);
+  for (size_t i = 0; i < count; i++) {
+    uint8_t* out = output.planes.data() + i * stride;
+    if (i >= planes.size()) {
+      copy_words(out, stride, state.lcm_plane(i), state.lcm_plane_size);
+    } else if (!masked) {
+      copy_words(out, stride, planes[i].data(), planes[i].size());
+    } else {
+      size_t size = std::min({state.lcm_plane_size, planes[i].size(), stride});
+      combine_words(out, state.lcm_plane(i), planes[i].data(), state.lcm_mask(),
+                    size);
+      std::memset(out + size, 0, stride - size);
+    }
+  }
+  finish_output_planes(ctx, static_cast<uint8_t>(count), out_dim);
 }
 
-static void initialize_frame(FrameSeq& seq) {
-  if (seq.frame_index < seq.frames.size()) {
-    seq.timer += static_cast<int64_t>(seq.frames[seq.frame_index].delay);
+static void clear_replace_cache(Context* ctx) {
+  // Keep the current output valid, it may point into the freed cache.
+  detach_output(ctx);
+  if (ctx->vni) {
+    for (auto& state : ctx->sequences) {
+      state.joined.clear();
+      state.joined.shrink_to_fit();
+      state.joined_ready.clear();
+      state.joined_ready.shrink_to_fit();
+    }
   }
+  ctx->replace_cache_bytes = 0;
 }
 
-static void output_frame(Context* ctx, FrameSeq& seq, const Dimensions& dim,
+static void output_frame(Context* ctx, SequenceState& state,
+                         const Dimensions& dim,
                          const std::vector<std::vector<uint8_t>>& planes) {
+  const FrameSeq& seq = *state.seq;
   std::vector<std::vector<uint8_t>> outplanes;
-  switch (seq.switch_mode) {
+  switch (state.switch_mode) {
     case SwitchMode::ColorMask:
     case SwitchMode::Follow:
-      outplanes = render_color_mask(seq, planes, seq.frame_index);
+      outplanes = render_color_mask(state, planes, state.frame_index);
       break;
     case SwitchMode::Replace:
     case SwitchMode::FollowReplace:
-      outplanes.clear();
-      if (seq.frame_index < seq.frames.size()) {
-        for (const auto& plane : seq.frames[seq.frame_index].planes) {
-          outplanes.push_back(plane.plane);
-        }
+      if (output_stored_planes(ctx, state, dim) ||
+          output_cached_replace(ctx, state, dim)) {
+        return;
+      }
+      if (state.frame_index < seq.frames.size()) {
+        outplanes = frame_planes(state, seq.frames[state.frame_index]);
       }
       break;
     case SwitchMode::LayeredColorMask:
     case SwitchMode::MaskedReplace:
-      outplanes = render_lcm(seq, dim, planes, ctx->scaler_mode);
-      break;
+      compose_lcm(ctx, state, dim, planes);
+      return;
     default:
       outplanes = planes;
       break;
   }
 
-  Dimensions out_dim = dim;
-  if (!outplanes.empty() && outplanes[0].size() == dim.surface() / 2) {
-    out_dim = Dimensions(dim.width * 2, dim.height * 2);
-  }
-
-  ctx->output.data = join_planes(outplanes, out_dim);
-  ctx->output.dimensions = out_dim;
-  ctx->output.bitlen = static_cast<uint8_t>(outplanes.size());
-  ctx->output.has_frame = true;
+  Dimensions out_dim =
+      output_dimensions(outplanes.empty() ? 0 : outplanes[0].size(), dim);
+  store_output(ctx, outplanes, out_dim);
 }
 
-static void render_animation(Context* ctx, FrameSeq& seq, const Dimensions& dim,
+static void render_animation(Context* ctx, SequenceState& state,
+                             const Dimensions& dim,
                              const std::vector<std::vector<uint8_t>>& planes) {
-  if (seq.switch_mode == SwitchMode::ColorMask ||
-      seq.switch_mode == SwitchMode::Replace) {
-    int64_t delay = now_ms() - seq.last_tick;
-    seq.last_tick = now_ms();
-    seq.timer -= delay;
-    if (seq.timer > 0) {
-      if (seq.frame_index > 0) {
-        seq.frame_index--;
-      }
-      output_frame(ctx, seq, dim, planes);
-      seq.frame_index++;
+  const FrameSeq& seq = *state.seq;
+  VNI_SPAN(ctx, RenderAnimation);
+  if (state.switch_mode == SwitchMode::ColorMask ||
+      state.switch_mode == SwitchMode::Replace) {
+    int64_t now = ctx->now();
+    int64_t delay = now - state.last_tick;
+    state.last_tick = now;
+    state.timer -= delay;
+    if (state.timer > 0) {
+      if (state.frame_index > 0) {
+        state.frame_index--;
+      }
+      output_frame(ctx, state, dim, planes);
+      state.frame_index++;
       return;
     }
   }
 
-  if (seq.frame_index < seq.frames.size()) {
-    if (seq.switch_mode == SwitchMode::LayeredColorMask ||
-        seq.switch_mode == SwitchMode::MaskedReplace ||
-        seq.switch_mode == SwitchMode::Follow ||
-        seq.switch_mode == SwitchMode::FollowReplace) {
-      output_frame(ctx, seq, dim, planes);
+  if (state.frame_index < seq.frames.size()) {
+    if (state.switch_mode == SwitchMode::LayeredColorMask ||
+        state.switch_mode == SwitchMode::MaskedReplace ||
+        state.switch_mode == SwitchMode::Follow ||
+        state.switch_mode == SwitchMode::FollowReplace) {
+      output_frame(ctx, state, dim, planes);
       return;
     }
 
-    initialize_frame(seq);
-    output_frame(ctx, seq, dim, planes);
-    seq.frame_index++;
+    initialize_frame(state);
+    output_frame(ctx, state, dim, planes);
+    state.frame_index++;
     return;
   }
 
-  seq.switch_mode = SwitchMode::Palette;
-  output_frame(ctx, seq, dim, planes);
-  seq.is_running = false;
-  seq.frame_index = 0;
+  state.switch_mode = SwitchMode::Palette;
+  output_frame(ctx, state, dim, planes);
+  state.is_running = false;
+  state.frame_index = 0;
+  VNI_SPAN_INSTANT(ctx, AnimationStop, 0, seq.offset);
 }
 
-static void detect_follow(FrameSeq& seq, const std::vector<uint8_t>& plane,
-                          uint32_t no_mask_crc,
-                          const std::vector<std::vector<uint8_t>>& masks,
-                          bool reverse) {
+// Any mask matching a frame selects it, so the masks are tried hottest
+// first. Their checksums don't depend on the frame and are computed at most
+// once per plane.
+static void detect_follow(Context* ctx, SequenceState& state,
+                          const std::vector<uint8_t>& plane,
+                          uint32_t no_mask_crc, bool reverse) {
+  const FrameSeq& seq = *state.seq;
+  VNI_SPAN(ctx, DetectFollow);
   uint32_t frame_index = 0;
   for (const auto& frame : seq.frames) {
     if (no_mask_crc == frame.hash) {
-      seq.frame_index = frame_index;
+      state.frame_index = frame_index;
+      VNI_STATS_INC(ctx, follow_detections);
       return;
     }
-    if (!masks.empty()) {
-      for (const auto& mask : masks) {
-        uint32_t mask_crc = checksum_plane_with_mask(plane, mask, reverse);
-        if (mask_crc == frame.hash) {
-          seq.frame_index = frame_index;
-          return;
-        }
+    for (uint16_t mask : ctx->mask_order) {
+      if (mask_checksum(ctx, plane, mask, reverse) == frame.hash) {
+        state.frame_index = frame_index;
+        VNI_STATS_INC(ctx, follow_detections);
+        record_mask_hit(ctx, mask);
+        return;
       }
     }
     frame_index++;
   }
 }
 
-static bool detect_lcm(FrameSeq& seq, const std::vector<uint8_t>& plane,
-                       uint32_t no_mask_crc, bool reverse, bool clear) {
+// detect_lcm for a sparse frame, in time proportional to its set words.
+static void or_sparse_frame(SequenceState& state, const AnimationFrame& frame,
+                            bool masked, bool clear) {
+  const FrameSeq& seq = *state.seq;
+  if (clear) {
+    for (size_t i = 0; i < state.lcm_planes; i++) {
+      std::memset(state.lcm_plane(i), 0, state.lcm_plane_size);
+    }
+    if (masked) {
+      std::memset(state.lcm_mask(), 0, state.lcm_plane_size);
+    }
+  }
+  size_t size = std::min<size_t>(frame.plane_size, state.lcm_plane_size);
+  const uint8_t* sparse =
+      seq.arena.data() + frame.data_offset + frame.plane_count;
+  for (size_t i = 0; i < frame.plane_count; i++) {
+    sparse = or_sparse(i < state.lcm_planes ? state.lcm_plane(i) : nullptr,
+                       sparse, size);
+  }
+  if (masked && frame.has_mask && frame.plane_count > 0) {
+    or_sparse(state.lcm_mask(), sparse, size);
+  }
+}
+
+static bool detect_lcm(Context* ctx, SequenceState& state,
+                       const std::vector<uint8_t>& plane, uint32_t no_mask_crc,
+                       bool reverse, bool clear) {
+  const FrameSeq& seq = *state.seq;
   uint32_t checksum = no_mask_crc;
   if (seq.masks.empty()) {
     return clear;
   }
+  VNI_SPAN(ctx, DetectLcm);
+  bool masked = state.switch_mode == SwitchMode::MaskedReplace;
   for (int k = -1; k < static_cast<int>(seq.masks.size()); k++) {
     if (k >= 0) {
-      checksum = checksum_plane_with_mask(plane, seq.masks[k], reverse);
+      checksum = checksum_plane_with_mask(plane, seq.data(seq.masks[k]),
+                                          seq.masks[k].size, reverse);
+      VNI_STATS_INC(ctx, masked_checksums);
     }
     for (const auto& frame : seq.frames) {
-      if (frame.hash == checksum) {
-        if (clear) {
-          for (auto& plane_buf : seq.lcm_buffer_planes) {
-            clear_plane(plane_buf);
-          }
-          clear = false;
-          if (seq.switch_mode == SwitchMode::MaskedReplace) {
-            clear_plane(seq.replace_mask);
-          }
+      if (frame.hash != checksum) {
+        continue;
+      }
+      VNI_STATS_INC(ctx, lcm_detections);
+      if (frame.sparse) {
+        or_sparse_frame(state, frame, masked, clear);
+        clear = false;
+        continue;
+      }
+      // One lookup of a cached block, rather than one per plane.
+      const uint8_t* block = state.planes(frame);
+      auto plane = [&](size_t i) {
+        return block ? block + i * frame.plane_size : state.plane(frame, i);
+      };
+      size_t size = std::min<size_t>(frame.plane_size, state.lcm_plane_size);
+      size_t count = std::min<size_t>(frame.plane_count, state.lcm_planes);
+      const uint8_t* mask = nullptr;
+      if (masked && frame.has_mask && frame.plane_count > 0) {
+        mask = plane(frame.plane_count);
+      }
+      if (clear) {
+        // The first match of an input frame replaces the buffers instead
+        // of clearing them and ORing into them.
+        for (size_t i = 0; i < state.lcm_planes; i++) {
+          copy_words(state.lcm_plane(i), state.lcm_plane_size,
+                     i < count ? plane(i) : nullptr, size);
         }
-        for (size_t i = 0; i < frame.planes.size(); i++) {
-          or_plane(frame.planes[i].plane, seq.lcm_buffer_planes[i]);
-          if (seq.switch_mode == SwitchMode::MaskedReplace &&
-              !frame.mask.empty()) {
-            or_plane(frame.mask, seq.replace_mask);
-          }
+        if (masked) {
+          copy_words(state.lcm_mask(), state.lcm_plane_size, mask, size);
         }
+        clear = false;
+        continue;
+      }
+      for (size_t i = 0; i < count; i++) {
+        or_words(state.lcm_plane(i), plane(i), size);
+      }
+      if (mask) {
+        or_words(state.lcm_mask(), mask, size);
       }
     }
   }
   return clear;
 }
 
-static void start_animation(Context* ctx, Mapping& mapping,
+static void publish_event(Context* ctx, const Mapping& mapping) {
+  if (std::find(ctx->frame_events.begin(), ctx->frame_events.end(),
+                mapping.checksum) != ctx->frame_events.end()) {
+    return;
+  }
+  ctx->frame_events.push_back(mapping.checksum);
+  if (std::find(ctx->last_frame_events.begin(), ctx->last_frame_events.end(),
+                mapping.checksum) != ctx->last_frame_events.end()) {
+    return;
+  }
+
+  Vni_Event event;
+  event.checksum = mapping.checksum;
+  event.palette_index = mapping.palette_index;
+  event.value = mapping.offset;
+  event.timestamp_ms = ctx->now();
+  VNI_STATS_INC(ctx, events);
+  if (!ctx->events.push(event)) {
+    VNI_STATS_INC(ctx, events_dropped);
+  }
+  if (ctx->event_callback) {
+    ctx->event_callback(&event, ctx->event_user_data);
+  }
+}
+
+static void start_animation(Context* ctx, const Mapping& mapping,
                             const Dimensions& dim,
                             const std::vector<std::vector<uint8_t>>& planes) {
   if (!ctx->pal) {
     return;
   }
   if (mapping.mode == SwitchMode::Event) {
+    VNI_STATS_INC(ctx, animation_starts[static_cast<size_t>(mapping.mode)]);
+    publish_event(ctx, mapping);
     return;
   }
   if (ctx->active_seq &&
       (ctx->active_seq->switch_mode == SwitchMode::LayeredColorMask ||
        ctx->active_seq->switch_mode == SwitchMode::MaskedReplace) &&
       mapping.mode == ctx->active_seq->switch_mode &&
-      mapping.offset == ctx->active_seq->offset) {
+      mapping.offset == ctx->active_seq->seq->offset) {
     return;
   }
 
   if (ctx->active_seq) {
+    if (ctx->active_seq->is_running) {
+      VNI_SPAN_INSTANT(ctx, AnimationStop, 0, ctx->active_seq->seq->offset);
+    }
     ctx->active_seq->is_running = false;
     ctx->active_seq = nullptr;
   }
 
-  Palette* palette = find_palette(ctx->pal.get(), mapping.palette_index);
+  const Palette* palette =
+      find_palette(ctx->pal.get(), mapping.palette_index);
   if (!palette) {
     return;
   }
@@ -736,36 +1967,43 @@ static void start_animation(Context* ctx, Mapping& mapping,
   ctx->palette_reset_at = -1;
 
   if (!mapping.is_animation() && mapping.duration > 0) {
-    ctx->palette_reset_at = now_ms() + mapping.duration;
+    ctx->palette_reset_at = ctx->now() + mapping.duration;
   }
 
   if (!mapping.is_animation()) {
+    VNI_STATS_INC(ctx, animation_starts[static_cast<size_t>(mapping.mode)]);
     return;
   }
 
-  if (!ctx->vni) {
-    return;
-  }
-  ctx->active_seq = find_animation(ctx->vni.get(), mapping.offset);
+  ctx->active_seq = find_sequence(ctx, mapping.offset);
   if (!ctx->active_seq) {
     return;
   }
   ctx->active_seq->switch_mode = mapping.mode;
   ctx->active_seq->frame_index = 0;
   ctx->active_seq->is_running = true;
+  VNI_STATS_INC(ctx, animation_starts[static_cast<size_t>(mapping.mode)]);
+  VNI_SPAN_INSTANT(ctx, AnimationStart, mapping.mode, mapping.offset);
 
   switch (mapping.mode) {
     case SwitchMode::ColorMask:
     case SwitchMode::Follow:
-      start_enhance(*ctx->active_seq);
+      start_enhance(*ctx->active_seq, ctx->now());
       break;
     case SwitchMode::Replace:
     case SwitchMode::FollowReplace:
-      start_replace(*ctx->active_seq);
+      start_replace(*ctx->active_seq, ctx->now());
       break;
     case SwitchMode::LayeredColorMask:
     case SwitchMode::MaskedReplace:
-      start_lcm(*ctx->active_seq);
+      try {
+        start_lcm(*ctx->active_seq);
+      } catch (const std::bad_alloc&) {
+        // Not left half started, the next trigger starts it again.
+        ctx->active_seq->is_running = false;
+        ctx->active_seq = nullptr;
+        throw;
+      }
       break;
     default:
       break;
@@ -780,10 +2018,12 @@ static void trigger_animation(Context* ctx, const Dimensions& dim,
   if (!ctx->pal || ctx->pal->mappings.empty()) {
     return;
   }
+  VNI_SPAN(ctx, Trigger);
   uint32_t nomask_crc = 0;
   bool clear = true;
   for (const auto& plane : planes) {
-    auto mapping = find_mapping(ctx->pal.get(), plane, reverse, &nomask_crc);
+    next_mask_plane(ctx);
+    auto mapping = find_mapping(ctx, plane, reverse, &nomask_crc);
     if (mapping) {
       start_animation(ctx, *mapping, dim, planes);
       if (ctx->active_seq &&
@@ -795,104 +2035,349 @@ static void trigger_animation(Context* ctx, const Dimensions& dim,
     if (ctx->active_seq) {
       if (ctx->active_seq->switch_mode == SwitchMode::LayeredColorMask ||
           ctx->active_seq->switch_mode == SwitchMode::MaskedReplace) {
-        clear = detect_lcm(*ctx->active_seq, plane, nomask_crc, reverse, clear);
+        clear = detect_lcm(ctx, *ctx->active_seq, plane, nomask_crc, reverse,
+                           clear);
       } else if (ctx->active_seq->switch_mode == SwitchMode::Follow ||
                  ctx->active_seq->switch_mode == SwitchMode::FollowReplace) {
-        detect_follow(*ctx->active_seq, plane, nomask_crc, ctx->pal->masks,
-                      reverse);
+        detect_follow(ctx, *ctx->active_seq, plane, nomask_crc, reverse);
       }
     }
   }
 }
 
 static void render(Context* ctx, const Dimensions& dim,
-                   std::vector<std::vector<uint8_t>> planes) {
+                   const std::vector<std::vector<uint8_t>>& planes) {
   if (!ctx->pal || !ctx->palette) {
     return;
   }
-  Dimensions out_dim = dim;
-  if (ctx->vni && (dim.width * 2 == ctx->vni->dimensions.width &&
-                   dim.height * 2 == ctx->vni->dimensions.height)) {
-    auto indexed = join_planes(planes, dim);
-    if (ctx->scaler_mode == ScalerMode::Scale2x ||
-        ctx->scaler_mode == ScalerMode::ScaleDouble) {
-      indexed = (ctx->scaler_mode == ScalerMode::Scale2x)
-                    ? scale2x_indexed(indexed, dim)
-                    : scale_double_indexed(indexed, dim);
-      out_dim = Dimensions(dim.width * 2, dim.height * 2);
-      planes = split_planes(indexed.data(), out_dim.width, out_dim.height,
-                            static_cast<uint8_t>(planes.size()));
-    }
+  VNI_SPAN(ctx, Render);
+  bool scale = ctx->vni &&
+               (dim.width * 2 == ctx->vni->dimensions.width &&
+                dim.height * 2 == ctx->vni->dimensions.height) &&
+               (ctx->scaler_mode == ScalerMode::Scale2x ||
+                ctx->scaler_mode == ScalerMode::ScaleDouble);
+  if (!scale) {
+    store_output(ctx, planes, dim);
+    return;
   }
-
-  ctx->output.data = join_planes(planes, out_dim);
-  ctx->output.dimensions = out_dim;
-  ctx->output.bitlen = static_cast<uint8_t>(planes.size());
-  ctx->output.has_frame = true;
+  {
+    VNI_SPAN(ctx, Scale);
+    scale_planes(planes, dim, ctx->scaler_mode == ScalerMode::Scale2x,
+                 &ctx->scaled_planes);
+  }
+  store_output(ctx, ctx->scaled_planes,
+               Dimensions(dim.width * 2, dim.height * 2));
 }
 
-static void maybe_reset_palette(Context* ctx) {
-  if (ctx->palette_reset_at < 0) {
-    return;
+static bool maybe_reset_palette(Context* ctx) {
+  if (ctx->palette_reset_at < 0 || ctx->now() < ctx->palette_reset_at) {
+    return false;
   }
-  if (now_ms() >= ctx->palette_reset_at) {
-    if (ctx->default_palette) {
-      ctx->palette = ctx->default_palette;
-    }
-    ctx->palette_reset_at = -1;
+  if (ctx->default_palette) {
+    ctx->palette = ctx->default_palette;
+  }
+  ctx->palette_reset_at = -1;
+  return true;
+}
+
+static bool is_timed(const SequenceState& state) {
+  return state.switch_mode == SwitchMode::ColorMask ||
+         state.switch_mode == SwitchMode::Replace;
+}
+
+// Time at which render_animation() moves a running timed animation on to
+// its next frame, or ends it.
+static int64_t animation_deadline(const Context* ctx) {
+  const SequenceState* state = ctx->active_seq;
+  if (!state || !state->is_running || !is_timed(*state)) {
+    return -1;
   }
+  return state->last_tick + state->timer;
 }
 
-}  // namespace vni
+static void expand_output_palette(Context* ctx) {
+  VNI_STATS_STAGE(ctx, palette);
+  VNI_SPAN(ctx, Palette);
+  size_t colors = 1u << ctx->output.bitlen;
+  expand_palette(*ctx->palette, colors, &ctx->output.palette);
+}
 
-using namespace vni;
+static VniReadOptions read_options(const Vni_Load_Options* options) {
+  VniReadOptions read_options;
+  if (options) {
+    read_options.keep_compressed = options->keep_compressed != 0;
+    read_options.frame_cache_bytes =
+        static_cast<size_t>(options->frame_cache_bytes);
+    read_options.prune_unreachable = options->prune_unreachable != 0;
+    read_options.dedup_planes = options->dedup_planes != 0;
+  }
+  return read_options;
+}
 
-Vni_Context* Vni_LoadFromPaths(const char* pal_path, const char* vni_path,
-                               const char* pac_path, const char* vni_key) {
-  auto ctx = std::make_unique<Context>();
+static bool is_overlay(SwitchMode mode) {
+  return mode == SwitchMode::LayeredColorMask ||
+         mode == SwitchMode::MaskedReplace;
+}
 
-  if (pac_path && pac_path[0] != '\0') {
-    std::fprintf(stderr,
-                 "VNI: encrypted PAC files are not supported; ignoring "
-                 "pac_path.\n");
+void reference_sequences(const PalFile& pal, VniReadOptions* options) {
+  std::map<uint32_t, bool> overlay_only;
+  for (const auto& entry : pal.mappings) {
+    const Mapping& mapping = entry.second;
+    if (!mapping.is_animation()) {
+      continue;
+    }
+    auto it = overlay_only.emplace(mapping.offset, true).first;
+    it->second = it->second && is_overlay(mapping.mode);
+  }
+  options->reachable.clear();
+  options->overlays.clear();
+  for (const auto& entry : overlay_only) {
+    options->reachable.push_back(entry.first);
+    if (entry.second) {
+      options->overlays.push_back(entry.first);
+    }
   }
-  (void)vni_key;
+}
 
-  if (pal_path && pal_path[0] != '\0') {
+static bool read_project(const std::string& pal_path,
+                         const std::string& vni_path,
+                         const VniReadOptions& options, Project* project) {
+  if (!pal_path.empty()) {
     std::ifstream pal_file(pal_path, std::ios::binary);
     if (pal_file.is_open()) {
       auto pal = std::make_unique<PalFile>();
       if (!read_pal_file(pal_file, pal.get())) {
-        return nullptr;
+        return false;
       }
-      ctx->pal = std::move(pal);
+      project->pal = std::move(pal);
     }
   }
-  if (vni_path && vni_path[0] != '\0') {
+  if (!vni_path.empty()) {
     std::ifstream vni_file(vni_path, std::ios::binary);
     if (vni_file.is_open()) {
-      auto vni_obj = std::make_unique<VniFile>();
-      if (!read_vni_file(vni_file, vni_obj.get())) {
-        return nullptr;
+      VniReadOptions vni_options = options;
+      // Without a PAL nothing is reachable, but nothing can be colorized
+      // either, so keep the file whole.
+      vni_options.prune_unreachable = options.prune_unreachable && project->pal;
+      if (project->pal) {
+        reference_sequences(*project->pal, &vni_options);
+      }
+      auto vni_obj = std::make_unique<VniFile>(options.memory);
+      if (!read_vni_file(vni_file, vni_obj.get(), vni_options)) {
+        return false;
       }
-      ctx->vni = std::move(vni_obj);
+      project->vni = std::move(vni_obj);
     }
   }
+  return true;
+}
 
-  if (!ctx->pal) {
-    return nullptr;
+// Reads the files that exist. Returns false if one of them fails to parse
+// or the project exceeds the memory budget of options.memory.
+static bool load_project(const std::string& pal_path,
+                         const std::string& vni_path,
+                         const VniReadOptions& options, Project* project) {
+  try {
+    return read_project(pal_path, vni_path, options, project);
+  } catch (const std::bad_alloc&) {
+    std::fprintf(stderr, "VNI: out of memory loading %s\n", vni_path.c_str());
+    *project = Project();
+    return false;
   }
+}
 
+// Makes pal and vni the project of ctx, with playback state of its own.
+static void use_project(Context* ctx, std::shared_ptr<const PalFile> pal,
+                        std::shared_ptr<const VniFile> vni) {
+  MemoryHooks* memory = ctx->memory.get();
+  std::unique_ptr<FrameCache> frame_cache;
+  HookVector<SequenceState> sequences(memory);
+  if (vni) {
+    if (vni->keep_compressed) {
+      frame_cache = std::make_unique<FrameCache>(memory);
+      frame_cache->set_budget(vni->frame_cache_bytes);
+    }
+    sequences.reserve(vni->animations.size());
+    for (const FrameSeq& seq : vni->animations) {
+      sequences.emplace_back(&seq, frame_cache.get(), memory);
+    }
+  }
+  ctx->active_seq = nullptr;
+  ctx->sequences = std::move(sequences);
+  ctx->frame_cache = std::move(frame_cache);
+  ctx->pal = std::move(pal);
+  ctx->vni = std::move(vni);
+  ctx->default_palette = nullptr;
+  ctx->palette = nullptr;
   if (ctx->pal->default_palette_index >= 0 &&
       ctx->pal->default_palette_index <
           static_cast<int>(ctx->pal->palettes.size())) {
     ctx->default_palette = &ctx->pal->palettes[ctx->pal->default_palette_index];
     ctx->palette = ctx->default_palette;
   }
+  reset_mask_order(ctx);
+}
+
+// Switches to a project published by the loader thread. Runs on the
+// colorizing thread between frames, so nothing references the old project
+// any more once the output is detached from its replace cache.
+static void adopt_pending_project(Context* ctx) {
+  if (!ctx->pending_project.load(std::memory_order_relaxed)) {
+    return;
+  }
+  std::unique_ptr<Project> project(
+      ctx->pending_project.exchange(nullptr, std::memory_order_acquire));
+  if (!project) {
+    return;
+  }
+  uint32_t expected = VNI_RELOAD_READY;
+  ctx->reload_state.compare_exchange_strong(expected, VNI_RELOAD_IDLE);
+
+  clear_replace_cache(ctx);
+  VNI_SPAN_INSTANT(ctx, Reload, 0, 0);
+  if (ctx->active_seq) {
+    if (ctx->active_seq->is_running) {
+      VNI_SPAN_INSTANT(ctx, AnimationStop, 0, ctx->active_seq->seq->offset);
+    }
+    ctx->active_seq->is_running = false;
+    ctx->active_seq = nullptr;
+  }
+  ctx->last_embedded_palette = -1;
+  ctx->reset_embedded = false;
+  ctx->palette_reset_at = -1;
+  use_project(ctx, std::move(project->pal), std::move(project->vni));
+  VNI_STATS_INC(ctx, reloads);
+}
+
+Context::~Context() {
+  if (loader.joinable()) {
+    loader.join();
+  }
+  delete pending_project.exchange(nullptr);
+}
+
+}  // namespace vni
+
+using namespace vni;
+
+Vni_Context* Vni_LoadFromPaths(const char* pal_path, const char* vni_path,
+                               const char* pac_path, const char* vni_key) {
+  return Vni_LoadFromPathsWithOptions(pal_path, vni_path, pac_path, vni_key,
+                                      nullptr);
+}
+
+Vni_Context* Vni_LoadFromPathsWithOptions(const char* pal_path,
+                                          const char* vni_path,
+                                          const char* pac_path,
+                                          const char* vni_key,
+                                          const Vni_Load_Options* options) {
+  if (pac_path && pac_path[0] != '\0') {
+    std::fprintf(stderr,
+                 "VNI: encrypted PAC files are not supported; ignoring "
+                 "pac_path.\n");
+  }
+  (void)vni_key;
 
+  auto ctx = std::make_unique<Context>(
+      make_memory_hooks(options ? options->allocator : nullptr));
+  VniReadOptions read = read_options(options);
+  read.memory = ctx->memory.get();
+  Project project;
+  if (!load_project(pal_path ? pal_path : "", vni_path ? vni_path : "", read,
+                    &project) ||
+      !project.pal) {
+    return nullptr;
+  }
+  use_project(ctx.get(), std::move(project.pal), std::move(project.vni));
   return reinterpret_cast<Vni_Context*>(ctx.release());
 }
 
+Vni_Context* Vni_Share(const Vni_Context* ctx) {
+  if (!ctx) {
+    return nullptr;
+  }
+  auto* base = reinterpret_cast<const Context*>(ctx);
+  if (!base->pal) {
+    return nullptr;
+  }
+  auto context = std::make_unique<Context>(base->memory);
+  try {
+    use_project(context.get(), base->pal, base->vni);
+  } catch (const std::bad_alloc&) {
+    std::fprintf(stderr, "VNI: out of memory sharing a project\n");
+    return nullptr;
+  }
+  return reinterpret_cast<Vni_Context*>(context.release());
+}
+
+uint32_t Vni_Reload(Vni_Context* ctx, const char* pal_path,
+                    const char* vni_path, const char* pac_path,
+                    const char* vni_key, const Vni_Load_Options* options) {
+  if (!ctx) {
+    return 0;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  // Claiming LOADING makes this the only caller that touches the loader
+  // thread until it finishes, even if several threads reload at once.
+  uint32_t state = context->reload_state.load();
+  do {
+    if (state == VNI_RELOAD_LOADING) {
+      return 0;
+    }
+  } while (!context->reload_state.compare_exchange_weak(state,
+                                                        VNI_RELOAD_LOADING));
+  if (pac_path && pac_path[0] != '\0') {
+    std::fprintf(stderr,
+                 "VNI: encrypted PAC files are not supported; ignoring "
+                 "pac_path.\n");
+  }
+  (void)vni_key;
+
+  // A previous loader may still be publishing its project.
+  if (context->loader.joinable()) {
+    context->loader.join();
+  }
+  VniReadOptions read = read_options(options);
+  read.memory = context->memory.get();
+  context->loader = std::thread(
+      [context, pal = std::string(pal_path ? pal_path : ""),
+       vni = std::string(vni_path ? vni_path : ""),
+       options = read]() {
+        auto project = std::make_unique<Project>();
+        if (!load_project(pal, vni, options, project.get()) ||
+            !project->pal) {
+          std::fprintf(stderr, "VNI: reloading %s failed\n", pal.c_str());
+          context->reload_state.store(VNI_RELOAD_FAILED);
+          return;
+        }
+        context->reload_state.store(VNI_RELOAD_READY);
+        // Replaces a project that was published but never adopted.
+        delete context->pending_project.exchange(project.release(),
+                                                 std::memory_order_release);
+      });
+  return 1;
+}
+
+uint32_t Vni_GetReloadState(const Vni_Context* ctx) {
+  if (!ctx) {
+    return VNI_RELOAD_IDLE;
+  }
+  auto* context = reinterpret_cast<const Context*>(ctx);
+  return context->reload_state.load();
+}
+
+void Vni_SetFrameCacheBudget(Vni_Context* ctx, uint64_t bytes) {
+  if (!ctx) {
+    return;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  if (context->frame_cache) {
+    // The output may point at a cached frame that is about to be evicted.
+    detach_output(context);
+    context->frame_cache->set_budget(static_cast<size_t>(bytes));
+  }
+}
+
 void Vni_Dispose(Vni_Context* ctx) {
   if (!ctx) {
     return;
@@ -906,16 +2391,45 @@ const Vni_Frame_Struc* Vni_GetFrame(const Vni_Context* ctx) {
     return nullptr;
   }
   auto* context = reinterpret_cast<const Context*>(ctx);
-  static Vni_Frame_Struc frame;
+  Vni_Frame_Struc& frame = context->output_frame;
   frame.width = context->output.dimensions.width;
   frame.height = context->output.dimensions.height;
   frame.bitlen = context->output.bitlen;
   frame.has_frame = context->output.has_frame ? 1 : 0;
-  frame.frame = context->output.data.data();
+  frame.frame = context->output_mode == OutputMode::Indexed
+                    ? context->output.pixels()
+                    : nullptr;
   frame.palette = context->output.palette.data();
   return &frame;
 }
 
+const Vni_Planes_Struc* Vni_GetPlanes(const Vni_Context* ctx) {
+  if (!ctx) {
+    return nullptr;
+  }
+  auto* context = reinterpret_cast<const Context*>(ctx);
+  bool bitplanes = context->output_mode == OutputMode::Bitplanes;
+  Vni_Planes_Struc& planes = context->output_planes;
+  planes.width = context->output.dimensions.width;
+  planes.height = context->output.dimensions.height;
+  planes.bitlen = context->output.bitlen;
+  planes.has_frame = context->output.has_frame ? 1 : 0;
+  planes.plane_size =
+      bitplanes ? static_cast<uint32_t>(context->output.plane_size) : 0;
+  planes.planes = bitplanes ? context->output.plane_data() : nullptr;
+  planes.palette = context->output.palette.data();
+  return &planes;
+}
+
+void Vni_SetOutputMode(Vni_Context* ctx, uint32_t mode) {
+  if (!ctx || mode > VNI_OUTPUT_BITPLANES) {
+    return;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  context->output_mode = static_cast<OutputMode>(mode);
+  context->output.has_frame = false;
+}
+
 void Vni_SetScalerMode(Vni_Context* ctx, uint32_t mode) {
   if (!ctx) {
     return;
@@ -924,6 +2438,15 @@ void Vni_SetScalerMode(Vni_Context* ctx, uint32_t mode) {
   context->scaler_mode = static_cast<ScalerMode>(mode);
 }
 
+void Vni_SetReplaceCacheLimit(Vni_Context* ctx, uint64_t max_bytes) {
+  if (!ctx) {
+    return;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  clear_replace_cache(context);
+  context->replace_cache_limit = static_cast<size_t>(max_bytes);
+}
+
 uint32_t Vni_Has128x32Animation(const Vni_Context* ctx) {
   if (!ctx) {
     return 0;
@@ -935,38 +2458,81 @@ uint32_t Vni_Has128x32Animation(const Vni_Context* ctx) {
   return context->pal->masks[0].size() == 512 ? 1 : 0;
 }
 
-uint32_t Vni_Colorize(Vni_Context* ctx, const uint8_t* frame, uint32_t width,
-                      uint32_t height, uint8_t bitlen) {
-  if (!ctx || !frame) {
-    return 0;
-  }
-  auto* context = reinterpret_cast<Context*>(ctx);
+// Resets the per-frame state. Returns false if there is nothing to colorize.
+static bool begin_frame(Context* context) {
+  adopt_pending_project(context);
   if (!context->pal || !context->palette) {
-    return 0;
+    return false;
   }
-
-  Dimensions dim(width, height);
   context->output.has_frame = false;
+  std::swap(context->frame_events, context->last_frame_events);
+  context->frame_events.clear();
+  return true;
+}
 
-  if (bitlen == 4 && context->pal->palettes.size() > 1 && !context->vni) {
-    if (frame[0] == 0x08 && frame[1] == 0x09 && frame[2] == 0x0a &&
-        frame[3] == 0x0b) {
-      uint32_t new_pal = static_cast<uint32_t>(frame[5]) * 8 + frame[4];
-      if (static_cast<size_t>(new_pal) < context->pal->palettes.size()) {
-        context->palette = &context->pal->palettes[new_pal];
-        if (!context->palette->is_persistent()) {
-          context->reset_embedded = true;
-        }
-        context->last_embedded_palette = static_cast<int>(new_pal);
-      }
-    } else if (context->reset_embedded) {
-      if (context->default_palette) {
-        context->palette = context->default_palette;
+// 4 bit frames of projects without VNI file can switch palettes with a
+// marker in their first pixels.
+static void apply_embedded_palette(Context* context, const uint8_t* pixels,
+                                   uint8_t bitlen) {
+  if (bitlen != 4 || context->pal->palettes.size() <= 1 || context->vni) {
+    return;
+  }
+  if (pixels[0] == 0x08 && pixels[1] == 0x09 && pixels[2] == 0x0a &&
+      pixels[3] == 0x0b) {
+    uint32_t new_pal = static_cast<uint32_t>(pixels[5]) * 8 + pixels[4];
+    if (static_cast<size_t>(new_pal) < context->pal->palettes.size()) {
+      context->palette = &context->pal->palettes[new_pal];
+      if (!context->palette->is_persistent()) {
+        context->reset_embedded = true;
       }
-      context->reset_embedded = false;
+      context->last_embedded_palette = static_cast<int>(new_pal);
+    }
+  } else if (context->reset_embedded) {
+    if (context->default_palette) {
+      context->palette = context->default_palette;
+    }
+    context->reset_embedded = false;
+  }
+}
+
+// Runs the pipeline on the planes of an input frame.
+static uint32_t colorize_planes(Context* context, const Dimensions& dim,
+                                std::vector<std::vector<uint8_t>> planes) {
+  if (!context->pal->mappings.empty()) {
+    VNI_STATS_STAGE(context, trigger);
+    trigger_animation(context, dim, planes, false);
+  }
+
+  {
+    VNI_STATS_STAGE(context, render);
+    if (context->active_seq && context->active_seq->is_running) {
+      render_animation(context, *context->active_seq, dim, planes);
+    } else {
+      render(context, dim, planes);
     }
   }
 
+  context->last_planes = std::move(planes);
+  context->last_dim = dim;
+
+  maybe_reset_palette(context);
+
+  if (context->output.has_frame) {
+    expand_output_palette(context);
+  }
+
+  return context->output.has_frame ? 1 : 0;
+}
+
+static uint32_t colorize(Context* context, const uint8_t* frame,
+                         uint32_t width, uint32_t height, uint8_t bitlen) {
+  VNI_SPAN(context, Colorize);
+  if (!begin_frame(context)) {
+    return 0;
+  }
+  Dimensions dim(width, height);
+  apply_embedded_palette(context, frame, bitlen);
+
   const uint8_t* effective_frame = frame;
   std::vector<uint8_t> padded_frame;
 
@@ -981,24 +2547,477 @@ uint32_t Vni_Colorize(Vni_Context* ctx, const uint8_t* frame, uint32_t width,
     dim = standard;
   }
 
-  auto planes = split_planes(effective_frame, dim.width, dim.height, bitlen);
+  VNI_STATS_INC(context, frames);
 
-  if (!context->pal->mappings.empty()) {
-    trigger_animation(context, dim, planes, false);
+  std::vector<std::vector<uint8_t>> planes;
+  {
+    VNI_STATS_STAGE(context, split);
+    VNI_SPAN(context, Split);
+    planes = split_planes(effective_frame, dim.width, dim.height, bitlen);
   }
+  return colorize_planes(context, dim, std::move(planes));
+}
 
-  if (context->active_seq && context->active_seq->is_running) {
-    render_animation(context, *context->active_seq, dim, planes);
-  } else {
-    render(context, dim, planes);
+// Input given as planes or packed pixels, see Vni_ColorizePlanes() and
+// Vni_ColorizePacked(). Frames smaller than the standard size are centered
+// on it as indexed pixels.
+static uint32_t colorize_split(Context* context, const uint8_t* data,
+                               bool packed, uint32_t width, uint32_t height,
+                               uint8_t bitlen) {
+  VNI_SPAN(context, Colorize);
+  Dimensions dim(width, height);
+  Dimensions standard;
+  if (dim.width < standard.width || dim.height < standard.height) {
+    std::vector<uint8_t> pixels =
+        packed ? unpack_pixels(data, dim.surface(), bitlen)
+               : join_plane_data(data, dim, bitlen);
+    return colorize(context, pixels.data(), width, height, bitlen);
+  }
+  if (!begin_frame(context)) {
+    return 0;
   }
+  VNI_STATS_INC(context, frames);
 
-  maybe_reset_palette(context);
+  std::vector<std::vector<uint8_t>> planes;
+  {
+    VNI_STATS_STAGE(context, split);
+    VNI_SPAN(context, Split);
+    planes = packed ? split_packed(data, dim.surface(), bitlen)
+                    : copy_planes(data, dim.surface() / 8, bitlen);
+  }
+  if (bitlen == 4) {
+    uint8_t first[6] = {};
+    for (size_t i = 0; i < 6; i++) {
+      for (uint8_t p = 0; p < bitlen; p++) {
+        first[i] |= static_cast<uint8_t>(((planes[p][0] >> i) & 1) << p);
+      }
+    }
+    apply_embedded_palette(context, first, bitlen);
+  }
+  return colorize_planes(context, dim, std::move(planes));
+}
 
-  if (context->output.has_frame) {
-    size_t colors = 1u << context->output.bitlen;
-    context->output.palette = expand_palette(*context->palette, colors);
+// Output buffers that would exceed the memory budget drop the frame.
+template <typename Fn>
+static uint32_t output_or_drop(Context* context, Fn&& fn) {
+  try {
+    return fn();
+  } catch (const std::bad_alloc&) {
+    std::fprintf(stderr, "VNI: out of memory, dropping frame\n");
+    context->output.has_frame = false;
+    return 0;
   }
+}
 
-  return context->output.has_frame ? 1 : 0;
+static void record_input(Context* context, const uint8_t* frame,
+                         uint32_t width, uint32_t height, uint8_t bitlen) {
+  if (!context->recorder->write(context->now(), frame, width, height,
+                                bitlen)) {
+    std::fprintf(stderr, "VNI: writing the trace failed, recording stopped\n");
+    context->recorder.reset();
+  }
+}
+
+uint32_t Vni_Colorize(Vni_Context* ctx, const uint8_t* frame, uint32_t width,
+                      uint32_t height, uint8_t bitlen) {
+  if (!ctx || !frame) {
+    return 0;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  if (context->recorder) {
+    record_input(context, frame, width, height, bitlen);
+  }
+  return output_or_drop(context, [&] {
+    return colorize(context, frame, width, height, bitlen);
+  });
+}
+
+uint32_t Vni_ColorizePlanes(Vni_Context* ctx, const uint8_t* planes,
+                            uint32_t width, uint32_t height, uint8_t bitlen) {
+  if (!ctx || !planes || bitlen == 0 || bitlen > 8 ||
+      (static_cast<size_t>(width) * height) % 8 != 0) {
+    return 0;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  if (context->recorder) {
+    std::vector<uint8_t> pixels =
+        join_plane_data(planes, Dimensions(width, height), bitlen);
+    record_input(context, pixels.data(), width, height, bitlen);
+  }
+  return output_or_drop(context, [&] {
+    return colorize_split(context, planes, false, width, height, bitlen);
+  });
+}
+
+uint32_t Vni_ColorizePacked(Vni_Context* ctx, const uint8_t* pixels,
+                            uint32_t width, uint32_t height, uint8_t bitlen) {
+  if (!ctx || !pixels || (bitlen != 1 && bitlen != 2 && bitlen != 4) ||
+      (static_cast<size_t>(width) * height) % 8 != 0) {
+    return 0;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  if (context->recorder) {
+    std::vector<uint8_t> indexed = unpack_pixels(
+        pixels, static_cast<size_t>(width) * height, bitlen);
+    record_input(context, indexed.data(), width, height, bitlen);
+  }
+  return output_or_drop(context, [&] {
+    return colorize_split(context, pixels, true, width, height, bitlen);
+  });
+}
+
+int64_t Vni_GetNextDeadline(const Vni_Context* ctx) {
+  if (!ctx) {
+    return -1;
+  }
+  auto* context = reinterpret_cast<const Context*>(ctx);
+  int64_t deadline = animation_deadline(context);
+  int64_t reset_at = context->palette_reset_at;
+  if (reset_at >= 0 && (deadline < 0 || reset_at < deadline)) {
+    deadline = reset_at;
+  }
+  return deadline;
+}
+
+static uint32_t tick(Context* context) {
+  VNI_SPAN(context, Tick);
+  adopt_pending_project(context);
+  if (!context->pal || !context->palette) {
+    return 0;
+  }
+
+  int64_t deadline = animation_deadline(context);
+  bool advance = deadline >= 0 && context->now() >= deadline &&
+                 !context->last_planes.empty();
+  if (advance) {
+    VNI_STATS_STAGE(context, render);
+    context->output.has_frame = false;
+    render_animation(context, *context->active_seq, context->last_dim,
+                     context->last_planes);
+  }
+  bool reset = maybe_reset_palette(context);
+  if (!context->output.has_frame || !(advance || reset)) {
+    return 0;
+  }
+  expand_output_palette(context);
+  VNI_STATS_INC(context, ticks);
+  return 1;
+}
+
+uint32_t Vni_Tick(Vni_Context* ctx) {
+  if (!ctx) {
+    return 0;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  return output_or_drop(context, [&] { return tick(context); });
+}
+
+void Vni_SetClock(Vni_Context* ctx, Vni_ClockCallback callback,
+                  void* user_data) {
+  if (!ctx) {
+    return;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  context->clock = callback;
+  context->clock_user_data = user_data;
+}
+
+uint32_t Vni_StartRecording(Vni_Context* ctx, const char* path) {
+  if (!ctx || !path) {
+    return 0;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  Vni_StopRecording(ctx);
+  auto recorder = std::make_unique<TraceWriter>();
+  if (!recorder->open(path)) {
+    std::fprintf(stderr, "VNI: unable to create trace %s\n", path);
+    return 0;
+  }
+  context->recorder = std::move(recorder);
+  return 1;
+}
+
+void Vni_StopRecording(Vni_Context* ctx) {
+  if (!ctx) {
+    return;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  if (context->recorder && !context->recorder->close()) {
+    std::fprintf(stderr, "VNI: writing the trace failed\n");
+  }
+  context->recorder.reset();
+}
+
+void Vni_SetEventCallback(Vni_Context* ctx, Vni_EventCallback callback,
+                          void* user_data) {
+  if (!ctx) {
+    return;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  context->event_callback = callback;
+  context->event_user_data = user_data;
+}
+
+uint32_t Vni_PollEvent(Vni_Context* ctx, Vni_Event* event) {
+  if (!ctx || !event) {
+    return 0;
+  }
+  auto* context = reinterpret_cast<Context*>(ctx);
+  return context->events.pop(event) ? 1 : 0;
+}
+
+uint32_t Vni_GetStats(const Vni_Context* ctx, Vni_Stats* stats) {
+  if (!stats) {
+    return 0;
+  }
+  *stats = Vni_Stats{};
+  if (!ctx) {
+    return 0;
+  }
+#if defined(VNI_ENABLE_STATS)
+  auto* context = reinterpret_cast<const Context*>(ctx);
+  const Stats& src = context->stats;
+  auto copy_stage = [](const StageStats& in, Vni_Stage_Stats* out) {
+    out->count = in.count;
+    out->total_ns = in.total_ns;
+    out->max_ns = in.max_ns;
+  };
+  stats->frames = src.frames;
+  stats->mapping_lookups = src.mapping_lookups;
+  stats->mapping_hits = src.mapping_hits;
+  stats->mapping_misses = src.mapping_misses;
+  stats->masked_checksums = src.masked_checksums;
+  static_assert(
+      std::extent_v<decltype(Vni_Stats::animation_starts)> ==
+              kSwitchModeCount &&
+          std::extent_v<decltype(Stats::animation_starts)> == kSwitchModeCount,
+      "animation_starts needs an entry per switch mode");
+  for (size_t i = 0; i < kSwitchModeCount; i++) {
+    stats->animation_starts[i] = src.animation_starts[i];
+  }
+  stats->lcm_detections = src.lcm_detections;
+  stats->follow_detections = src.follow_detections;
+  stats->events = src.events;
+  stats->events_dropped = src.events_dropped;
+  stats->replace_cache_hits = src.replace_cache_hits;
+  stats->replace_cache_bytes = context->replace_cache_bytes;
+  stats->reloads = src.reloads;
+  stats->ticks = src.ticks;
+  if (context->frame_cache) {
+    const FrameCache& cache = *context->frame_cache;
+    stats->frame_cache_hits = cache.hits();
+    stats->frame_cache_misses = cache.misses();
+    stats->frame_cache_evictions = cache.evictions();
+    stats->frame_cache_bytes = cache.bytes();
+  }
+  if (context->vni) {
+    stats->pruned_sequences = context->vni->pruned_sequences;
+    stats->pruned_bytes = context->vni->pruned_bytes;
+    stats->sparse_frames = context->vni->sparse_frames;
+    stats->sparse_bytes_saved = context->vni->sparse_bytes_saved;
+  }
+  if (context->vni && context->vni->plane_store) {
+    const PlaneStore& store = *context->vni->plane_store;
+    stats->plane_store_refs = store.refs();
+    stats->plane_store_planes = store.planes();
+    stats->plane_store_ref_bytes = store.ref_bytes();
+    stats->plane_store_bytes = store.bytes();
+  }
+  copy_stage(src.split, &stats->split);
+  copy_stage(src.trigger, &stats->trigger);
+  copy_stage(src.render, &stats->render);
+  copy_stage(src.join, &stats->join);
+  copy_stage(src.palette, &stats->palette);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+void Vni_ResetStats(Vni_Context* ctx) {
+  if (!ctx) {
+    return;
+  }
+#if defined(VNI_ENABLE_STATS)
+  auto* context = reinterpret_cast<Context*>(ctx);
+  context->stats = Stats{};
+#endif
+}
+
+uint32_t Vni_GetMemoryUsage(const Vni_Context* ctx, Vni_Memory_Usage* usage,
+                            Vni_Sequence_Memory* sequences,
+                            uint32_t max_sequences) {
+  if (!usage) {
+    return 0;
+  }
+  *usage = Vni_Memory_Usage{};
+  if (!ctx) {
+    return 0;
+  }
+  auto* context = reinterpret_cast<const Context*>(ctx);
+  uint64_t blocks = 0;
+  // Bytes of one part, its heap blocks go into blocks.
+  auto part = [&blocks](const HeapTally& tally) {
+    blocks += tally.blocks;
+    return tally.bytes;
+  };
+
+  HeapTally state;
+  state.add_block(sizeof(Context));
+  for (const auto& plane : context->last_planes) {
+    state.add(plane);
+  }
+  state.add(context->last_planes);
+  state.add(context->mask_crc);
+  state.add(context->mask_crc_epoch);
+  state.add(context->mask_order);
+  state.add(context->mask_rank);
+  state.add(context->mask_hits);
+  state.add(context->frame_events);
+  state.add(context->last_frame_events);
+
+  if (const PalFile* pal = context->pal.get()) {
+    state.add_block(sizeof(PalFile));
+    HeapTally palettes;
+    palettes.add(pal->palettes);
+    for (const auto& palette : pal->palettes) {
+      palettes.add(palette.colors);
+    }
+    usage->palettes = part(palettes);
+    // Tree nodes hold three pointers and the color besides the entry.
+    HeapTally mappings;
+    for (size_t i = 0; i < pal->mappings.size(); i++) {
+      mappings.add_block(sizeof(decltype(pal->mappings)::value_type) +
+                         4 * sizeof(void*));
+    }
+    usage->mappings = part(mappings);
+    HeapTally masks;
+    masks.add(pal->masks);
+    for (const auto& mask : pal->masks) {
+      masks.add(mask);
+    }
+    usage->masks = part(masks);
+  }
+
+  if (const VniFile* vni = context->vni.get()) {
+    state.add_block(sizeof(VniFile));
+    HeapTally metadata;
+    metadata.add(vni->animations);
+    HeapTally frame_data;
+    HeapTally runtime;
+    usage->sequences = static_cast<uint32_t>(vni->animations.size());
+    for (size_t i = 0; i < vni->animations.size(); i++) {
+      const FrameSeq& seq = vni->animations[i];
+      HeapTally seq_metadata;
+      seq_metadata.add(seq.name);
+      seq_metadata.add(seq.frames);
+      seq_metadata.add(seq.masks);
+      seq_metadata.add(seq.slots);
+      HeapTally seq_frames;
+      seq_frames.add(seq.arena);
+      HeapTally seq_runtime;
+      const SequenceState& state = context->sequences[i];
+      seq_runtime.add(state.lcm_buffer);
+      seq_runtime.add(state.joined);
+      seq_runtime.add(state.joined_ready);
+      uint64_t shared = 0;
+      for (const auto& frame : seq.frames) {
+        if (seq.is_shared(frame)) {
+          shared += (frame.plane_count + (frame.has_mask ? 1u : 0u)) *
+                    uint64_t{frame.plane_size};
+        }
+      }
+      if (seq.store) {
+        for (const auto& mask : seq.masks) {
+          shared += mask.size;
+        }
+      }
+      if (sequences && i < max_sequences) {
+        Vni_Sequence_Memory& out = sequences[i];
+        out.offset = seq.offset;
+        out.frames = static_cast<uint32_t>(seq.frames.size());
+        out.frame_bytes = seq_frames.bytes;
+        out.shared_bytes = shared;
+        out.metadata_bytes = seq_metadata.bytes;
+        out.runtime_bytes = seq_runtime.bytes;
+      }
+      metadata.add(seq_metadata);
+      frame_data.add(seq_frames);
+      runtime.add(seq_runtime);
+    }
+    usage->sequence_metadata = part(metadata);
+    usage->frame_data = part(frame_data);
+    usage->sequence_runtime = part(runtime);
+    if (vni->plane_store) {
+      HeapTally store;
+      store.add_block(sizeof(PlaneStore));
+      vni->plane_store->tally_memory(&store);
+      usage->plane_store = part(store);
+    }
+  }
+  state.add(context->sequences);
+  if (context->frame_cache) {
+    HeapTally cache;
+    cache.add_block(sizeof(FrameCache));
+    context->frame_cache->tally_memory(&cache);
+    usage->frame_cache = part(cache);
+  }
+  usage->context = part(state);
+
+  HeapTally diagnostics;
+  if (context->recorder) {
+    diagnostics.add_block(sizeof(TraceWriter));
+    context->recorder->tally_memory(&diagnostics);
+  }
+#if defined(VNI_ENABLE_TRACING)
+  context->spans.tally_memory(&diagnostics);
+#endif
+  usage->diagnostics = part(diagnostics);
+
+  HeapTally output;
+  output.add(context->output.data);
+  output.add(context->output.planes);
+  output.add(context->output.palette);
+  usage->output = part(output);
+
+  usage->allocations = blocks;
+  usage->allocator_overhead = blocks * HeapTally::kBlockOverhead;
+  usage->total = usage->palettes + usage->mappings + usage->masks +
+                 usage->sequence_metadata + usage->frame_data +
+                 usage->plane_store + usage->frame_cache +
+                 usage->sequence_runtime + usage->context +
+                 usage->diagnostics + usage->output +
+                 usage->allocator_overhead;
+  usage->allocator_bytes = context->memory ? context->memory->used() : 0;
+  return 1;
+}
+
+void Vni_SetSpanTracing(Vni_Context* ctx, uint32_t enabled) {
+  if (!ctx) {
+    return;
+  }
+#if defined(VNI_ENABLE_TRACING)
+  auto* context = reinterpret_cast<Context*>(ctx);
+  context->spans.set_enabled(enabled != 0);
+#else
+  (void)enabled;
+#endif
+}
+
+uint32_t Vni_FlushSpanTrace(Vni_Context* ctx, const char* path) {
+  if (!ctx || !path) {
+    return 0;
+  }
+#if defined(VNI_ENABLE_TRACING)
+  auto* context = reinterpret_cast<Context*>(ctx);
+  if (!context->spans.flush(path)) {
+    std::fprintf(stderr, "VNI: unable to write span trace %s\n", path);
+    return 0;
+  }
+  return 1;
+#else
+  std::fprintf(stderr,
+               "VNI: span tracing is not compiled in, see ENABLE_TRACING\n");
+  return 0;
+#endif
 }
@@ -36,6 +36,150 @@ typedef struct Vni_Frame_Struc {
   const uint8_t* palette;  // RGB triples, size = (1 << bitlen) * 3
 } Vni_Frame_Struc;
 
+// Output of VNI_OUTPUT_BITPLANES. Each plane holds one bit of every pixel,
+// plane 0 the least significant one. Pixels are row-major, 8 per byte with
+// the leftmost pixel in the least significant bit.
+typedef struct Vni_Planes_Struc {
+  uint32_t width;
+  uint32_t height;
+  uint8_t bitlen;  // number of planes
+  uint8_t has_frame;
+  uint32_t plane_size;     // bytes per plane, width * height / 8
+  const uint8_t* planes;   // bitlen planes back to back
+  const uint8_t* palette;  // RGB triples, size = (1 << bitlen) * 3
+} Vni_Planes_Struc;
+
+typedef struct Vni_Event {
+  uint32_t checksum;       // checksum of the mapping that matched
+  uint16_t palette_index;  // palette index of the mapping
+  uint32_t value;          // offset/duration field of the mapping
+  int64_t timestamp_ms;    // monotonic clock used for animation timing
+} Vni_Event;
+
+// Called from Vni_Colorize() on the colorizing thread.
+typedef void (*Vni_EventCallback)(const Vni_Event* event, void* user_data);
+
+// Returns the current time in ms, see Vni_SetClock().
+typedef int64_t (*Vni_ClockCallback)(void* user_data);
+
+typedef struct Vni_Stage_Stats {
+  uint64_t count;
+  uint64_t total_ns;  // cumulative wall time spent in the stage
+  uint64_t max_ns;    // slowest single run of the stage
+} Vni_Stage_Stats;
+
+typedef struct Vni_Stats {
+  uint64_t frames;  // frames passed to Vni_Colorize
+  uint64_t mapping_lookups;
+  uint64_t mapping_hits;
+  uint64_t mapping_misses;
+  uint64_t masked_checksums;
+  uint64_t animation_starts[8];  // indexed by switch mode (0 = Palette ...)
+  uint64_t lcm_detections;       // LayeredColorMask/MaskedReplace frame hits
+  uint64_t follow_detections;    // Follow/FollowReplace frame hits
+  uint64_t events;               // Event mappings published
+  uint64_t events_dropped;       // events lost because the queue was full
+  uint64_t replace_cache_hits;   // Replace frames output without a join
+  uint64_t replace_cache_bytes;  // memory held by the replace cache
+  uint64_t frame_cache_hits;     // compressed frames found decoded
+  uint64_t frame_cache_misses;   // compressed frames decoded on demand
+  uint64_t frame_cache_evictions;
+  uint64_t frame_cache_bytes;      // decoded frames held by the frame cache
+  uint64_t reloads;                // reloaded projects put into use
+  uint64_t ticks;                  // frames output by Vni_Tick()
+  uint64_t pruned_sequences;       // VNI sequences skipped by prune_unreachable
+  uint64_t pruned_bytes;           // VNI file bytes of the skipped sequences
+  uint64_t plane_store_refs;       // planes and masks held by dedup_planes
+  uint64_t plane_store_planes;     // distinct ones among them
+  uint64_t plane_store_ref_bytes;  // their bytes without sharing
+  uint64_t plane_store_bytes;      // bytes the plane store holds
+  uint64_t sparse_frames;          // LCM overlay frames stored sparse
+  uint64_t sparse_bytes_saved;     // bytes that saved over full planes
+  Vni_Stage_Stats split;
+  Vni_Stage_Stats trigger;
+  Vni_Stage_Stats render;  // includes join
+  Vni_Stage_Stats join;
+  Vni_Stage_Stats palette;
+} Vni_Stats;
+
+// Memory a sequence holds, in bytes, see Vni_GetMemoryUsage().
+typedef struct Vni_Sequence_Memory {
+  uint32_t offset;  // of the sequence in the VNI file, as in PAL mappings
+  uint32_t frames;
+  uint64_t frame_bytes;     // planes, masks and markers it stores itself
+  uint64_t shared_bytes;    // planes and masks it uses in the plane store
+  uint64_t metadata_bytes;  // frame table, name and plane store slots
+  uint64_t runtime_bytes;   // LCM composition and joined Replace frames
+} Vni_Sequence_Memory;
+
+// Memory a context holds, in bytes, by what it is used for. Containers
+// count with their capacity.
+typedef struct Vni_Memory_Usage {
+  uint64_t palettes;            // PAL palettes
+  uint64_t mappings;            // PAL mappings
+  uint64_t masks;               // PAL masks
+  uint64_t sequence_metadata;   // sequences, their frame tables and names
+  uint64_t frame_data;          // frame_bytes of all sequences
+  uint64_t plane_store;         // planes and masks shared by dedup_planes
+  uint64_t frame_cache;         // frames decoded by keep_compressed
+  uint64_t sequence_runtime;    // runtime_bytes of all sequences
+  uint64_t context;             // context and project objects, input state
+  uint64_t diagnostics;         // span trace buffer and input recording
+  uint64_t output;              // output pixels, planes and palette
+  uint64_t allocations;         // heap blocks behind all of the above
+  uint64_t allocator_overhead;  // estimated, 16 bytes per block
+  uint64_t total;               // sum of the byte counts above
+  // Bytes held through the Vni_Allocator of the context, as counted
+  // against its budget. 0 for contexts on the C++ heap.
+  uint64_t allocator_bytes;
+  uint32_t sequences;  // sequences of the VNI file
+} Vni_Memory_Usage;
+
+// Memory of a context. The VNI project (sequences, frame tables, frame data
+// and the plane store), the frame and replace caches, the playback buffers
+// of the sequences, the per-mask checksum tables and the output buffers
+// allocate through these hooks and count against budget_bytes. The context
+// object and the objects that own those tables, the PAL palettes, mappings
+// and masks, the read buffers of a load, the input planes and scratch
+// buffers of the frame being processed and trace recording and span
+// buffers use the C++ heap and are not counted. Vni_GetMemoryUsage()
+// reports both.
+typedef struct Vni_Allocator {
+  // Both set or both null, null uses the C++ heap. alloc returns size bytes
+  // aligned to alignment or null, free gets the same size and alignment.
+  // They must be thread-safe: Vni_Reload() calls them from its loader
+  // thread while the context colorizes, and the contexts of Vni_Share()
+  // call them from the threads that colorize them.
+  void* (*alloc)(void* user_data, size_t size, size_t alignment);
+  void (*free)(void* user_data, void* ptr, size_t size, size_t alignment);
+  void* user_data;
+  // Bytes the hooked allocations of the context may hold at once, 0 for no
+  // limit. Loads and reloads that would exceed it fail, a frame that would
+  // exceed it is not output. The C++ heap allocations above come on top.
+  uint64_t budget_bytes;
+} Vni_Allocator;
+
+typedef struct Vni_Load_Options {
+  // Keep heatshrink compressed VNI frames compressed in memory and decode
+  // them on demand into an LRU cache of frame_cache_bytes decoded bytes.
+  uint8_t keep_compressed;
+  uint64_t frame_cache_bytes;
+  // Allocator of the new context, null for the one set by
+  // Vni_SetAllocator(). Ignored by Vni_Reload(), which keeps the context's.
+  const Vni_Allocator* allocator;
+  // Skip VNI sequences that no PAL mapping starts. They are never decoded
+  // or held, output is the same. Vni_GetStats() reports what was skipped.
+  uint8_t prune_unreachable;
+  // Store identical planes and masks of uncompressed frames once, shared by
+  // all sequences. Vni_GetStats() reports the savings.
+  uint8_t dedup_planes;
+} Vni_Load_Options;
+
+// Sets the allocator of contexts loaded afterwards without one of their
+// own, null restores the C++ heap. Existing contexts keep their allocator.
+// Every context gets its own budget.
+VNI_API void Vni_SetAllocator(const Vni_Allocator* allocator);
+
 // Loads PAL/VNI data from the provided paths. Any path may be null.
 // pac_path and vni_key are accepted for API compatibility, but encrypted PAC
 // files are not supported. If pac_path is provided, an error is logged and it
@@ -45,15 +189,78 @@ VNI_API Vni_Context* Vni_LoadFromPaths(const char* pal_path,
                                        const char* pac_path,
                                        const char* vni_key);
 
+enum {
+  VNI_RELOAD_IDLE = 0,     // nothing pending, the last reload is in use
+  VNI_RELOAD_LOADING = 1,  // the new project is being parsed
+  VNI_RELOAD_READY = 2,    // parsed, used from the next Vni_Colorize()
+  VNI_RELOAD_FAILED = 3,   // parsing failed, the old project stays in use
+};
+
+// Same as Vni_LoadFromPaths(), with options. options may be null.
+VNI_API Vni_Context* Vni_LoadFromPathsWithOptions(
+    const char* pal_path, const char* vni_path, const char* pac_path,
+    const char* vni_key, const Vni_Load_Options* options);
+
+// Creates a context that colorizes with the project of ctx without reading
+// the files again, for hosts that serve several independent streams. The
+// new context has its own animation state, output, events and stats and
+// starts with default settings. It shares the allocator and budget of ctx
+// and the loaded project, which is read-only: PAL tables, sequences and
+// their frames are held once, only the playback state, buffers and the
+// keep_compressed frame cache of a context are its own. Either context can
+// be reloaded or disposed first. Call it on the thread that colorizes ctx.
+// Returns null if ctx has no project or its state exceeds the budget.
+VNI_API Vni_Context* Vni_Share(const Vni_Context* ctx);
+
+// Changes the byte budget of the decoded frame cache of a context loaded
+// with keep_compressed. Evicts frames right away if the cache is over it.
+VNI_API void Vni_SetFrameCacheBudget(Vni_Context* ctx, uint64_t bytes);
+
+// Loads a new PAL/VNI project into the context on a background thread.
+// Vni_Colorize() keeps using the current project until the new one is
+// parsed and switches to it before the next frame, which stops any
+// running animation. The old project is released at that point, unless a
+// Vni_Share() context still uses it. May be called from any thread,
+// returns 0 if a reload is still loading. Arguments are as for
+// Vni_LoadFromPathsWithOptions().
+VNI_API uint32_t Vni_Reload(Vni_Context* ctx, const char* pal_path,
+                            const char* vni_path, const char* pac_path,
+                            const char* vni_key,
+                            const Vni_Load_Options* options);
+
+// Returns the VNI_RELOAD_* state of the last Vni_Reload().
+VNI_API uint32_t Vni_GetReloadState(const Vni_Context* ctx);
+
 // Releases all resources held by the context.
 VNI_API void Vni_Dispose(Vni_Context* ctx);
 
-// Returns a pointer to the current output frame buffer.
+// Returns the current output frame. The struct belongs to ctx and is valid
+// until the next Vni_Colorize() call on it.
 VNI_API const Vni_Frame_Struc* Vni_GetFrame(const Vni_Context* ctx);
 
+enum {
+  VNI_OUTPUT_INDEXED = 0,    // Vni_GetFrame(), the default
+  VNI_OUTPUT_BITPLANES = 1,  // Vni_GetPlanes(), skips joining the planes
+};
+
+// Selects the output format of Vni_Colorize(). In bitplane mode
+// Vni_GetFrame() has no pixels (frame is null) and in indexed mode
+// Vni_GetPlanes() has no planes.
+VNI_API void Vni_SetOutputMode(Vni_Context* ctx, uint32_t mode);
+
+// Returns the current output frame as bitplanes. The struct belongs to ctx
+// and is valid until the next Vni_Colorize() call on it.
+VNI_API const Vni_Planes_Struc* Vni_GetPlanes(const Vni_Context* ctx);
+
 // Sets the scaler mode: 0 = none, 1 = scale2x, 2 = doubled pixels.
 VNI_API void Vni_SetScalerMode(Vni_Context* ctx, uint32_t mode);
 
+// Keeps Replace and FollowReplace frames joined into indexed pixels after
+// they were first output, so replaying them costs no join. A sequence is
+// cached only if all of its frames fit into max_bytes together with the
+// sequences cached before it. 0 disables the cache and frees it (default).
+VNI_API void Vni_SetReplaceCacheLimit(Vni_Context* ctx, uint64_t max_bytes);
+
 // Returns 1 if the PAL file contains 128x32 masks (used by some consumers).
 VNI_API uint32_t Vni_Has128x32Animation(const Vni_Context* ctx);
 
@@ -62,6 +269,97 @@ VNI_API uint32_t Vni_Has128x32Animation(const Vni_Context* ctx);
 VNI_API uint32_t Vni_Colorize(Vni_Context* ctx, const uint8_t* frame,
                               uint32_t width, uint32_t height, uint8_t bitlen);
 
+// Same as Vni_Colorize() for a frame held as bitlen bitplanes of
+// width * height / 8 bytes back to back, in the layout of Vni_Planes_Struc.
+// Skips splitting the frame into planes. width * height must be a multiple
+// of 8.
+VNI_API uint32_t Vni_ColorizePlanes(Vni_Context* ctx, const uint8_t* planes,
+                                    uint32_t width, uint32_t height,
+                                    uint8_t bitlen);
+
+// Same as Vni_Colorize() for pixels packed bitlen (1, 2 or 4) bits each,
+// row-major, the first pixel of a byte in its least significant bits.
+// width * height must be a multiple of 8.
+VNI_API uint32_t Vni_ColorizePacked(Vni_Context* ctx, const uint8_t* pixels,
+                                    uint32_t width, uint32_t height,
+                                    uint8_t bitlen);
+
+// Returns when the output will next change without new input: the next
+// frame of a running Replace/ColorMask animation or a timed palette reset.
+// The time is in ms on the clock of Vni_Event::timestamp_ms
+// (std::chrono::steady_clock unless replaced by Vni_SetClock()), -1 if
+// nothing is pending.
+VNI_API int64_t Vni_GetNextDeadline(const Vni_Context* ctx);
+
+// Advances a running timed animation and resets a timed palette once their
+// deadline has passed, rendering against the last Vni_Colorize() input.
+// Returns 1 if a new output frame is available, 0 leaves the output as is.
+// Call from the Vni_Colorize() thread, e.g. when Vni_GetNextDeadline() is
+// reached while the input frame holds still.
+VNI_API uint32_t Vni_Tick(Vni_Context* ctx);
+
+// Replaces the clock of animation timing, event timestamps and deadlines,
+// e.g. with virtual time to replay a trace deterministically. callback is
+// called from the Vni_Colorize() thread. Pass null to restore
+// std::chrono::steady_clock.
+VNI_API void Vni_SetClock(Vni_Context* ctx, Vni_ClockCallback callback,
+                          void* user_data);
+
+// Starts recording every Vni_Colorize() input, with its dimensions, bitlen
+// and the time of the context clock, into a trace file at path, replacing
+// it. Frames are stored as the pixels that changed since the previous one.
+// Vni_ColorizePlanes() and Vni_ColorizePacked() inputs are recorded as
+// indexed pixels. vni-replay replays traces. The recorder uses the C++ heap,
+// outside the context's memory budget. Returns 0 if the file can't be
+// created.
+VNI_API uint32_t Vni_StartRecording(Vni_Context* ctx, const char* path);
+
+// Finishes the trace. Vni_Dispose() does so as well.
+VNI_API void Vni_StopRecording(Vni_Context* ctx);
+
+// Registers a callback for matched Event mappings. Pass null to remove it.
+// An event is published once when its frame appears, holding the same frame
+// doesn't repeat it.
+VNI_API void Vni_SetEventCallback(Vni_Context* ctx, Vni_EventCallback callback,
+                                  void* user_data);
+
+// Pops the oldest queued Event mapping match. Returns 1 if event was filled.
+// May be called from a different thread than Vni_Colorize(), but only from
+// one thread at a time. Up to 64 events are queued, further ones are dropped.
+VNI_API uint32_t Vni_PollEvent(Vni_Context* ctx, Vni_Event* event);
+
+// Copies the runtime counters of the context into stats. Returns 0 and zeroes
+// stats if the library was built without runtime counters (ENABLE_STATS).
+VNI_API uint32_t Vni_GetStats(const Vni_Context* ctx, Vni_Stats* stats);
+
+// Resets all runtime counters of the context.
+VNI_API void Vni_ResetStats(Vni_Context* ctx);
+
+// Fills usage with the memory the context holds and the first
+// max_sequences entries of sequences, which may be null, with the
+// sequences in VNI file order. Contexts created with Vni_Share() each
+// count the project data they share. A reload that isn't in use yet is not
+// included. usage->sequences is the number of sequences. Call from the
+// Vni_Colorize() thread. Returns 1, or 0 if ctx or usage is null.
+VNI_API uint32_t Vni_GetMemoryUsage(const Vni_Context* ctx,
+                                    Vni_Memory_Usage* usage,
+                                    Vni_Sequence_Memory* sequences,
+                                    uint32_t max_sequences);
+
+// Starts (enabled = 1) or stops recording the pipeline stages of
+// Vni_Colorize() and Vni_Tick() as timed spans, with animation starts and
+// stops and reloads as instants. Call from the Vni_Colorize() thread. Up to
+// 65536 spans are buffered, further ones are dropped until the next flush.
+// Does nothing unless the library is built with ENABLE_TRACING.
+VNI_API void Vni_SetSpanTracing(Vni_Context* ctx, uint32_t enabled);
+
+// Writes the buffered spans to path as a Chrome trace-event JSON file, for
+// chrome://tracing or ui.perfetto.dev, and empties the buffer. May be called
+// from a different thread than Vni_Colorize(), but only from one thread at
+// a time. Returns 0 if the file can't be written or the library was built
+// without span tracing (ENABLE_TRACING).
+VNI_API uint32_t Vni_FlushSpanTrace(Vni_Context* ctx, const char* path);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -0,0 +1,1112 @@
+// vni_bench: builds synthetic PAL/VNI projects, loads them through the public
+// API and measures load time, per-frame latency and throughput for every
+// switch mode. Results are written as JSON lines so runs can be compared.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "FrameUtil.h"
+#include "vni.h"
+#include "vni_crc32.h"
+#include "vni_internal.h"
+#include "vni_tool_util.h"
+#include "vni_writer.h"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+std::atomic<uint64_t> g_allocations{0};
+
+// Counts allocations so the load of a project can report them.
+void* operator new(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* ptr = malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+// GCC can't see that the replaced operator new is malloc based.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* ptr) noexcept { free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace {
+
+using vni::add_latency;
+using vni::fnv1a;
+using vni::JsonLine;
+using vni::kDigestSeed;
+using vni::parse_u32;
+using vni::parse_u64;
+using vni::percentile;
+
+// Memory of contexts loaded with --memory-budget, through Vni_Allocator.
+std::atomic<uint64_t> g_hook_bytes{0};
+std::atomic<uint64_t> g_hook_peak{0};
+
+void* hook_alloc(void*, size_t size, size_t alignment) {
+  void* ptr = ::operator new(size, std::align_val_t(alignment), std::nothrow);
+  if (ptr) {
+    uint64_t bytes = g_hook_bytes.fetch_add(size) + size;
+    uint64_t peak = g_hook_peak.load();
+    while (bytes > peak && !g_hook_peak.compare_exchange_weak(peak, bytes)) {
+    }
+  }
+  return ptr;
+}
+
+void hook_free(void*, void* ptr, size_t size, size_t alignment) {
+  ::operator delete(ptr, std::align_val_t(alignment));
+  g_hook_bytes.fetch_sub(size);
+}
+
+constexpr uint8_t kInputBitlen = 2;
+constexpr uint8_t kOutputPlanes = 4;
+
+struct ModeInfo {
+  const char* name;
+  uint8_t mode;
+};
+
+constexpr ModeInfo kModes[] = {
+    {"palette", 0},           {"replace", 1},
+    {"colormask", 2},         {"event", 3},
+    {"follow", 4},            {"lcm", 5},
+    {"followreplace", 6},     {"maskedreplace", 7},
+};
+
+// How input frames are passed to the library.
+enum class Input {
+  Indexed,  // Vni_Colorize()
+  Planes,   // Vni_ColorizePlanes()
+  Packed,   // Vni_ColorizePacked()
+};
+
+struct Options {
+  std::vector<uint8_t> modes;
+  std::vector<std::pair<uint32_t, uint32_t>> sizes;
+  std::vector<uint32_t> mask_counts;
+  uint32_t sequences = 16;
+  uint32_t frames_per_seq = 32;
+  uint32_t frames = 2000;
+  uint32_t warmup = 200;
+  uint32_t load_runs = 5;
+  uint32_t scaler = 0;
+  uint64_t replace_cache = 0;
+  int64_t frame_cache = -1;  // -1 decodes all frames at load
+  uint32_t reload_every = 0;
+  uint32_t lcm_layers = 1;
+  uint32_t orphans = 0;
+  uint32_t repeat_planes = 0;  // percent
+  uint32_t overlay_area = 0;   // percent, 0 = overlays cover the frame
+  int64_t memory_budget = -1;  // -1 allocates from the C++ heap
+  Input input = Input::Indexed;
+  bool bitplanes = false;
+  bool double_size = false;
+  bool compress = false;
+  bool keep = false;
+  bool crc = false;
+  bool record = false;
+  bool spans = false;
+  bool prune = false;
+  bool dedup = false;
+  std::string dir;
+  std::string out;
+};
+
+struct Scenario {
+  uint8_t mode = 0;
+  uint32_t width = 128;
+  uint32_t height = 32;
+  uint32_t masks = 0;
+};
+
+class Rng {
+ public:
+  explicit Rng(uint64_t seed) : state_(seed * 0x9e3779b97f4a7c15ull + 1) {}
+
+  uint32_t next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return static_cast<uint32_t>(state_ >> 32);
+  }
+
+  // Returns a byte where each bit is set with a probability of percent/100.
+  uint8_t bits(uint32_t percent) {
+    uint8_t out = 0;
+    for (int i = 0; i < 8; i++) {
+      if (next() % 100 < percent) {
+        out |= static_cast<uint8_t>(1 << i);
+      }
+    }
+    return out;
+  }
+
+ private:
+  uint64_t state_;
+};
+
+struct Project {
+  std::string pal;
+  std::string vni;
+  std::vector<std::vector<uint8_t>> trace;
+};
+
+bool is_follow(uint8_t mode) { return mode == 4 || mode == 6; }
+bool is_lcm(uint8_t mode) { return mode == 5 || mode == 7; }
+
+const char* mode_name(uint8_t mode) {
+  for (const auto& info : kModes) {
+    if (info.mode == mode) {
+      return info.name;
+    }
+  }
+  return "unknown";
+}
+
+const char* input_name(Input input) {
+  switch (input) {
+    case Input::Planes:
+      return "planes";
+    case Input::Packed:
+      return "packed";
+    default:
+      return "indexed";
+  }
+}
+
+// Converts indexed frames of kInputBitlen bits to the input format, so the
+// conversion isn't measured.
+std::vector<std::vector<uint8_t>> convert_trace(
+    const std::vector<std::vector<uint8_t>>& trace, Input input,
+    uint32_t width, uint32_t height) {
+  std::vector<std::vector<uint8_t>> converted;
+  converted.reserve(trace.size());
+  for (const auto& pixels : trace) {
+    std::vector<uint8_t> frame(pixels.size() * kInputBitlen / 8, 0);
+    if (input == Input::Planes) {
+      FrameUtil::Helper::Split(frame.data(), static_cast<uint16_t>(width),
+                               static_cast<uint16_t>(height), kInputBitlen,
+                               const_cast<uint8_t*>(pixels.data()));
+    } else {
+      for (size_t i = 0; i < pixels.size(); i++) {
+        size_t bit = i * kInputBitlen;
+        frame[bit / 8] |= static_cast<uint8_t>(pixels[i] << (bit % 8));
+      }
+    }
+    converted.push_back(std::move(frame));
+  }
+  return converted;
+}
+
+// Zeros the bytes of plane outside [begin, end).
+void clear_outside(std::vector<uint8_t>* plane, size_t begin, size_t end) {
+  for (size_t i = 0; i < plane->size(); i++) {
+    if (i < begin || i >= end) {
+      (*plane)[i] = 0;
+    }
+  }
+}
+
+std::vector<uint8_t> random_plane(Rng& rng, size_t size, uint32_t percent) {
+  std::vector<uint8_t> plane(size);
+  for (auto& b : plane) {
+    b = rng.bits(percent);
+  }
+  return plane;
+}
+
+std::vector<uint8_t> random_frame(Rng& rng, uint32_t width, uint32_t height) {
+  std::vector<uint8_t> frame(static_cast<size_t>(width) * height);
+  for (auto& px : frame) {
+    px = static_cast<uint8_t>(rng.next() & ((1u << kInputBitlen) - 1));
+  }
+  return frame;
+}
+
+std::vector<uint8_t> first_plane(const std::vector<uint8_t>& frame,
+                                 uint32_t width, uint32_t height) {
+  size_t plane_size = static_cast<size_t>(width) * height / 8;
+  std::vector<uint8_t> packed(plane_size * kInputBitlen, 0);
+  FrameUtil::Helper::Split(packed.data(), static_cast<uint16_t>(width),
+                           static_cast<uint16_t>(height), kInputBitlen,
+                           const_cast<uint8_t*>(frame.data()));
+  packed.resize(plane_size);
+  return packed;
+}
+
+uint32_t plane_checksum(const std::vector<uint8_t>& plane,
+                        const std::vector<uint8_t>* mask) {
+  if (mask) {
+    return FrameUtil::Helper::ChecksumWithMask(plane.data(), mask->data(),
+                                               plane.size(), false);
+  }
+  return FrameUtil::Helper::Checksum(plane.data(), plane.size(), false);
+}
+
+bool valid_pal_mask_size(size_t size) {
+  return size == 256 || size == 512 || size == 1536;
+}
+
+bool build_project(const Scenario& sc, const Options& opt, Project* project) {
+  Rng rng(sc.mode * 7919u + sc.width * 31u + sc.height + sc.masks * 131u);
+  Rng repeat_rng(opt.repeat_planes);
+  Rng overlay_rng(opt.overlay_area);
+  size_t plane_size = static_cast<size_t>(sc.width) * sc.height / 8;
+  // Only replacing modes can render sequences larger than the input.
+  bool doubled =
+      opt.double_size && (sc.mode == 1 || sc.mode == 6 || sc.mode == 7);
+
+  vni::PalFile pal;
+  pal.version = 1;
+  if (valid_pal_mask_size(plane_size)) {
+    for (uint32_t i = 0; i < sc.masks && i < 255; i++) {
+      pal.masks.push_back(random_plane(rng, plane_size, 50));
+    }
+  } else if (sc.masks > 0) {
+    fprintf(stderr,
+            "vni_bench: PAL masks need 256, 512 or 1536 byte planes, "
+            "ignoring them for %ux%u\n",
+            sc.width, sc.height);
+  }
+  // LCM sequences need at least one mask, otherwise detect_lcm never runs.
+  uint32_t seq_masks = std::max<uint32_t>(sc.masks, is_lcm(sc.mode) ? 1 : 0);
+
+  vni::VniFile vni;
+  std::vector<std::vector<uint8_t>> trigger_frames;
+  std::vector<std::vector<std::vector<uint8_t>>> follow_inputs;
+  for (uint32_t s = 0; s < opt.sequences; s++) {
+    trigger_frames.push_back(random_frame(rng, sc.width, sc.height));
+    if (sc.mode == 0 || sc.mode == 3) {
+      continue;
+    }
+    vni::FrameSeq seq;
+    seq.name = "seq" + std::to_string(s);
+    seq.size = vni::Dimensions(doubled ? sc.width * 2 : sc.width,
+                               doubled ? sc.height * 2 : sc.height);
+    size_t seq_plane = seq.size.surface() / 8;
+    std::vector<std::vector<uint8_t>> seq_mask_data;
+    if (is_lcm(sc.mode)) {
+      for (uint32_t m = 0; m < seq_masks; m++) {
+        seq_mask_data.push_back(random_plane(rng, plane_size, 50));
+        seq.add_mask(seq_mask_data.back());
+      }
+    }
+    std::vector<std::vector<uint8_t>> inputs;
+    std::vector<std::vector<uint8_t>> last_planes;
+    for (uint32_t f = 0; f < opt.frames_per_seq; f++) {
+      vni::AnimationFrame frame;
+      // Overlays of layered color masks are mostly empty, replacements and
+      // color masks are full frames.
+      uint32_t density = is_lcm(sc.mode) ? 10 : 50;
+      std::vector<std::vector<uint8_t>> planes;
+      for (uint8_t p = 0; p < kOutputPlanes; p++) {
+        // Static parts of an animation repeat the previous frame's plane.
+        if (f > 0 && opt.repeat_planes > 0 &&
+            repeat_rng.next() % 100 < opt.repeat_planes) {
+          planes.push_back(last_planes[p]);
+        } else {
+          planes.push_back(random_plane(rng, seq_plane, density));
+        }
+      }
+      last_planes = planes;
+      std::vector<uint8_t> frame_mask;
+      if (sc.mode == 7) {
+        frame_mask = random_plane(rng, seq_plane, 20);
+      }
+      if (is_lcm(sc.mode) && opt.overlay_area > 0) {
+        // Real overlays are small colored areas, keep a band of rows.
+        size_t rows = seq.size.height;
+        size_t band = std::max<size_t>(1, rows * opt.overlay_area / 100);
+        size_t top = overlay_rng.next() % (rows - band + 1);
+        size_t row_bytes = seq.size.width / 8;
+        clear_outside(&frame_mask, top * row_bytes, (top + band) * row_bytes);
+        for (auto& plane : planes) {
+          clear_outside(&plane, top * row_bytes, (top + band) * row_bytes);
+        }
+      }
+      if (is_lcm(sc.mode) && f % opt.lcm_layers != 0) {
+        // Layers of a group share the first frame's input, every input
+        // frame ORs lcm_layers overlays.
+        frame.hash = seq.frames.back().hash;
+        inputs.push_back(inputs.back());
+      } else if (is_follow(sc.mode) || is_lcm(sc.mode)) {
+        auto input = random_frame(rng, sc.width, sc.height);
+        auto plane = first_plane(input, sc.width, sc.height);
+        const std::vector<uint8_t>* mask = nullptr;
+        if (is_follow(sc.mode) && !pal.masks.empty()) {
+          mask = &pal.masks[f % pal.masks.size()];
+        } else if (is_lcm(sc.mode)) {
+          mask = &seq_mask_data[f % seq_mask_data.size()];
+        }
+        frame.hash = plane_checksum(plane, mask);
+        inputs.push_back(std::move(input));
+      }
+      seq.add_frame(frame, planes, {}, frame_mask);
+    }
+    follow_inputs.push_back(std::move(inputs));
+    vni.animations.push_back(std::move(seq));
+  }
+
+  // Sequences no mapping references, like authoring leftovers, written
+  // after the real ones in turn. Their own generator keeps the rest of the
+  // project the same with and without them.
+  std::vector<size_t> written_index;
+  for (size_t i = 0; i < vni.animations.size(); i++) {
+    written_index.push_back(i);
+  }
+  if (!vni.animations.empty() && opt.orphans > 0) {
+    Rng orphan_rng(0x0f0f + opt.orphans);
+    std::vector<vni::FrameSeq> orphans;
+    for (uint32_t o = 0; o < opt.orphans; o++) {
+      vni::FrameSeq seq;
+      seq.name = "orphan" + std::to_string(o);
+      seq.size = vni.animations.front().size;
+      size_t seq_plane = seq.size.surface() / 8;
+      for (uint32_t f = 0; f < opt.frames_per_seq; f++) {
+        std::vector<std::vector<uint8_t>> planes;
+        for (uint8_t p = 0; p < kOutputPlanes; p++) {
+          planes.push_back(random_plane(orphan_rng, seq_plane, 50));
+        }
+        seq.add_frame(vni::AnimationFrame(), planes, {}, {});
+      }
+      orphans.push_back(std::move(seq));
+    }
+    vni::HookVector<vni::FrameSeq> mixed;
+    size_t o = 0;
+    for (size_t i = 0; i < vni.animations.size(); i++) {
+      written_index[i] = mixed.size();
+      mixed.push_back(std::move(vni.animations[i]));
+      if (o < orphans.size()) {
+        mixed.push_back(std::move(orphans[o++]));
+      }
+    }
+    for (; o < orphans.size(); o++) {
+      mixed.push_back(std::move(orphans[o]));
+    }
+    vni.animations = std::move(mixed);
+  }
+
+  vni::VniWriteResult written;
+  if (!vni.animations.empty()) {
+    vni::VniWriteOptions write_options;
+    write_options.compress = opt.compress;
+    std::ostringstream out;
+    if (!vni::write_vni_file(out, vni, write_options, &written)) {
+      return false;
+    }
+    project->vni = out.str();
+  }
+
+  uint16_t num_palettes = 8;
+  for (uint16_t i = 0; i < num_palettes; i++) {
+    vni::Palette palette;
+    palette.index = i;
+    palette.type = i == 0 ? 2 : 0;  // first palette is the default one
+    for (uint32_t c = 0; c < 16; c++) {
+      palette.colors.push_back(static_cast<uint8_t>(c * 16 + i));
+      palette.colors.push_back(static_cast<uint8_t>(255 - c * 16));
+      palette.colors.push_back(static_cast<uint8_t>(i * 32));
+    }
+    pal.palettes.push_back(std::move(palette));
+  }
+  for (uint32_t s = 0; s < opt.sequences; s++) {
+    auto plane = first_plane(trigger_frames[s], sc.width, sc.height);
+    // With PAL masks the trigger only matches through the last mask, so
+    // every lookup probes the full mask list.
+    const std::vector<uint8_t>* mask =
+        pal.masks.empty() ? nullptr : &pal.masks.back();
+    vni::Mapping mapping;
+    mapping.checksum = plane_checksum(plane, mask);
+    mapping.mode = static_cast<vni::SwitchMode>(sc.mode);
+    mapping.palette_index =
+        static_cast<uint16_t>(1 + s % (num_palettes - 1));
+    mapping.offset =
+        written.offsets.empty() ? 0 : written.offsets[written_index[s]];
+    pal.mappings.emplace(mapping.checksum, mapping);
+  }
+  std::ostringstream pal_out;
+  if (!vni::write_pal_file(pal_out, pal)) {
+    return false;
+  }
+  project->pal = pal_out.str();
+
+  std::vector<std::vector<uint8_t>> gameplay;
+  for (int i = 0; i < 64; i++) {
+    gameplay.push_back(random_frame(rng, sc.width, sc.height));
+  }
+  uint32_t total = opt.warmup + opt.frames;
+  uint32_t s = 0;
+  size_t g = 0;
+  while (project->trace.size() < total) {
+    project->trace.push_back(trigger_frames[s]);
+    for (uint32_t f = 0; f < opt.frames_per_seq; f++) {
+      if (is_follow(sc.mode) || is_lcm(sc.mode)) {
+        project->trace.push_back(follow_inputs[s][f]);
+      } else {
+        project->trace.push_back(gameplay[g++ % gameplay.size()]);
+      }
+    }
+    s = (s + 1) % opt.sequences;
+  }
+  project->trace.resize(total);
+  return true;
+}
+
+bool write_file(const std::filesystem::path& path, const std::string& data) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    return false;
+  }
+  out.write(data.data(), static_cast<std::streamsize>(data.size()));
+  return out.good();
+}
+
+// Heap bytes currently allocated, or -1 where the C library can't tell.
+int64_t heap_in_use() {
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  return static_cast<int64_t>(mallinfo2().uordblks);
+#else
+  return -1;
+#endif
+}
+
+double stage_mean(const Vni_Stage_Stats& stage) {
+  return stage.count ? static_cast<double>(stage.total_ns) / stage.count : 0.0;
+}
+
+bool run_scenario(const Scenario& sc, const Options& opt, FILE* out) {
+  Project project;
+  if (!build_project(sc, opt, &project)) {
+    fprintf(stderr, "vni_bench: unable to build the synthetic project\n");
+    return false;
+  }
+
+  char label[96];
+  snprintf(label, sizeof(label), "%s-%ux%u-m%u%s", mode_name(sc.mode),
+           sc.width, sc.height, sc.masks, opt.double_size ? "-2x" : "");
+
+  std::filesystem::path dir(opt.dir);
+  std::filesystem::path pal_path = dir / (std::string(label) + ".pal");
+  std::filesystem::path vni_path = dir / (std::string(label) + ".vni");
+  if (!write_file(pal_path, project.pal) ||
+      (!project.vni.empty() && !write_file(vni_path, project.vni))) {
+    fprintf(stderr, "vni_bench: unable to write project files to %s\n",
+            opt.dir.c_str());
+    return false;
+  }
+  std::string pal_str = pal_path.string();
+  std::string vni_str = vni_path.string();
+  const char* vni_arg = project.vni.empty() ? nullptr : vni_str.c_str();
+
+  Vni_Load_Options load_options = {};
+  load_options.prune_unreachable = opt.prune ? 1 : 0;
+  load_options.dedup_planes = opt.dedup ? 1 : 0;
+  if (opt.frame_cache >= 0) {
+    load_options.keep_compressed = 1;
+    load_options.frame_cache_bytes = static_cast<uint64_t>(opt.frame_cache);
+  }
+  Vni_Allocator allocator = {hook_alloc, hook_free, nullptr, 0};
+  if (opt.memory_budget >= 0) {
+    allocator.budget_bytes = static_cast<uint64_t>(opt.memory_budget);
+    load_options.allocator = &allocator;
+  }
+  g_hook_peak.store(0);
+  auto load = [&]() {
+    return Vni_LoadFromPathsWithOptions(pal_str.c_str(), vni_arg, nullptr,
+                                        nullptr, &load_options);
+  };
+
+  std::vector<double> load_ms;
+  for (uint32_t i = 0; i < std::max<uint32_t>(opt.load_runs, 1); i++) {
+    auto start = std::chrono::steady_clock::now();
+    Vni_Context* ctx = load();
+    auto end = std::chrono::steady_clock::now();
+    if (!ctx) {
+      fprintf(stderr, "vni_bench: %s failed to load\n", label);
+      return false;
+    }
+    Vni_Dispose(ctx);
+    load_ms.push_back(
+        std::chrono::duration<double, std::milli>(end - start).count());
+  }
+  std::sort(load_ms.begin(), load_ms.end());
+
+  uint64_t allocations_before = g_allocations.load(std::memory_order_relaxed);
+  int64_t heap_before = heap_in_use();
+  Vni_Context* ctx = load();
+  if (!ctx) {
+    fprintf(stderr, "vni_bench: %s failed to load\n", label);
+    return false;
+  }
+  uint64_t load_allocations =
+      g_allocations.load(std::memory_order_relaxed) - allocations_before;
+  int64_t load_heap_bytes =
+      heap_before >= 0 ? heap_in_use() - heap_before : -1;
+  if (opt.record) {
+    std::string trace = (dir / (std::string(label) + ".trace")).string();
+    if (!Vni_StartRecording(ctx, trace.c_str())) {
+      Vni_Dispose(ctx);
+      return false;
+    }
+  }
+  Vni_SetScalerMode(ctx, opt.scaler);
+  Vni_SetReplaceCacheLimit(ctx, opt.replace_cache);
+  Vni_SetOutputMode(ctx,
+                    opt.bitplanes ? VNI_OUTPUT_BITPLANES : VNI_OUTPUT_INDEXED);
+
+  std::vector<uint64_t> latencies;
+  latencies.reserve(opt.frames);
+  uint64_t digest = kDigestSeed;
+  uint64_t outputs = 0;
+  uint64_t events = 0;
+  std::vector<uint8_t> joined;
+  std::vector<std::vector<uint8_t>> input;
+  if (opt.input != Input::Indexed) {
+    input = convert_trace(project.trace, opt.input, sc.width, sc.height);
+  }
+  auto bench_start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < project.trace.size(); i++) {
+    if (i == opt.warmup) {
+      Vni_ResetStats(ctx);
+      Vni_SetSpanTracing(ctx, opt.spans ? 1 : 0);
+      bench_start = std::chrono::steady_clock::now();
+    }
+    if (opt.reload_every > 0 && i % opt.reload_every == 0) {
+      Vni_Reload(ctx, pal_str.c_str(), vni_arg, nullptr, nullptr,
+                 &load_options);
+    }
+    auto start = std::chrono::steady_clock::now();
+    uint32_t has_frame = 0;
+    if (opt.input == Input::Planes) {
+      has_frame = Vni_ColorizePlanes(ctx, input[i].data(), sc.width,
+                                     sc.height, kInputBitlen);
+    } else if (opt.input == Input::Packed) {
+      has_frame = Vni_ColorizePacked(ctx, input[i].data(), sc.width,
+                                     sc.height, kInputBitlen);
+    } else {
+      has_frame = Vni_Colorize(ctx, project.trace[i].data(), sc.width,
+                               sc.height, kInputBitlen);
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (i >= opt.warmup) {
+      latencies.push_back(static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+              .count()));
+    }
+    if (has_frame && opt.bitplanes) {
+      // Digest the joined pixels, so both output modes digest the same.
+      const Vni_Planes_Struc* planes = Vni_GetPlanes(ctx);
+      joined.assign(static_cast<size_t>(planes->width) * planes->height, 0);
+      FrameUtil::Helper::Join(joined.data(),
+                              static_cast<uint16_t>(planes->width),
+                              static_cast<uint16_t>(planes->height),
+                              planes->bitlen, planes->planes);
+      digest = fnv1a(digest, joined.data(), joined.size());
+      digest = fnv1a(digest, planes->palette, (1u << planes->bitlen) * 3u);
+      outputs++;
+    } else if (has_frame) {
+      const Vni_Frame_Struc* frame = Vni_GetFrame(ctx);
+      digest = fnv1a(digest, frame->frame,
+                     static_cast<size_t>(frame->width) * frame->height);
+      digest = fnv1a(digest, frame->palette, (1u << frame->bitlen) * 3u);
+      outputs++;
+    }
+    Vni_Event event;
+    while (Vni_PollEvent(ctx, &event)) {
+      digest = fnv1a(digest, reinterpret_cast<const uint8_t*>(&event.checksum),
+                     sizeof(event.checksum));
+      events++;
+    }
+  }
+  auto bench_end = std::chrono::steady_clock::now();
+  double seconds =
+      std::chrono::duration<double>(bench_end - bench_start).count();
+
+  Vni_Stats stats;
+  bool has_stats = Vni_GetStats(ctx, &stats) != 0;
+  Vni_Memory_Usage memory;
+  Vni_GetMemoryUsage(ctx, &memory, nullptr, 0);
+  if (opt.spans) {
+    std::string spans = (dir / (std::string(label) + ".spans.json")).string();
+    if (!Vni_FlushSpanTrace(ctx, spans.c_str())) {
+      fprintf(stderr, "vni_bench: unable to write %s\n", spans.c_str());
+    }
+  }
+  Vni_Dispose(ctx);
+
+  std::vector<uint64_t> sorted = latencies;
+  std::sort(sorted.begin(), sorted.end());
+  double fps = seconds > 0 ? latencies.size() / seconds : 0.0;
+
+  JsonLine json;
+  json.add_str("scenario", label);
+  json.add_str("mode", mode_name(sc.mode));
+  json.add_u64("width", sc.width);
+  json.add_u64("height", sc.height);
+  json.add_u64("masks", sc.masks);
+  json.add_u64("sequences", opt.sequences);
+  json.add_u64("frames_per_seq", opt.frames_per_seq);
+  json.add_bool("double", opt.double_size);
+  json.add_bool("compressed", opt.compress);
+  json.add_u64("scaler", opt.scaler);
+  json.add_u64("replace_cache", opt.replace_cache);
+  json.add_u64("reload_every", opt.reload_every);
+  json.add_u64("lcm_layers", opt.lcm_layers);
+  json.add_u64("orphans", opt.orphans);
+  json.add_bool("prune", opt.prune);
+  json.add_u64("repeat_planes", opt.repeat_planes);
+  json.add_bool("dedup", opt.dedup);
+  json.add_u64("overlay_area", opt.overlay_area);
+  json.add_str("input", input_name(opt.input));
+  json.add_str("output", opt.bitplanes ? "bitplanes" : "indexed");
+  if (opt.frame_cache >= 0) {
+    json.add_u64("frame_cache", static_cast<uint64_t>(opt.frame_cache));
+  }
+  if (opt.memory_budget >= 0) {
+    json.add_u64("memory_budget", static_cast<uint64_t>(opt.memory_budget));
+    json.add_u64("memory_peak_bytes", g_hook_peak.load());
+  }
+  json.add_u64("pal_bytes", project.pal.size());
+  json.add_u64("vni_bytes", project.vni.size());
+  json.begin("load_ms");
+  json.add_f("min", load_ms.front(), 3);
+  json.add_f("median", load_ms[load_ms.size() / 2], 3);
+  json.add_f("max", load_ms.back(), 3);
+  json.end();
+  json.add_u64("load_allocations", load_allocations);
+  if (load_heap_bytes >= 0) {
+    json.add_u64("load_heap_bytes", static_cast<uint64_t>(load_heap_bytes));
+  }
+  json.add_u64("frames", latencies.size());
+  json.add_u64("outputs", outputs);
+  json.add_u64("events", events);
+  json.add_f("throughput_fps", fps, 1);
+  add_latency(&json, sorted);
+  json.add_hex("digest", digest, 16);
+  json.begin("memory");
+  json.add_u64("palettes", memory.palettes);
+  json.add_u64("mappings", memory.mappings);
+  json.add_u64("masks", memory.masks);
+  json.add_u64("sequence_metadata", memory.sequence_metadata);
+  json.add_u64("frame_data", memory.frame_data);
+  json.add_u64("plane_store", memory.plane_store);
+  json.add_u64("frame_cache", memory.frame_cache);
+  json.add_u64("sequence_runtime", memory.sequence_runtime);
+  json.add_u64("context", memory.context);
+  json.add_u64("diagnostics", memory.diagnostics);
+  json.add_u64("output", memory.output);
+  json.add_u64("allocations", memory.allocations);
+  json.add_u64("allocator_overhead", memory.allocator_overhead);
+  json.add_u64("total", memory.total);
+  json.add_u64("allocator_bytes", memory.allocator_bytes);
+  json.end();
+  if (has_stats) {
+    json.begin("stats");
+    json.add_u64("mapping_lookups", stats.mapping_lookups);
+    json.add_u64("mapping_hits", stats.mapping_hits);
+    json.add_u64("masked_checksums", stats.masked_checksums);
+    json.add_f("masked_checksums_per_frame",
+               stats.frames ? static_cast<double>(stats.masked_checksums) /
+                                  static_cast<double>(stats.frames)
+                            : 0.0,
+               2);
+    json.add_u64("lcm_detections", stats.lcm_detections);
+    json.add_u64("follow_detections", stats.follow_detections);
+    json.add_u64("replace_cache_hits", stats.replace_cache_hits);
+    json.add_u64("replace_cache_bytes", stats.replace_cache_bytes);
+    json.add_u64("reloads", stats.reloads);
+    json.add_u64("ticks", stats.ticks);
+    json.add_u64("frame_cache_hits", stats.frame_cache_hits);
+    json.add_u64("frame_cache_misses", stats.frame_cache_misses);
+    json.add_u64("frame_cache_evictions", stats.frame_cache_evictions);
+    json.add_u64("frame_cache_bytes", stats.frame_cache_bytes);
+    json.add_u64("pruned_sequences", stats.pruned_sequences);
+    json.add_u64("pruned_bytes", stats.pruned_bytes);
+    json.add_u64("sparse_frames", stats.sparse_frames);
+    json.add_u64("sparse_bytes_saved", stats.sparse_bytes_saved);
+    if (opt.dedup) {
+      json.add_u64("plane_store_refs", stats.plane_store_refs);
+      json.add_u64("plane_store_planes", stats.plane_store_planes);
+      json.add_u64("plane_store_ref_bytes", stats.plane_store_ref_bytes);
+      json.add_u64("plane_store_bytes", stats.plane_store_bytes);
+      json.add_f("dedup_ratio",
+                 stats.plane_store_bytes
+                     ? static_cast<double>(stats.plane_store_ref_bytes) /
+                           static_cast<double>(stats.plane_store_bytes)
+                     : 0.0,
+                 2);
+    }
+    json.begin("stage_mean_ns");
+    json.add_f("split", stage_mean(stats.split), 1);
+    json.add_f("trigger", stage_mean(stats.trigger), 1);
+    json.add_f("render", stage_mean(stats.render), 1);
+    json.add_f("join", stage_mean(stats.join), 1);
+    json.add_f("palette", stage_mean(stats.palette), 1);
+    json.end();
+    json.end();
+  }
+  fprintf(out, "%s\n", json.finish().c_str());
+  fflush(out);
+
+  fprintf(stderr,
+          "%-28s load %8.3f ms  p50 %8llu ns  p99 %8llu ns  %10.1f fps\n",
+          label, load_ms[load_ms.size() / 2],
+          static_cast<unsigned long long>(percentile(sorted, 0.50)),
+          static_cast<unsigned long long>(percentile(sorted, 0.99)), fps);
+
+  if (!opt.keep) {
+    std::error_code ec;
+    std::filesystem::remove(pal_path, ec);
+    std::filesystem::remove(vni_path, ec);
+  }
+  return true;
+}
+
+template <typename T>
+bool parse_list(const char* arg, std::vector<T>* out,
+                bool (*parse)(const std::string&, T*)) {
+  out->clear();
+  std::string list(arg);
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    T value;
+    if (!parse(list.substr(start, end - start), &value)) {
+      return false;
+    }
+    out->push_back(value);
+    start = end + 1;
+  }
+  return !out->empty();
+}
+
+constexpr vni::Crc32Engine kCrcEngines[] = {
+    vni::Crc32Engine::Slice8, vni::Crc32Engine::Slice16,
+    vni::Crc32Engine::Pclmul, vni::Crc32Engine::ArmCrc};
+
+// Checks every CRC-32 engine this CPU supports against FrameUtil on random
+// data of every length up to a few frames, with and without mask and bit
+// reversal, then measures each engine's throughput on plane sized inputs.
+bool run_crc(FILE* out) {
+  using Clock = std::chrono::steady_clock;
+  Rng rng(40);
+  std::vector<uint8_t> data = random_plane(rng, 2112, 50);
+  std::vector<uint8_t> mask = random_plane(rng, 2112, 50);
+  uint32_t mismatches = 0;
+  for (auto engine : kCrcEngines) {
+    if (!vni::crc32_engine_supported(engine)) {
+      continue;
+    }
+    for (size_t len = 0; len <= data.size(); len++) {
+      for (size_t offset : {0, 1}) {
+        if (offset > len) {
+          continue;
+        }
+        const uint8_t* d = data.data() + offset;
+        const uint8_t* m = mask.data() + offset;
+        size_t n = len - offset;
+        for (bool reverse : {false, true}) {
+          if (vni::crc32_with(engine, d, nullptr, n, reverse) !=
+                  FrameUtil::Helper::Checksum(d, n, reverse) ||
+              vni::crc32_with(engine, d, m, n, reverse) !=
+                  FrameUtil::Helper::ChecksumWithMask(d, m, n, reverse)) {
+            if (mismatches++ < 8) {
+              fprintf(stderr,
+                      "vni_bench: crc32 %s mismatch at length %zu offset %zu "
+                      "reverse %d\n",
+                      vni::crc32_engine_name(engine), n, offset, reverse);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  for (auto engine : kCrcEngines) {
+    if (!vni::crc32_engine_supported(engine)) {
+      continue;
+    }
+    for (size_t size : {256, 512, 1536, 2048}) {
+      for (bool masked : {false, true}) {
+        const uint32_t reps = 200000000 / 64 / static_cast<uint32_t>(size);
+        uint32_t sink = 0;
+        auto start = Clock::now();
+        for (uint32_t r = 0; r < reps; r++) {
+          sink += vni::crc32_with(engine, data.data(),
+                                  masked ? mask.data() : nullptr, size, false);
+        }
+        double secs =
+            std::chrono::duration<double>(Clock::now() - start).count();
+        fprintf(out,
+                "{\"crc32_engine\":\"%s\",\"default\":%s,\"bytes\":%zu,"
+                "\"masked\":%s,\"mb_per_s\":%.1f,\"ns_per_call\":%.1f,"
+                "\"sink\":%u}\n",
+                vni::crc32_engine_name(engine),
+                engine == vni::crc32_engine() ? "true" : "false", size,
+                masked ? "true" : "false",
+                static_cast<double>(size) * reps / secs / 1e6,
+                secs * 1e9 / reps, sink);
+      }
+    }
+  }
+  fprintf(out, "{\"crc32_mismatches\":%u}\n", mismatches);
+  return mismatches == 0;
+}
+
+bool parse_size(const std::string& s, std::pair<uint32_t, uint32_t>* out) {
+  size_t x = s.find('x');
+  if (x == std::string::npos) {
+    return false;
+  }
+  return parse_u32(s.substr(0, x).c_str(), &out->first) &&
+         parse_u32(s.substr(x + 1).c_str(), &out->second) &&
+         out->first % 8 == 0 && out->first > 0 && out->second > 0;
+}
+
+bool parse_count(const std::string& s, uint32_t* out) {
+  return parse_u32(s.c_str(), out);
+}
+
+bool parse_mode(const std::string& s, uint8_t* out) {
+  for (const auto& info : kModes) {
+    if (s == info.name) {
+      *out = info.mode;
+      return true;
+    }
+  }
+  return false;
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: vni_bench [options]\n"
+          "  --mode LIST            palette,replace,colormask,event,follow,\n"
+          "                         lcm,followreplace,maskedreplace (default "
+          "all)\n"
+          "  --size LIST            input frame sizes, e.g. 128x32,192x64\n"
+          "  --masks LIST           PAL/sequence mask counts, e.g. 0,8\n"
+          "  --sequences N          sequences (and mappings) per project\n"
+          "  --frames-per-seq N     frames per sequence\n"
+          "  --frames N             measured frames per scenario\n"
+          "  --warmup N             unmeasured frames before measuring\n"
+          "  --load-runs N          repetitions of the load measurement\n"
+          "  --double               replacement sequences at twice the size\n"
+          "  --compress             store frames heatshrink compressed\n"
+          "  --scaler N             0 = none, 1 = scale2x, 2 = doubled\n"
+          "  --replace-cache BYTES  joined Replace frame cache limit\n"
+          "  --frame-cache BYTES    keep frames compressed, decode into an "
+          "LRU\n"
+          "                         cache of BYTES (needs --compress)\n"
+          "  --reload-every N       hot reload the project every N frames\n"
+          "  --lcm-layers N         LCM overlays matching each input frame\n"
+          "  --orphans N            add N sequences no mapping references\n"
+          "  --prune                load with prune_unreachable\n"
+          "  --repeat-planes PCT    repeat this percentage of planes from the "
+          "previous\n"
+          "                         frame\n"
+          "  --dedup                load with dedup_planes\n"
+          "  --overlay-area PCT     LCM overlays cover a band of PCT percent "
+          "of the\n"
+          "                         rows\n"
+          "  --memory-budget BYTES  allocate through Vni_Allocator with this "
+          "budget\n"
+          "                         (0 = unlimited)\n"
+          "  --input FORMAT         indexed, planes or packed input frames "
+          "(default\n"
+          "                         indexed)\n"
+          "  --bitplanes            bitplane output instead of indexed "
+          "pixels\n"
+          "  --crc                  check and time the CRC-32 engines "
+          "instead\n"
+          "  --dir PATH             where project files are generated\n"
+          "  --keep                 keep generated project files\n"
+          "  --record               record the inputs of every scenario to "
+          "a trace\n"
+          "                         in --dir, see vni-replay\n"
+          "  --spans                trace the measured frames to a Chrome "
+          "trace-event\n"
+          "                         file in --dir\n"
+          "  --out PATH             write JSON lines to PATH (default "
+          "stdout)\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opt;
+  for (const auto& info : kModes) {
+    opt.modes.push_back(info.mode);
+  }
+  opt.sizes = {{128, 32}, {192, 64}};
+  opt.mask_counts = {0, 8};
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    bool ok = true;
+    if (arg == "--double") {
+      opt.double_size = true;
+      continue;
+    } else if (arg == "--compress") {
+      opt.compress = true;
+      continue;
+    } else if (arg == "--bitplanes") {
+      opt.bitplanes = true;
+      continue;
+    } else if (arg == "--keep") {
+      opt.keep = true;
+      continue;
+    } else if (arg == "--crc") {
+      opt.crc = true;
+      continue;
+    } else if (arg == "--record") {
+      opt.record = true;
+      continue;
+    } else if (arg == "--spans") {
+      opt.spans = true;
+      continue;
+    } else if (arg == "--prune") {
+      opt.prune = true;
+      continue;
+    } else if (arg == "--dedup") {
+      opt.dedup = true;
+      continue;
+    } else if (arg == "--help" || arg == "-h") {
+      usage();
+      return 0;
+    } else if (!value) {
+      ok = false;
+    } else if (arg == "--mode") {
+      ok = std::string(value) == "all" || parse_list(value, &opt.modes,
+                                                     parse_mode);
+    } else if (arg == "--size") {
+      ok = parse_list(value, &opt.sizes, parse_size);
+    } else if (arg == "--masks") {
+      ok = parse_list(value, &opt.mask_counts, parse_count);
+    } else if (arg == "--sequences") {
+      ok = parse_u32(value, &opt.sequences) && opt.sequences > 0 &&
+           opt.sequences < 65536;
+    } else if (arg == "--frames-per-seq") {
+      ok = parse_u32(value, &opt.frames_per_seq) && opt.frames_per_seq > 0 &&
+           opt.frames_per_seq < 65536;
+    } else if (arg == "--frames") {
+      ok = parse_u32(value, &opt.frames) && opt.frames > 0;
+    } else if (arg == "--warmup") {
+      ok = parse_u32(value, &opt.warmup);
+    } else if (arg == "--load-runs") {
+      ok = parse_u32(value, &opt.load_runs);
+    } else if (arg == "--scaler") {
+      ok = parse_u32(value, &opt.scaler) && opt.scaler <= 2;
+    } else if (arg == "--replace-cache") {
+      ok = parse_u64(value, &opt.replace_cache);
+    } else if (arg == "--frame-cache") {
+      uint64_t bytes = 0;
+      ok = parse_u64(value, &bytes) && bytes <= INT64_MAX;
+      opt.frame_cache = static_cast<int64_t>(bytes);
+    } else if (arg == "--reload-every") {
+      ok = parse_u32(value, &opt.reload_every);
+    } else if (arg == "--memory-budget") {
+      uint64_t bytes = 0;
+      ok = parse_u64(value, &bytes) && bytes <= INT64_MAX;
+      opt.memory_budget = static_cast<int64_t>(bytes);
+    } else if (arg == "--lcm-layers") {
+      ok = parse_u32(value, &opt.lcm_layers) && opt.lcm_layers > 0;
+    } else if (arg == "--overlay-area") {
+      ok = parse_u32(value, &opt.overlay_area) && opt.overlay_area <= 100;
+    } else if (arg == "--repeat-planes") {
+      ok = parse_u32(value, &opt.repeat_planes) && opt.repeat_planes <= 100;
+    } else if (arg == "--orphans") {
+      ok = parse_u32(value, &opt.orphans) && opt.orphans < 65536;
+    } else if (arg == "--input") {
+      std::string format = value;
+      if (format == "indexed") {
+        opt.input = Input::Indexed;
+      } else if (format == "planes") {
+        opt.input = Input::Planes;
+      } else if (format == "packed") {
+        opt.input = Input::Packed;
+      } else {
+        ok = false;
+      }
+    } else if (arg == "--dir") {
+      opt.dir = value;
+    } else if (arg == "--out") {
+      opt.out = value;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, "vni_bench: invalid argument %s\n", arg.c_str());
+      usage();
+      return 1;
+    }
+    i++;
+  }
+
+  if (opt.dir.empty()) {
+    opt.dir = (std::filesystem::temp_directory_path() / "vni_bench").string();
+  }
+  std::error_code ec;
+  std::filesystem::create_directories(opt.dir, ec);
+
+  FILE* out = stdout;
+  if (!opt.out.empty()) {
+    out = fopen(opt.out.c_str(), "w");
+    if (!out) {
+      fprintf(stderr, "vni_bench: unable to open %s\n", opt.out.c_str());
+      return 1;
+    }
+  }
+
+  int failures = 0;
+  if (opt.crc) {
+    failures += run_crc(out) ? 0 : 1;
+    opt.modes.clear();
+  }
+  for (uint8_t mode : opt.modes) {
+    for (const auto& size : opt.sizes) {
+      for (uint32_t masks : opt.mask_counts) {
+        Scenario sc;
+        sc.mode = mode;
+        sc.width = size.first;
+        sc.height = size.second;
+        sc.masks = masks;
+        if (!run_scenario(sc, opt, out)) {
+          failures++;
+        }
+      }
+    }
+  }
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  return failures == 0 ? 0 : 1;
+}
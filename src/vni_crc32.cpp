@@ -0,0 +1,418 @@
+#include "vni_crc32.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+#define VNI_CRC32_X86 1
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define VNI_CRC32_ARM 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <windows.h>
+#else
+#include <arm_acle.h>
+#endif
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VNI_TARGET_PCLMUL __attribute__((target("pclmul,sse4.1,ssse3")))
+#if defined(__clang__)
+#define VNI_TARGET_CRC __attribute__((target("crc")))
+#else
+#define VNI_TARGET_CRC __attribute__((target("+crc")))
+#endif
+#else
+#define VNI_TARGET_PCLMUL
+#define VNI_TARGET_CRC
+#endif
+
+namespace vni {
+
+namespace {
+
+constexpr uint32_t kPolynomial = 0xedb88320;
+
+using CrcTables = std::array<std::array<uint32_t, 256>, 16>;
+
+// kTables[k][b] is the CRC of byte b followed by k zero bytes, the tables
+// of slice-by-8 and slice-by-16.
+constexpr CrcTables make_tables() {
+  CrcTables tables{};
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t crc = b;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (kPolynomial & (0u - (crc & 1)));
+    }
+    tables[0][b] = crc;
+  }
+  for (size_t k = 1; k < tables.size(); k++) {
+    for (uint32_t b = 0; b < 256; b++) {
+      uint32_t prev = tables[k - 1][b];
+      tables[k][b] = (prev >> 8) ^ tables[0][prev & 0xff];
+    }
+  }
+  return tables;
+}
+
+constexpr CrcTables kTables = make_tables();
+
+uint64_t load_le64(const uint8_t* p) {
+  uint64_t word;
+  std::memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+// Mirrors the bits of each byte of word.
+uint64_t reverse_byte_bits(uint64_t word) {
+  word = ((word >> 1) & 0x5555555555555555ull) |
+         ((word & 0x5555555555555555ull) << 1);
+  word = ((word >> 2) & 0x3333333333333333ull) |
+         ((word & 0x3333333333333333ull) << 2);
+  return ((word >> 4) & 0x0f0f0f0f0f0f0f0full) |
+         ((word & 0x0f0f0f0f0f0f0f0full) << 4);
+}
+
+// The bytes an engine checksums: data, optionally ANDed with a mask and bit
+// reversed. Resolved at compile time so the inner loops don't branch.
+template <bool kMasked, bool kReverse>
+struct Input {
+  const uint8_t* data;
+  const uint8_t* mask;
+
+  uint64_t word(size_t i) const {
+    uint64_t w = load_le64(data + i);
+    if (kMasked) {
+      w &= load_le64(mask + i);
+    }
+    return kReverse ? reverse_byte_bits(w) : w;
+  }
+
+  uint8_t byte(size_t i) const {
+    uint8_t b = kMasked ? static_cast<uint8_t>(data[i] & mask[i]) : data[i];
+    return kReverse ? static_cast<uint8_t>(reverse_byte_bits(b)) : b;
+  }
+};
+
+// The engines below take and return the CRC register, before the final
+// inversion.
+
+template <typename In>
+uint32_t crc_bytes(const In& in, size_t i, size_t len, uint32_t crc) {
+  for (; i < len; i++) {
+    crc = (crc >> 8) ^ kTables[0][(crc ^ in.byte(i)) & 0xff];
+  }
+  return crc;
+}
+
+template <typename In>
+uint32_t slice8(const In& in, size_t i, size_t len, uint32_t crc) {
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w = in.word(i) ^ crc;
+    crc = kTables[7][w & 0xff] ^ kTables[6][(w >> 8) & 0xff] ^
+          kTables[5][(w >> 16) & 0xff] ^ kTables[4][(w >> 24) & 0xff] ^
+          kTables[3][(w >> 32) & 0xff] ^ kTables[2][(w >> 40) & 0xff] ^
+          kTables[1][(w >> 48) & 0xff] ^ kTables[0][w >> 56];
+  }
+  return crc_bytes(in, i, len, crc);
+}
+
+template <typename In>
+uint32_t slice16(const In& in, size_t i, size_t len, uint32_t crc) {
+  for (; i + 16 <= len; i += 16) {
+    uint64_t a = in.word(i) ^ crc;
+    uint64_t b = in.word(i + 8);
+    crc = kTables[15][a & 0xff] ^ kTables[14][(a >> 8) & 0xff] ^
+          kTables[13][(a >> 16) & 0xff] ^ kTables[12][(a >> 24) & 0xff] ^
+          kTables[11][(a >> 32) & 0xff] ^ kTables[10][(a >> 40) & 0xff] ^
+          kTables[9][(a >> 48) & 0xff] ^ kTables[8][a >> 56] ^
+          kTables[7][b & 0xff] ^ kTables[6][(b >> 8) & 0xff] ^
+          kTables[5][(b >> 16) & 0xff] ^ kTables[4][(b >> 24) & 0xff] ^
+          kTables[3][(b >> 32) & 0xff] ^ kTables[2][(b >> 40) & 0xff] ^
+          kTables[1][(b >> 48) & 0xff] ^ kTables[0][b >> 56];
+  }
+  return slice8(in, i, len, crc);
+}
+
+#if defined(VNI_CRC32_X86)
+
+bool probe_pclmul() {
+  unsigned int ecx = 0;
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  ecx = static_cast<unsigned int>(info[2]);
+#else
+  unsigned int eax, ebx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+#endif
+  const unsigned int pclmul = 1u << 1, ssse3 = 1u << 9, sse41 = 1u << 19;
+  return (ecx & pclmul) && (ecx & ssse3) && (ecx & sse41);
+}
+
+// cpuid traps under some hypervisors, so it runs once.
+bool cpu_has_pclmul() {
+  static const bool supported = probe_pclmul();
+  return supported;
+}
+
+template <bool kMasked, bool kReverse>
+VNI_TARGET_PCLMUL __m128i load_block(const Input<kMasked, kReverse>& in,
+                                     size_t i) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in.data + i));
+  if (kMasked) {
+    v = _mm_and_si128(
+        v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(in.mask + i)));
+  }
+  if (kReverse) {
+    // Mirrored low nibble moves up, mirrored high nibble moves down.
+    const __m128i low_up = _mm_setr_epi8(
+        0x00, static_cast<char>(0x80), 0x40, static_cast<char>(0xc0), 0x20,
+        static_cast<char>(0xa0), 0x60, static_cast<char>(0xe0), 0x10,
+        static_cast<char>(0x90), 0x50, static_cast<char>(0xd0), 0x30,
+        static_cast<char>(0xb0), 0x70, static_cast<char>(0xf0));
+    const __m128i high_down = _mm_setr_epi8(0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6,
+                                            0xe, 0x1, 0x9, 0x5, 0xd, 0x3, 0xb,
+                                            0x7, 0xf);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i lo = _mm_and_si128(v, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    v = _mm_or_si128(_mm_shuffle_epi8(low_up, lo),
+                     _mm_shuffle_epi8(high_down, hi));
+  }
+  return v;
+}
+
+// Folds acc over the 128 bits that follow it and adds next.
+VNI_TARGET_PCLMUL __m128i fold16(__m128i acc, __m128i next, __m128i k3k4) {
+  __m128i lo = _mm_clmulepi64_si128(acc, k3k4, 0x00);
+  __m128i hi = _mm_clmulepi64_si128(acc, k3k4, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(hi, next), lo);
+}
+
+// Folds 16 byte blocks with carry-less multiplication and Barrett-reduces
+// the remainder (Intel, "Fast CRC Computation for Generic Polynomials Using
+// PCLMULQDQ"), the constants being those of the reflected IEEE polynomial.
+// Needs len >= 64, covers the multiple of 16 below len and leaves the rest
+// to slice16().
+template <bool kMasked, bool kReverse>
+VNI_TARGET_PCLMUL uint32_t pclmul(const Input<kMasked, kReverse>& in,
+                                  size_t len, uint32_t crc) {
+  if (len < 64) {
+    return slice16(in, 0, len, crc);
+  }
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+
+  __m128i x1 = load_block(in, 0x00);
+  __m128i x2 = load_block(in, 0x10);
+  __m128i x3 = load_block(in, 0x20);
+  __m128i x4 = load_block(in, 0x30);
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+
+  size_t i = 64;
+  for (; i + 64 <= len; i += 64) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), load_block(in, i + 0x00));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), load_block(in, i + 0x10));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), load_block(in, i + 0x20));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), load_block(in, i + 0x30));
+  }
+
+  // Fold the four lanes and the remaining blocks into one.
+  x1 = fold16(x1, x2, k3k4);
+  x1 = fold16(x1, x3, k3k4);
+  x1 = fold16(x1, x4, k3k4);
+  for (; i + 16 <= len; i += 16) {
+    x1 = fold16(x1, load_block(in, i), k3k4);
+  }
+
+  // 128 to 64 bits.
+  const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, low32);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits.
+  x2 = _mm_and_si128(x1, low32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, low32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  crc = static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+  return slice16(in, i, len, crc);
+}
+
+#endif  // VNI_CRC32_X86
+
+#if defined(VNI_CRC32_ARM)
+
+bool probe_crc() {
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+  return true;
+#elif defined(__linux__)
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(_WIN32)
+  return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE);
+#else
+  return false;
+#endif
+}
+
+bool cpu_has_crc() {
+  static const bool supported = probe_crc();
+  return supported;
+}
+
+template <typename In>
+VNI_TARGET_CRC uint32_t arm_crc(const In& in, size_t len, uint32_t crc) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    crc = __crc32d(crc, in.word(i));
+  }
+  for (; i < len; i++) {
+    crc = __crc32b(crc, in.byte(i));
+  }
+  return crc;
+}
+
+#endif  // VNI_CRC32_ARM
+
+Crc32Engine detect_engine() {
+#if defined(VNI_CRC32_X86)
+  if (cpu_has_pclmul()) {
+    return Crc32Engine::Pclmul;
+  }
+#elif defined(VNI_CRC32_ARM) && defined(VNI_ENABLE_ARM_CRC32)
+  if (cpu_has_crc()) {
+    return Crc32Engine::ArmCrc;
+  }
+#endif
+  return Crc32Engine::Slice16;
+}
+
+template <bool kMasked, bool kReverse>
+uint32_t run(Crc32Engine engine, const uint8_t* data, const uint8_t* mask,
+             size_t len) {
+  Input<kMasked, kReverse> in{data, mask};
+  uint32_t crc = 0xffffffff;
+  switch (engine) {
+    case Crc32Engine::Slice8:
+      crc = slice8(in, 0, len, crc);
+      break;
+#if defined(VNI_CRC32_X86)
+    case Crc32Engine::Pclmul:
+      crc = pclmul(in, len, crc);
+      break;
+#endif
+#if defined(VNI_CRC32_ARM)
+    case Crc32Engine::ArmCrc:
+      crc = arm_crc(in, len, crc);
+      break;
+#endif
+    default:
+      crc = slice16(in, 0, len, crc);
+      break;
+  }
+  return ~crc;
+}
+
+}  // namespace
+
+Crc32Engine crc32_engine() {
+  static const Crc32Engine engine = detect_engine();
+  return engine;
+}
+
+bool crc32_engine_supported(Crc32Engine engine) {
+  switch (engine) {
+    case Crc32Engine::Slice8:
+    case Crc32Engine::Slice16:
+      return true;
+#if defined(VNI_CRC32_X86)
+    case Crc32Engine::Pclmul:
+      return cpu_has_pclmul();
+#endif
+#if defined(VNI_CRC32_ARM)
+    case Crc32Engine::ArmCrc:
+      return cpu_has_crc();
+#endif
+    default:
+      return false;
+  }
+}
+
+const char* crc32_engine_name(Crc32Engine engine) {
+  switch (engine) {
+    case Crc32Engine::Slice8:
+      return "slice8";
+    case Crc32Engine::Slice16:
+      return "slice16";
+    case Crc32Engine::Pclmul:
+      return "pclmul";
+    case Crc32Engine::ArmCrc:
+      return "armcrc";
+  }
+  return "unknown";
+}
+
+uint32_t crc32_with(Crc32Engine engine, const uint8_t* data,
+                    const uint8_t* mask, size_t len, bool reverse) {
+  if (!crc32_engine_supported(engine)) {
+    engine = Crc32Engine::Slice16;
+  }
+  if (mask) {
+    return reverse ? run<true, true>(engine, data, mask, len)
+                   : run<true, false>(engine, data, mask, len);
+  }
+  return reverse ? run<false, true>(engine, data, nullptr, len)
+                 : run<false, false>(engine, data, nullptr, len);
+}
+
+uint32_t crc32(const uint8_t* data, size_t len, bool reverse) {
+  Crc32Engine engine = crc32_engine();
+  return reverse ? run<false, true>(engine, data, nullptr, len)
+                 : run<false, false>(engine, data, nullptr, len);
+}
+
+uint32_t crc32_masked(const uint8_t* data, const uint8_t* mask, size_t len,
+                      bool reverse) {
+  Crc32Engine engine = crc32_engine();
+  return reverse ? run<true, true>(engine, data, mask, len)
+                 : run<true, false>(engine, data, mask, len);
+}
+
+}  // namespace vni
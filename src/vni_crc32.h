@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace vni {
+
+// CRC-32 as used for PAL/VNI checksums: the IEEE 802.3 polynomial,
+// reflected, as zlib computes it. The results must equal
+// FrameUtil::Helper::Checksum() and ChecksumWithMask(), vni_bench --crc
+// checks every engine the CPU supports against them. reverse mirrors the
+// bits of every byte before it is checksummed.
+
+enum class Crc32Engine {
+  Slice8 = 0,
+  Slice16 = 1,
+  Pclmul = 2,  // x86 carry-less multiply folding
+  ArmCrc = 3,  // ARMv8 crc32 instructions
+};
+
+// CRC-32 of len bytes of data.
+uint32_t crc32(const uint8_t* data, size_t len, bool reverse);
+
+// CRC-32 of data[i] & mask[i] for len bytes.
+uint32_t crc32_masked(const uint8_t* data, const uint8_t* mask, size_t len,
+                      bool reverse);
+
+// The engine crc32() and crc32_masked() use: PCLMUL if the CPU has it, the
+// ARMv8 instructions only in builds with VNI_ENABLE_ARM_CRC32 as they haven't
+// been checked on hardware yet, slice-by-16 otherwise.
+Crc32Engine crc32_engine();
+
+bool crc32_engine_supported(Crc32Engine engine);
+const char* crc32_engine_name(Crc32Engine engine);
+
+// Runs a specific supported engine. mask may be null.
+uint32_t crc32_with(Crc32Engine engine, const uint8_t* data,
+                    const uint8_t* mask, size_t len, bool reverse);
+
+}  // namespace vni
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+
+#include "vni.h"
+
+namespace vni {
+
+// Single producer / single consumer queue of matched Event mappings.
+// Vni_Colorize() is the producer, Vni_PollEvent() the consumer, they may run
+// on different threads. Events are dropped when the queue is full.
+class EventRing {
+ public:
+  static constexpr uint32_t kCapacity = 64;
+
+  bool push(const Vni_Event& event) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    if (head - tail >= kCapacity) {
+      return false;
+    }
+    events_[head % kCapacity] = event;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(Vni_Event* event) {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    uint32_t head = head_.load(std::memory_order_acquire);
+    if (tail == head) {
+      return false;
+    }
+    *event = events_[tail % kCapacity];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::array<Vni_Event, kCapacity> events_{};
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+};
+
+}  // namespace vni
@@ -2,6 +2,8 @@
 
 #include <stddef.h>
 
+#include <algorithm>
+
 namespace vni {
 
 namespace {
@@ -44,6 +46,33 @@ class BitReader {
   int bits_in_buf_ = 0;
 };
 
+class BitWriter {
+ public:
+  explicit BitWriter(std::vector<uint8_t>* out) : out_(out) {}
+
+  void write_bits(int count, uint32_t value) {
+    for (int i = 0; i < count; i++) {
+      bitbuf_ |= static_cast<uint8_t>(((value >> i) & 1u) << bits_in_buf_);
+      if (++bits_in_buf_ == 8) {
+        out_->push_back(bitbuf_);
+        bitbuf_ = 0;
+        bits_in_buf_ = 0;
+      }
+    }
+  }
+
+ private:
+  std::vector<uint8_t>* out_;
+  uint8_t bitbuf_ = 0;
+  int bits_in_buf_ = 0;
+};
+
+struct Token {
+  size_t pos;
+  uint32_t count;     // 0 for a literal
+  uint32_t distance;  // backreference distance
+};
+
 }  // namespace
 
 bool heatshrink_decompress(const uint8_t* data, size_t len, int window_sz,
@@ -91,4 +120,118 @@ bool heatshrink_decompress(const uint8_t* data, size_t len, int window_sz,
   return true;
 }
 
+bool heatshrink_compress(const uint8_t* data, size_t len, int window_sz,
+                         int lookahead_sz, int max_chain,
+                         std::vector<uint8_t>* out) {
+  if (!out || window_sz < 4 || window_sz > 15 || lookahead_sz < 3 ||
+      lookahead_sz >= window_sz) {
+    return false;
+  }
+  out->clear();
+
+  const size_t max_distance = size_t{1} << window_sz;
+  const uint32_t max_count = 1u << lookahead_sz;
+  const int literal_bits = 9;
+  const int backref_bits = 1 + window_sz + lookahead_sz;
+  // Shortest match that is cheaper than emitting literals.
+  const uint32_t min_count =
+      static_cast<uint32_t>(backref_bits / literal_bits) + 1;
+
+  // Hash chains over two byte prefixes.
+  std::vector<int32_t> head(65536, -1);
+  std::vector<int32_t> prev(len, -1);
+  auto insert = [&](size_t pos) {
+    if (pos + 1 < len) {
+      uint32_t key = (static_cast<uint32_t>(data[pos]) << 8) | data[pos + 1];
+      prev[pos] = head[key];
+      head[key] = static_cast<int32_t>(pos);
+    }
+  };
+
+  std::vector<Token> tokens;
+  size_t total_bits = 0;
+  size_t pos = 0;
+  while (pos < len) {
+    uint32_t best_count = 0;
+    uint32_t best_distance = 0;
+    if (pos + 1 < len) {
+      uint32_t key = (static_cast<uint32_t>(data[pos]) << 8) | data[pos + 1];
+      int32_t candidate = head[key];
+      int depth = 0;
+      while (candidate >= 0 && pos - candidate <= max_distance &&
+             depth++ < max_chain) {
+        uint32_t count = 0;
+        while (count < max_count && pos + count < len &&
+               data[candidate + count] == data[pos + count]) {
+          count++;
+        }
+        if (count > best_count) {
+          best_count = count;
+          best_distance = static_cast<uint32_t>(pos - candidate);
+          if (count == max_count) {
+            break;
+          }
+        }
+        candidate = prev[candidate];
+      }
+    }
+    if (best_count >= min_count) {
+      tokens.push_back({pos, best_count, best_distance});
+      total_bits += backref_bits;
+      for (uint32_t i = 0; i < best_count; i++) {
+        insert(pos + i);
+      }
+      pos += best_count;
+    } else {
+      tokens.push_back({pos, 0, 0});
+      total_bits += literal_bits;
+      insert(pos);
+      pos++;
+    }
+  }
+
+  // The decoder treats any bit left in the last byte as the start of another
+  // token, so the stream has to end exactly on a byte boundary. Peeling the
+  // first byte off a backreference into a literal adds 9 bits, turning a
+  // single byte backreference into a literal changes the size by
+  // literal_bits - backref_bits.
+  size_t guard = tokens.size() * 2 + 16;
+  while (total_bits % 8 != 0 && guard-- > 0) {
+    auto it = std::find_if(tokens.begin(), tokens.end(),
+                           [](const Token& t) { return t.count >= 2; });
+    if (it != tokens.end()) {
+      Token literal{it->pos, 0, 0};
+      it->pos++;
+      it->count--;
+      tokens.insert(it, literal);
+      total_bits += literal_bits;
+      continue;
+    }
+    it = std::find_if(tokens.begin(), tokens.end(),
+                      [](const Token& t) { return t.count == 1; });
+    if (it == tokens.end() || literal_bits == backref_bits) {
+      return false;
+    }
+    it->count = 0;
+    total_bits = total_bits + literal_bits - backref_bits;
+  }
+  if (total_bits % 8 != 0) {
+    return false;
+  }
+
+  out->reserve(total_bits / 8);
+  BitWriter writer(out);
+  for (const auto& token : tokens) {
+    if (token.count == 0) {
+      writer.write_bits(1, 1);
+      writer.write_bits(8, data[token.pos]);
+    } else {
+      writer.write_bits(1, 0);
+      writer.write_bits(window_sz, token.distance - 1);
+      writer.write_bits(lookahead_sz, token.count - 1);
+    }
+  }
+  return true;
+}
+
 }  // namespace vni
@@ -9,4 +9,12 @@ namespace vni {
 bool heatshrink_decompress(const uint8_t* data, size_t len, int window_sz,
                            int lookahead_sz, std::vector<uint8_t>* out);
 
+// Produces a stream that heatshrink_decompress() decodes back to data.
+// max_chain bounds the number of match candidates tried per position.
+// Returns false if no byte aligned encoding exists, the caller should store
+// the data uncompressed then.
+bool heatshrink_compress(const uint8_t* data, size_t len, int window_sz,
+                         int lookahead_sz, int max_chain,
+                         std::vector<uint8_t>* out);
+
 }  // namespace vni
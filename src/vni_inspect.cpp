@@ -0,0 +1,507 @@
+// vni-inspect: loads a PAL/VNI project the way Vni_Load() does and reports
+// where the load spends its time and what the project holds: time per load
+// phase, stored and decompressed bytes, frames, planes and masks per
+// sequence, mappings per switch mode, PAL masks and references that lead
+// nowhere. Prints a report or, with --json, one JSON object.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "vni_internal.h"
+#include "vni_tool_util.h"
+
+using namespace vni;
+
+namespace {
+
+struct Options {
+  std::string pal;
+  std::string vni;
+  uint32_t runs = 1;
+  uint32_t top = 10;
+  bool keep_compressed = false;
+  bool dedup = false;
+  bool prune = false;
+  bool json = false;
+};
+
+struct Load {
+  uint64_t pal_bytes = 0;
+  uint64_t vni_bytes = 0;
+  uint64_t pal_ns = 0;
+  LoadProfile profile;
+  std::unique_ptr<PalFile> pal;
+  std::unique_ptr<VniFile> vni;
+
+  uint64_t total_ns() const { return pal_ns + profile.total_ns; }
+};
+
+// A sequence of the file, loaded or pruned.
+struct Sequence {
+  const SequenceLoadProfile* profile = nullptr;
+  const FrameSeq* seq = nullptr;  // null if pruned
+  uint32_t refs = 0;
+  uint32_t modes = 0;  // bit per referencing SwitchMode
+  uint32_t planes = 0;
+  uint32_t frame_masks = 0;
+};
+
+struct Dangling {
+  const Mapping* mapping;
+  bool sequence;  // a missing sequence, else a missing palette
+};
+
+uint64_t file_size(std::ifstream& in) {
+  in.seekg(0, std::ios::end);
+  auto size = in.tellg();
+  in.seekg(0);
+  return size < 0 ? 0 : static_cast<uint64_t>(size);
+}
+
+uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+}
+
+bool load(const Options& opt, Load* out) {
+  std::ifstream pal_in(opt.pal, std::ios::binary);
+  if (!pal_in.is_open()) {
+    fprintf(stderr, "vni-inspect: unable to open %s\n", opt.pal.c_str());
+    return false;
+  }
+  out->pal_bytes = file_size(pal_in);
+  out->pal = std::make_unique<PalFile>();
+  auto start = std::chrono::steady_clock::now();
+  bool ok = read_pal_file(pal_in, out->pal.get());
+  out->pal_ns = elapsed_ns(start);
+  if (!ok) {
+    fprintf(stderr, "vni-inspect: unable to parse %s\n", opt.pal.c_str());
+    return false;
+  }
+  if (opt.vni.empty()) {
+    return true;
+  }
+
+  std::ifstream vni_in(opt.vni, std::ios::binary);
+  if (!vni_in.is_open()) {
+    fprintf(stderr, "vni-inspect: unable to open %s\n", opt.vni.c_str());
+    return false;
+  }
+  out->vni_bytes = file_size(vni_in);
+  VniReadOptions options;
+  options.keep_compressed = opt.keep_compressed;
+  options.dedup_planes = opt.dedup;
+  options.prune_unreachable = opt.prune;
+  options.profile = &out->profile;
+  reference_sequences(*out->pal, &options);
+  out->vni = std::make_unique<VniFile>();
+  if (!read_vni_file(vni_in, out->vni.get(), options)) {
+    fprintf(stderr, "vni-inspect: unable to parse %s\n", opt.vni.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::vector<Sequence> sequences(const Load& load) {
+  std::vector<Sequence> result;
+  std::map<uint32_t, size_t> by_offset;
+  for (const auto& profile : load.profile.sequences) {
+    Sequence sequence;
+    sequence.profile = &profile;
+    by_offset.emplace(profile.offset, result.size());
+    result.push_back(sequence);
+  }
+  if (load.vni) {
+    for (const auto& seq : load.vni->animations) {
+      Sequence& sequence = result[by_offset.at(seq.offset)];
+      sequence.seq = &seq;
+      for (const auto& frame : seq.frames) {
+        sequence.planes += frame.plane_count;
+        sequence.frame_masks += frame.has_mask ? 1 : 0;
+      }
+    }
+  }
+  for (const auto& entry : load.pal->mappings) {
+    const Mapping& mapping = entry.second;
+    auto it = by_offset.find(mapping.offset);
+    if (mapping.is_animation() && it != by_offset.end()) {
+      result[it->second].refs++;
+      result[it->second].modes |= 1u << static_cast<uint32_t>(mapping.mode);
+    }
+  }
+  return result;
+}
+
+// Mappings that start a sequence that isn't in the VNI file or switch to a
+// palette that isn't in the PAL file. Without a VNI file only palettes are
+// checked.
+std::vector<Dangling> dangling(const Load& load,
+                               const std::vector<Sequence>& sequences) {
+  std::vector<uint32_t> offsets;
+  for (const auto& sequence : sequences) {
+    offsets.push_back(sequence.profile->offset);
+  }
+  std::sort(offsets.begin(), offsets.end());
+  std::vector<Dangling> result;
+  for (const auto& entry : load.pal->mappings) {
+    const Mapping& mapping = entry.second;
+    if (load.vni && mapping.is_animation() &&
+        !std::binary_search(offsets.begin(), offsets.end(), mapping.offset)) {
+      result.push_back(Dangling{&mapping, true});
+    }
+    if (mapping.mode != SwitchMode::Event &&
+        std::none_of(load.pal->palettes.begin(), load.pal->palettes.end(),
+                     [&](const Palette& palette) {
+                       return palette.index == mapping.palette_index;
+                     })) {
+      result.push_back(Dangling{&mapping, false});
+    }
+  }
+  return result;
+}
+
+std::string mode_list(uint32_t modes) {
+  std::string result;
+  for (size_t i = 0; i < kSwitchModeCount; i++) {
+    if (modes & (1u << i)) {
+      if (!result.empty()) {
+        result += ",";
+      }
+      result += switch_mode_name(static_cast<SwitchMode>(i));
+    }
+  }
+  return result.empty() ? "-" : result;
+}
+
+double ms(uint64_t ns) { return static_cast<double>(ns) / 1e6; }
+
+struct Totals {
+  uint64_t frames = 0;
+  uint64_t planes = 0;
+  uint64_t frame_masks = 0;
+  uint64_t sequence_masks = 0;
+  uint64_t compressed_bytes = 0;
+  uint64_t decompressed_bytes = 0;
+  uint64_t compressed_frames = 0;
+  uint32_t unreachable = 0;
+  uint64_t unreachable_bytes = 0;
+};
+
+Totals totals(const std::vector<Sequence>& sequences) {
+  Totals t;
+  for (const auto& sequence : sequences) {
+    const SequenceLoadProfile& profile = *sequence.profile;
+    t.compressed_bytes += profile.compressed_bytes;
+    t.decompressed_bytes += profile.decompressed_bytes;
+    t.compressed_frames += profile.compressed_frames;
+    if (sequence.refs == 0) {
+      t.unreachable++;
+      t.unreachable_bytes += profile.file_bytes;
+    }
+    if (sequence.seq) {
+      t.frames += sequence.seq->frames.size();
+      t.planes += sequence.planes;
+      t.frame_masks += sequence.frame_masks;
+      t.sequence_masks += sequence.seq->masks.size();
+    }
+  }
+  return t;
+}
+
+void print_json(const Options& opt, const Load& load,
+                const std::vector<Sequence>& sequences,
+                const std::vector<Dangling>& dangling) {
+  const LoadProfile& p = load.profile;
+  const PalFile& pal = *load.pal;
+  Totals t = totals(sequences);
+  uint64_t phases =
+      p.header_ns + p.decompress_ns + p.reverse_ns + p.store_ns;
+  JsonLine json;
+  json.begin("pal");
+  json.add_str("path", opt.pal);
+  json.add_u64("bytes", load.pal_bytes);
+  json.add_u64("version", pal.version);
+  json.end();
+  json.begin("vni");
+  json.add_str("path", opt.vni);
+  json.add_u64("bytes", load.vni_bytes);
+  json.add_u64("version", load.vni ? load.vni->version : 0u);
+  json.end();
+  json.begin("load_ms");
+  json.add_u64("runs", opt.runs);
+  json.add_f("total", ms(load.total_ns()), 3);
+  json.add_f("pal", ms(load.pal_ns), 3);
+  json.add_f("headers", ms(p.header_ns), 3);
+  json.add_f("decompress", ms(p.decompress_ns), 3);
+  json.add_f("bit_reversal", ms(p.reverse_ns), 3);
+  json.add_f("store", ms(p.store_ns), 3);
+  json.add_f("other", ms(p.total_ns > phases ? p.total_ns - phases : 0), 3);
+  json.end();
+  json.add_u64("palettes", pal.palettes.size());
+  json.add_i64("default_palette", pal.default_palette_index);
+  size_t per_mode[kSwitchModeCount] = {};
+  for (const auto& entry : pal.mappings) {
+    size_t mode = static_cast<size_t>(entry.second.mode);
+    if (mode < kSwitchModeCount) {
+      per_mode[mode]++;
+    }
+  }
+  json.begin("mappings");
+  json.add_u64("total", pal.mappings.size());
+  for (size_t i = 0; i < kSwitchModeCount; i++) {
+    json.add_u64(switch_mode_name(static_cast<SwitchMode>(i)), per_mode[i]);
+  }
+  json.end();
+  json.begin_array("pal_masks");
+  for (const auto& mask : pal.masks) {
+    json.add_u64(nullptr, mask.size());
+  }
+  json.end_array();
+  json.begin("totals");
+  json.add_u64("sequences", sequences.size());
+  json.add_u64("frames", t.frames);
+  json.add_u64("planes", t.planes);
+  json.add_u64("frame_masks", t.frame_masks);
+  json.add_u64("sequence_masks", t.sequence_masks);
+  json.add_u64("compressed_frames", t.compressed_frames);
+  json.add_u64("compressed_bytes", t.compressed_bytes);
+  json.add_u64("decompressed_bytes", t.decompressed_bytes);
+  json.add_u64("unreachable", t.unreachable);
+  json.add_u64("unreachable_bytes", t.unreachable_bytes);
+  json.end();
+  json.begin_array("dangling");
+  for (const auto& d : dangling) {
+    const Mapping& m = *d.mapping;
+    json.begin(nullptr);
+    json.add_hex("checksum", m.checksum, 8);
+    json.add_str("mode", switch_mode_name(m.mode));
+    json.add_str("missing", d.sequence ? "sequence" : "palette");
+    json.add_u64("offset", m.offset);
+    json.add_u64("palette", m.palette_index);
+    json.end();
+  }
+  json.end_array();
+  json.begin_array("sequences");
+  for (const Sequence& s : sequences) {
+    const SequenceLoadProfile& sp = *s.profile;
+    json.begin(nullptr);
+    json.add_u64("offset", sp.offset);
+    json.add_u64("file_bytes", sp.file_bytes);
+    json.add_u64("compressed_bytes", sp.compressed_bytes);
+    json.add_u64("decompressed_bytes", sp.decompressed_bytes);
+    json.add_u64("compressed_frames", sp.compressed_frames);
+    json.add_f("load_us", static_cast<double>(sp.load_ns) / 1e3, 1);
+    json.add_u64("refs", s.refs);
+    json.add_str("modes", mode_list(s.modes));
+    json.add_bool("pruned", sp.pruned);
+    if (s.seq) {
+      json.add_str("name", s.seq->name);
+      json.add_u64("width", s.seq->size.width);
+      json.add_u64("height", s.seq->size.height);
+      json.add_u64("frames", s.seq->frames.size());
+      json.add_u64("planes", s.planes);
+      json.add_u64("frame_masks", s.frame_masks);
+      json.add_u64("sequence_masks", s.seq->masks.size());
+    }
+    json.end();
+  }
+  json.end_array();
+  printf("%s\n", json.finish().c_str());
+}
+
+void print_report(const Options& opt, const Load& load,
+                  const std::vector<Sequence>& sequences,
+                  const std::vector<Dangling>& dangling) {
+  const LoadProfile& p = load.profile;
+  const PalFile& pal = *load.pal;
+  Totals t = totals(sequences);
+  uint64_t phases =
+      p.header_ns + p.decompress_ns + p.reverse_ns + p.store_ns;
+  printf("pal:            %s (%llu bytes, version %u)\n", opt.pal.c_str(),
+         static_cast<unsigned long long>(load.pal_bytes), pal.version);
+  if (load.vni) {
+    printf("vni:            %s (%llu bytes, version %u)\n", opt.vni.c_str(),
+           static_cast<unsigned long long>(load.vni_bytes),
+           load.vni->version);
+  }
+  printf("load:           %.3f ms%s\n", ms(load.total_ns()),
+         opt.runs > 1 ? " (median run)" : "");
+  printf("  pal parse     %.3f ms\n", ms(load.pal_ns));
+  if (load.vni) {
+    printf("  headers       %.3f ms\n", ms(p.header_ns));
+    printf("  decompress    %.3f ms\n", ms(p.decompress_ns));
+    printf("  bit reversal  %.3f ms\n", ms(p.reverse_ns));
+    printf("  dedup/sparse  %.3f ms\n", ms(p.store_ns));
+    printf("  other         %.3f ms (frame headers, uncompressed frames)\n",
+           ms(p.total_ns > phases ? p.total_ns - phases : 0));
+  }
+
+  printf("palettes:       %zu (default %d)\n", pal.palettes.size(),
+         pal.default_palette_index);
+  printf("mappings:       %zu\n", pal.mappings.size());
+  size_t per_mode[kSwitchModeCount] = {};
+  for (const auto& entry : pal.mappings) {
+    size_t mode = static_cast<size_t>(entry.second.mode);
+    if (mode < kSwitchModeCount) {
+      per_mode[mode]++;
+    }
+  }
+  for (size_t i = 0; i < kSwitchModeCount; i++) {
+    if (per_mode[i]) {
+      printf("  %-16s %zu\n", switch_mode_name(static_cast<SwitchMode>(i)),
+             per_mode[i]);
+    }
+  }
+  if (pal.masks.empty()) {
+    printf("pal masks:      none\n");
+  } else {
+    printf("pal masks:      %zu x %zu bytes\n", pal.masks.size(),
+           pal.masks.front().size());
+  }
+  if (!load.vni) {
+    return;
+  }
+
+  printf("sequences:      %zu (%llu frames, %llu planes, %llu frame masks, "
+         "%llu sequence masks)\n",
+         sequences.size(), static_cast<unsigned long long>(t.frames),
+         static_cast<unsigned long long>(t.planes),
+         static_cast<unsigned long long>(t.frame_masks),
+         static_cast<unsigned long long>(t.sequence_masks));
+  printf("frame data:     %llu bytes stored, %llu decompressed (%llu "
+         "compressed frames)\n",
+         static_cast<unsigned long long>(t.compressed_bytes),
+         static_cast<unsigned long long>(t.decompressed_bytes),
+         static_cast<unsigned long long>(t.compressed_frames));
+  printf("unreachable:    %u sequences, %llu bytes\n", t.unreachable,
+         static_cast<unsigned long long>(t.unreachable_bytes));
+  printf("dangling:       %zu\n", dangling.size());
+  for (const auto& d : dangling) {
+    const Mapping& m = *d.mapping;
+    if (d.sequence) {
+      printf("  %08x %-16s missing sequence at %u\n", m.checksum,
+             switch_mode_name(m.mode), m.offset);
+    } else {
+      printf("  %08x %-16s missing palette %u\n", m.checksum,
+             switch_mode_name(m.mode), m.palette_index);
+    }
+  }
+
+  std::vector<const Sequence*> slowest;
+  for (const auto& sequence : sequences) {
+    slowest.push_back(&sequence);
+  }
+  std::sort(slowest.begin(), slowest.end(),
+            [](const Sequence* a, const Sequence* b) {
+              return a->profile->load_ns > b->profile->load_ns;
+            });
+  slowest.resize(std::min<size_t>(slowest.size(), opt.top));
+  if (slowest.empty()) {
+    return;
+  }
+  printf("\nslowest sequences:\n");
+  printf("  %10s %9s %10s %12s %7s %7s %6s %5s  %-10s %s\n", "offset",
+         "load us", "stored", "decompressed", "frames", "planes", "masks",
+         "refs", "size", "modes");
+  for (const Sequence* s : slowest) {
+    const SequenceLoadProfile& sp = *s->profile;
+    std::string size = "-";
+    size_t frames = 0;
+    size_t masks = 0;
+    if (s->seq) {
+      size = std::to_string(s->seq->size.width) + "x" +
+             std::to_string(s->seq->size.height);
+      frames = s->seq->frames.size();
+      masks = s->frame_masks + s->seq->masks.size();
+    }
+    printf("  %10u %9.1f %10llu %12llu %7zu %7u %6zu %5u  %-10s %s%s\n",
+           sp.offset, static_cast<double>(sp.load_ns) / 1e3,
+           static_cast<unsigned long long>(sp.compressed_bytes),
+           static_cast<unsigned long long>(sp.decompressed_bytes), frames,
+           s->planes, masks, s->refs, size.c_str(),
+           mode_list(s->modes).c_str(), sp.pruned ? " (pruned)" : "");
+  }
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: vni-inspect [options] PROJECT.pal [PROJECT.vni]\n"
+          "  --runs N            load N times and report the median run\n"
+          "  --top N             slowest sequences to list (default 10)\n"
+          "  --keep-compressed   load with keep_compressed\n"
+          "  --dedup             load with dedup_planes\n"
+          "  --prune             load with prune_unreachable\n"
+          "  --json              print one JSON object with all sequences\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opt;
+  std::vector<std::string> positional;
+  auto exit_code = parse_args(
+      "vni-inspect", argc, argv, usage, &positional,
+      [&](const std::string& arg, const char* value) {
+        if (arg == "--keep-compressed") {
+          opt.keep_compressed = true;
+        } else if (arg == "--dedup") {
+          opt.dedup = true;
+        } else if (arg == "--prune") {
+          opt.prune = true;
+        } else if (arg == "--json") {
+          opt.json = true;
+        } else if (arg == "--runs") {
+          return value_arg(parse_u32(value, &opt.runs) && opt.runs > 0);
+        } else if (arg == "--top") {
+          return value_arg(parse_u32(value, &opt.top));
+        } else {
+          return Arg::Invalid;
+        }
+        return Arg::Flag;
+      });
+  if (exit_code) {
+    return *exit_code;
+  }
+  if (positional.empty() || positional.size() > 2) {
+    usage();
+    return 1;
+  }
+  opt.pal = positional[0];
+  if (positional.size() == 2 && positional[1] != "-") {
+    opt.vni = positional[1];
+  }
+
+  std::vector<std::unique_ptr<Load>> loads;
+  for (uint32_t run = 0; run < opt.runs; run++) {
+    auto result = std::make_unique<Load>();
+    if (!load(opt, result.get())) {
+      return 1;
+    }
+    loads.push_back(std::move(result));
+  }
+  std::sort(loads.begin(), loads.end(),
+            [](const std::unique_ptr<Load>& a, const std::unique_ptr<Load>& b) {
+              return a->total_ns() < b->total_ns();
+            });
+  const Load& median = *loads[loads.size() / 2];
+
+  std::vector<Sequence> seqs = sequences(median);
+  std::vector<Dangling> missing = dangling(median, seqs);
+  if (opt.json) {
+    print_json(opt, median, seqs, missing);
+  } else {
+    print_report(opt, median, seqs, missing);
+  }
+  return 0;
+}
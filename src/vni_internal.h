@@ -1,15 +1,33 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <atomic>
 #include <chrono>
+#include <iosfwd>
+#include <list>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "vni_events.h"
+#include "vni_memory.h"
+#include "vni_spans.h"
+#include "vni_stats.h"
+#include "vni_trace.h"
+
 namespace vni {
 
+// Heatshrink parameters of compressed VNI frames.
+constexpr int kHeatshrinkWindow = 10;
+constexpr int kHeatshrinkLookahead = 5;
+
+constexpr uint8_t kMaskMarker = 0x6d;
+
 struct Dimensions {
   uint32_t width = 128;
   uint32_t height = 32;
@@ -31,6 +49,11 @@ enum class SwitchMode : uint8_t {
   MaskedReplace = 7
 };
 
+constexpr size_t kSwitchModeCount = 8;
+
+// Name of a switch mode as LibDmd spells it, "unknown" for other values.
+const char* switch_mode_name(SwitchMode mode);
+
 struct Mapping {
   uint32_t checksum = 0;
   SwitchMode mode = SwitchMode::Palette;
@@ -52,44 +75,305 @@ struct Palette {
   bool is_persistent() const { return type == 1; }
 };
 
-struct AnimationPlane {
-  uint8_t marker = 0;
-  std::vector<uint8_t> plane;
+// Range of bytes in FrameSeq::arena.
+struct ArenaSpan {
+  uint32_t offset = 0;
+  uint32_t size = 0;
 };
 
+// Frame metadata. The pixel data lives in the arena of the owning FrameSeq,
+// one block per frame: plane_count planes of plane_size bytes, the replace
+// mask if has_mask is set, then one marker byte per plane. Frames loaded
+// with VniReadOptions::keep_compressed store the heatshrink stream of the
+// block instead (stored_size bytes) and are decoded through a FrameCache.
+// Uncompressed frames of a sequence loaded with VniReadOptions::dedup_planes
+// keep only the markers at data_offset, their planes and mask are in the
+// project's PlaneStore at the offsets FrameSeq::slots[slot_index...].
+// Sparse frames, see VniReadOptions::overlays, hold the markers followed by
+// the planes and mask as runs of non-zero words, written by make_sparse()
+// through append_sparse(). Only detect_lcm() reads them, through
+// or_sparse_frame().
 struct AnimationFrame {
   uint32_t time = 0;
   uint32_t delay = 0;
   uint8_t bit_length = 0;
-  std::vector<AnimationPlane> planes;
-  std::vector<uint8_t> mask;
   uint32_t hash = 0;
+  uint32_t data_offset = 0;
+  uint32_t stored_size = 0;
+  uint32_t slot_index = 0;
+  uint16_t plane_size = 0;
+  uint8_t plane_count = 0;
+  bool has_mask = false;
+  bool sparse = false;
+
+  bool is_compressed() const { return stored_size != 0; }
+  size_t block_size() const {
+    return (plane_count + (has_mask ? 1u : 0u)) * size_t{plane_size} +
+           plane_count;
+  }
+};
+
+struct FrameSeq;
+
+// Bounded LRU cache of decoded frame blocks. The most recently returned
+// block always stays resident, even if it alone exceeds the budget, so a
+// pointer from get() is valid until get() is called for another frame.
+class FrameCache {
+ public:
+  explicit FrameCache(MemoryHooks* memory = nullptr)
+      : lru_(memory), index_(memory), spare_(memory) {}
+
+  void set_budget(size_t bytes);
+  const uint8_t* get(const FrameSeq& seq, const AnimationFrame& frame);
+
+  size_t budget() const { return budget_; }
+  size_t bytes() const { return bytes_; }
+  void tally_memory(HeapTally* tally) const;
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+  uint64_t evictions() const { return evictions_; }
+
+ private:
+  struct Entry {
+    const AnimationFrame* frame;
+    HookVector<uint8_t> block;
+  };
+
+  void evict(size_t keep);
+
+  HookList<Entry> lru_;  // most recently used first
+  HookUnorderedMap<const AnimationFrame*, HookList<Entry>::iterator> index_;
+  std::vector<uint8_t> scratch_;
+  // Also provides the allocator of new blocks.
+  HookVector<uint8_t> spare_;
+  size_t budget_ = 0;
+  size_t bytes_ = 0;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  uint64_t evictions_ = 0;
+};
+
+// Content-addressed storage of the planes and masks of a project. Identical
+// planes are stored once, at word aligned offsets, and shared read-only by
+// all frames and sequences that contain them.
+class PlaneStore {
+ public:
+  explicit PlaneStore(MemoryHooks* memory = nullptr)
+      : arena_(memory), index_(memory) {}
+
+  // Returns the offset of the stored copy of data, storing it first if
+  // there is none.
+  uint32_t intern(const uint8_t* data, size_t size);
+  // Drops the lookup index once the project is loaded.
+  void seal();
+
+  const uint8_t* data(uint32_t offset) const { return arena_.data() + offset; }
+  size_t bytes() const { return arena_.size(); }
+  void tally_memory(HeapTally* tally) const;
+  uint64_t refs() const { return refs_; }
+  uint64_t planes() const { return planes_; }
+  uint64_t ref_bytes() const { return ref_bytes_; }
+
+ private:
+  struct Entry {
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  HookVector<uint8_t> arena_;
+  HookUnorderedMultimap<uint32_t, Entry> index_;  // by CRC-32
+  uint64_t refs_ = 0;
+  uint64_t planes_ = 0;
+  uint64_t ref_bytes_ = 0;
 };
 
 struct FrameSeq {
-  std::string name;
+  FrameSeq() = default;
+  explicit FrameSeq(MemoryHooks* memory)
+      : name(memory), frames(memory), arena(memory), masks(memory),
+        slots(memory), header(memory) {}
+
+  HookString name;
   uint32_t offset = 0;
-  std::vector<AnimationFrame> frames;
+  HookVector<AnimationFrame> frames;
   uint32_t animation_duration = 0;
   Dimensions size;
-  SwitchMode switch_mode = SwitchMode::Palette;
 
-  std::vector<std::vector<uint8_t>> masks;
+  // Planes, frame masks and sequence masks of all frames, so a sequence is
+  // two allocations no matter how many frames it has.
+  HookVector<uint8_t> arena;
+  HookVector<ArenaSpan> masks;
+  // Holds the sequence masks and the planes of uncompressed frames when set,
+  // see AnimationFrame.
+  const PlaneStore* store = nullptr;
+  HookVector<uint32_t> slots;
+  // The header from the cycles on, including the fields playback ignores,
+  // as a version 6 file stores it. Only kept with
+  // VniReadOptions::keep_header.
+  HookVector<uint8_t> header;
+
+  bool is_shared(const AnimationFrame& frame) const {
+    return store && !frame.is_compressed() && !frame.sparse;
+  }
+  // Frame data accessors. cache decodes compressed frames and may be null
+  // if the sequence has none.
+  const uint8_t* block(const AnimationFrame& frame, FrameCache* cache) const {
+    if (frame.is_compressed()) {
+      return cache->get(*this, frame);
+    }
+    return arena.data() + frame.data_offset;
+  }
+  // The planes and mask of frame back to back, or null if they are in the
+  // plane store and not stored in a row or the frame is sparse.
+  const uint8_t* planes(const AnimationFrame& frame, FrameCache* cache) const;
+  const uint8_t* plane(const AnimationFrame& frame, size_t i,
+                       FrameCache* cache) const {
+    if (is_shared(frame)) {
+      return store->data(slots[frame.slot_index + i]);
+    }
+    return block(frame, cache) + i * frame.plane_size;
+  }
+  const uint8_t* mask(const AnimationFrame& frame, FrameCache* cache) const {
+    return frame.has_mask ? plane(frame, frame.plane_count, cache) : nullptr;
+  }
+  uint8_t marker(const AnimationFrame& frame, size_t i,
+                 FrameCache* cache) const {
+    if (is_shared(frame)) {
+      return arena[frame.data_offset + i];
+    }
+    return block(frame, cache)[(frame.plane_count + (frame.has_mask ? 1 : 0)) *
+                                   frame.plane_size +
+                               i];
+  }
+  const uint8_t* data(const ArenaSpan& span) const {
+    return store ? store->data(span.offset) : arena.data() + span.offset;
+  }
+
+  // Reserves size bytes at the end of the arena, aligned for word-wide
+  // access, and returns their offset. Invalidates pointers into the arena.
+  uint32_t allocate(size_t size);
+  // Appends a frame block built from separate buffers. Used by tools that
+  // assemble sequences in memory.
+  void add_frame(AnimationFrame frame,
+                 const std::vector<std::vector<uint8_t>>& planes,
+                 const std::vector<uint8_t>& markers,
+                 const std::vector<uint8_t>& mask);
+  void add_mask(const std::vector<uint8_t>& mask);
+};
+
+// Playback state of a sequence in one context. The FrameSeq is read-only
+// project data that the contexts of Vni_Share() share.
+struct SequenceState {
+  SequenceState(const FrameSeq* sequence, FrameCache* frame_cache,
+                MemoryHooks* memory)
+      : seq(sequence), cache(frame_cache), lcm_buffer(memory),
+        joined(memory), joined_ready(memory) {}
 
+  const FrameSeq* seq;
+  // The context's cache of decoded frames, null if seq has no compressed
+  // frames.
+  FrameCache* cache;
+  SwitchMode switch_mode = SwitchMode::Palette;
   bool is_running = false;
 
   uint32_t frame_index = 0;
   int64_t last_tick = 0;
   int64_t timer = 0;
 
-  std::vector<std::vector<uint8_t>> lcm_buffer_planes;
-  std::vector<uint8_t> replace_mask;
+  // LayeredColorMask/MaskedReplace composition: lcm_planes planes and, for
+  // MaskedReplace, the replace mask, each lcm_plane_size bytes at a word
+  // aligned lcm_stride.
+  HookVector<uint64_t> lcm_buffer;
+  size_t lcm_planes = 0;
+  size_t lcm_plane_size = 0;
+  size_t lcm_stride = 0;
+
+  // Replace/FollowReplace frames joined into indexed pixels, one
+  // joined_dim.surface() block per frame, filled as frames are first output.
+  HookVector<uint8_t> joined;
+  HookVector<bool> joined_ready;
+  Dimensions joined_dim;
+
+  const uint8_t* planes(const AnimationFrame& frame) const {
+    return seq->planes(frame, cache);
+  }
+  const uint8_t* plane(const AnimationFrame& frame, size_t i) const {
+    return seq->plane(frame, i, cache);
+  }
+  uint8_t* lcm_plane(size_t i) {
+    return reinterpret_cast<uint8_t*>(lcm_buffer.data()) + i * lcm_stride;
+  }
+  uint8_t* lcm_mask() { return lcm_plane(lcm_planes); }
 };
 
+// A loaded VNI file. Read-only once loaded, contexts keep their playback
+// state in SequenceState and decode compressed frames into a FrameCache of
+// their own.
 struct VniFile {
+  VniFile() = default;
+  explicit VniFile(MemoryHooks* memory) : animations(memory) {}
+
   uint16_t version = 0;
-  std::vector<FrameSeq> animations;
+  HookVector<FrameSeq> animations;
   Dimensions dimensions;
+  // Frames loaded with VniReadOptions::keep_compressed are decoded into a
+  // frame cache of frame_cache_bytes.
+  bool keep_compressed = false;
+  size_t frame_cache_bytes = 0;
+  // Only with VniReadOptions::dedup_planes.
+  std::unique_ptr<PlaneStore> plane_store;
+  // Sequences left out by VniReadOptions::reachable and their file bytes.
+  uint32_t pruned_sequences = 0;
+  uint64_t pruned_bytes = 0;
+  // Frames stored sparse and the bytes that saved.
+  uint32_t sparse_frames = 0;
+  uint64_t sparse_bytes_saved = 0;
+};
+
+// Bytes and load time of one sequence, see LoadProfile.
+struct SequenceLoadProfile {
+  uint32_t offset = 0;
+  uint32_t file_bytes = 0;
+  // Frame data as stored in the file (heatshrink streams of compressed
+  // frames) and after decompression.
+  uint64_t compressed_bytes = 0;
+  uint64_t decompressed_bytes = 0;
+  uint32_t compressed_frames = 0;
+  uint64_t load_ns = 0;
+  bool pruned = false;
+};
+
+// Where read_vni_file() spends its time, in nanoseconds. Time that falls in
+// none of the phases is reading frame headers and uncompressed frames.
+struct LoadProfile {
+  uint64_t header_ns = 0;  // file header and sequence headers
+  uint64_t decompress_ns = 0;
+  uint64_t reverse_ns = 0;  // bit reversal of planes and masks
+  uint64_t store_ns = 0;    // plane dedup and sparse frames
+  uint64_t total_ns = 0;
+  std::vector<SequenceLoadProfile> sequences;  // in file order
+};
+
+struct VniReadOptions {
+  // Keep heatshrink compressed frames compressed in memory.
+  bool keep_compressed = false;
+  size_t frame_cache_bytes = 0;
+  // Store identical planes and masks of uncompressed frames once.
+  bool dedup_planes = false;
+  // Drop sequences whose offset isn't in reachable, a sorted list of the
+  // offsets PAL mappings start. Set by read_project() from the PAL.
+  bool prune_unreachable = false;
+  std::vector<uint32_t> reachable;
+  // Sorted offsets of the sequences only LayeredColorMask and MaskedReplace
+  // mappings start. Their mostly empty frames are stored sparse. Set by
+  // read_project() from the PAL.
+  std::vector<uint32_t> overlays;
+  // Keep the sequence headers in FrameSeq::header for write_vni_file().
+  bool keep_header = false;
+  // Sequences, frame data and the plane store allocate from memory.
+  MemoryHooks* memory = nullptr;
+  // Filled by read_vni_file() if set.
+  LoadProfile* profile = nullptr;
 };
 
 struct PalFile {
@@ -100,12 +384,32 @@ struct PalFile {
   int default_palette_index = -1;
 };
 
+struct Project {
+  std::unique_ptr<PalFile> pal;
+  std::unique_ptr<VniFile> vni;
+};
+
 struct OutputFrame {
-  std::vector<uint8_t> data;
-  std::vector<uint8_t> palette;
+  explicit OutputFrame(MemoryHooks* memory)
+      : data(memory), planes(memory), palette(memory) {}
+
+  HookVector<uint8_t> data;
+  // Points into a replace cache instead of data when set.
+  const uint8_t* shared = nullptr;
+  // Bitplane output: bitlen planes of plane_size bytes, in planes or, for
+  // Replace frames, shared_planes pointing at the stored frame.
+  HookVector<uint8_t> planes;
+  const uint8_t* shared_planes = nullptr;
+  size_t plane_size = 0;
+  HookVector<uint8_t> palette;
   Dimensions dimensions;
   uint8_t bitlen = 0;
   bool has_frame = false;
+
+  const uint8_t* pixels() const { return shared ? shared : data.data(); }
+  const uint8_t* plane_data() const {
+    return shared_planes ? shared_planes : planes.data();
+  }
 };
 
 enum class ScalerMode : uint32_t {
@@ -114,20 +418,107 @@ enum class ScalerMode : uint32_t {
   ScaleDouble = 2,
 };
 
+enum class OutputMode : uint32_t {
+  Indexed = 0,
+  Bitplanes = 1,
+};
+
 struct Context {
-  std::unique_ptr<VniFile> vni;
-  std::unique_ptr<PalFile> pal;
+  explicit Context(std::shared_ptr<MemoryHooks> hooks)
+      : memory(std::move(hooks)),
+        sequences(memory.get()),
+        output(memory.get()),
+        mask_crc(memory.get()),
+        mask_crc_epoch(memory.get()),
+        mask_order(memory.get()),
+        mask_rank(memory.get()),
+        mask_hits(memory.get()),
+        frame_events(memory.get()),
+        last_frame_events(memory.get()) {}
+
+  // Declared first, everything below may allocate from it.
+  std::shared_ptr<MemoryHooks> memory;
+  // Read-only project data, shared with the contexts of Vni_Share().
+  std::shared_ptr<const VniFile> vni;
+  std::shared_ptr<const PalFile> pal;
+  // Playback state of the sequences of vni, in the same order, and the
+  // cache their compressed frames are decoded into.
+  std::unique_ptr<FrameCache> frame_cache;
+  HookVector<SequenceState> sequences;
   OutputFrame output;
+  // Returned by Vni_GetFrame() and Vni_GetPlanes(), which fill them from
+  // output.
+  mutable Vni_Frame_Struc output_frame{};
+  mutable Vni_Planes_Struc output_planes{};
   ScalerMode scaler_mode = ScalerMode::None;
+  OutputMode output_mode = OutputMode::Indexed;
 
-  FrameSeq* active_seq = nullptr;
-  Palette* palette = nullptr;
-  Palette* default_palette = nullptr;
+  SequenceState* active_seq = nullptr;
+  const Palette* palette = nullptr;
+  const Palette* default_palette = nullptr;
   int last_embedded_palette = -1;
   bool reset_embedded = false;
   int64_t palette_reset_at = -1;
+  // Input planes of the last Vni_Colorize() frame, rendered again by
+  // Vni_Tick() when a timed animation advances on its own.
+  std::vector<std::vector<uint8_t>> last_planes;
+  Dimensions last_dim;
+  // Input planes doubled to the VNI size, reused from frame to frame.
+  std::vector<std::vector<uint8_t>> scaled_planes;
 
+  // Checksums of the current input plane under the PAL masks, computed on
+  // first use so find_mapping() and detect_follow() share them. Entries are
+  // valid where mask_crc_epoch equals mask_epoch.
+  HookVector<uint32_t> mask_crc;
+  HookVector<uint32_t> mask_crc_epoch;
+  uint32_t mask_epoch = 0;
+  // PAL mask indices with the most hits first, for lookups where the mask
+  // order doesn't change the result. mask_rank is the inverse of mask_order.
+  HookVector<uint16_t> mask_order;
+  HookVector<uint16_t> mask_rank;
+  HookVector<uint64_t> mask_hits;
+
+  size_t replace_cache_limit = 0;
+  size_t replace_cache_bytes = 0;
+
+  EventRing events;
+  Vni_EventCallback event_callback = nullptr;
+  void* event_user_data = nullptr;
+  // Event checksums matched by the current and the previous frame, used to
+  // publish an event only when its frame appears.
+  HookVector<uint32_t> frame_events;
+  HookVector<uint32_t> last_frame_events;
+
+  // Hot reload. The loader thread parses a project and publishes it through
+  // pending_project, Vni_Colorize() adopts it before the next frame.
+  std::thread loader;
+  std::atomic<Project*> pending_project{nullptr};
+  std::atomic<uint32_t> reload_state{VNI_RELOAD_IDLE};
+
+  // Vni_SetClock(), null for std::chrono::steady_clock.
+  Vni_ClockCallback clock = nullptr;
+  void* clock_user_data = nullptr;
+  // Vni_StartRecording(), null when not recording.
+  std::unique_ptr<TraceWriter> recorder;
+
+#if defined(VNI_ENABLE_STATS)
+  Stats stats;
+#endif
+#if defined(VNI_ENABLE_TRACING)
+  SpanRing spans;
+#endif
+
+  ~Context();
+
+  // Milliseconds on the clock of animation timing and event timestamps.
+  int64_t now() const;
   uint32_t tick() const;
 };
 
+bool read_pal_file(std::istream& in, PalFile* pal);
+bool read_vni_file(std::istream& in, VniFile* vni,
+                   const VniReadOptions& options = VniReadOptions());
+// Fills the sequence offsets of options that depend on the PAL mappings.
+void reference_sequences(const PalFile& pal, VniReadOptions* options);
+
 }  // namespace vni
@@ -0,0 +1,62 @@
+#include "vni_memory.h"
+
+#include <mutex>
+#include <new>
+
+namespace vni {
+
+namespace {
+
+std::mutex g_allocator_mutex;
+Vni_Allocator g_allocator;
+bool g_has_allocator = false;
+
+}  // namespace
+
+void* MemoryHooks::allocate(size_t bytes, size_t alignment) {
+  size_t used = used_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  if (allocator_.budget_bytes != 0 && used > budget()) {
+    used_.fetch_sub(bytes, std::memory_order_relaxed);
+    throw std::bad_alloc();
+  }
+  void* p = nullptr;
+  if (custom()) {
+    p = allocator_.alloc(allocator_.user_data, bytes, alignment);
+  } else {
+    p = ::operator new(bytes, std::align_val_t(alignment), std::nothrow);
+  }
+  if (!p) {
+    used_.fetch_sub(bytes, std::memory_order_relaxed);
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void MemoryHooks::deallocate(void* p, size_t bytes, size_t alignment) {
+  if (custom()) {
+    allocator_.free(allocator_.user_data, p, bytes, alignment);
+  } else {
+    ::operator delete(p, std::align_val_t(alignment));
+  }
+  used_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+std::shared_ptr<MemoryHooks> make_memory_hooks(
+    const Vni_Allocator* allocator) {
+  if (allocator) {
+    return std::make_shared<MemoryHooks>(*allocator);
+  }
+  std::lock_guard<std::mutex> lock(g_allocator_mutex);
+  if (!g_has_allocator) {
+    return nullptr;
+  }
+  return std::make_shared<MemoryHooks>(g_allocator);
+}
+
+}  // namespace vni
+
+void Vni_SetAllocator(const Vni_Allocator* allocator) {
+  std::lock_guard<std::mutex> lock(vni::g_allocator_mutex);
+  vni::g_has_allocator = allocator != nullptr;
+  vni::g_allocator = allocator ? *allocator : Vni_Allocator();
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "vni.h"
+
+namespace vni {
+
+// Allocator hooks of a context: VNI project data, playback state, caches and
+// output buffers allocate through the Vni_Allocator callbacks and count
+// against its byte budget, see Vni_Allocator for what doesn't. An
+// allocation the callbacks refuse or that would exceed the budget throws
+// std::bad_alloc, which the API turns into a failed load or a missing
+// frame.
+class MemoryHooks {
+ public:
+  explicit MemoryHooks(const Vni_Allocator& allocator)
+      : allocator_(allocator) {}
+
+  void* allocate(size_t bytes, size_t alignment);
+  void deallocate(void* p, size_t bytes, size_t alignment);
+
+  size_t used() const { return used_.load(std::memory_order_relaxed); }
+  size_t budget() const {
+    return static_cast<size_t>(allocator_.budget_bytes);
+  }
+
+ private:
+  bool custom() const { return allocator_.alloc && allocator_.free; }
+
+  Vni_Allocator allocator_;
+  // Shared by the colorizing and the reload thread.
+  std::atomic<size_t> used_{0};
+};
+
+// Hooks for a context loaded with allocator, or the global hooks set by
+// Vni_SetAllocator() if allocator is null. Null means the default heap.
+std::shared_ptr<MemoryHooks> make_memory_hooks(
+    const Vni_Allocator* allocator);
+
+// Standard allocator over the hooks of a context, or over the default heap
+// if hooks is null. Copies of a container use the default heap, like
+// std::pmr containers, so they can outlive the context.
+template <typename T>
+class HookAllocator {
+ public:
+  using value_type = T;
+
+  HookAllocator() = default;
+  HookAllocator(MemoryHooks* hooks) : hooks_(hooks) {}  // NOLINT
+  template <typename U>
+  HookAllocator(const HookAllocator<U>& other) : hooks_(other.hooks()) {}
+
+  T* allocate(size_t n) {
+    if (n > static_cast<size_t>(-1) / sizeof(T)) {
+      throw std::bad_array_new_length();
+    }
+    if (!hooks_) {
+      return std::allocator<T>().allocate(n);
+    }
+    return static_cast<T*>(hooks_->allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T* p, size_t n) {
+    if (!hooks_) {
+      std::allocator<T>().deallocate(p, n);
+    } else {
+      hooks_->deallocate(p, n * sizeof(T), alignof(T));
+    }
+  }
+  HookAllocator select_on_container_copy_construction() const {
+    return HookAllocator();
+  }
+
+  MemoryHooks* hooks() const { return hooks_; }
+
+  template <typename U>
+  bool operator==(const HookAllocator<U>& other) const {
+    return hooks_ == other.hooks();
+  }
+  template <typename U>
+  bool operator!=(const HookAllocator<U>& other) const {
+    return hooks_ != other.hooks();
+  }
+
+ private:
+  MemoryHooks* hooks_ = nullptr;
+};
+
+template <typename T>
+using HookVector = std::vector<T, HookAllocator<T>>;
+template <typename T>
+using HookList = std::list<T, HookAllocator<T>>;
+template <typename Key, typename T>
+using HookUnorderedMap =
+    std::unordered_map<Key, T, std::hash<Key>, std::equal_to<Key>,
+                       HookAllocator<std::pair<const Key, T>>>;
+template <typename Key, typename T>
+using HookUnorderedMultimap =
+    std::unordered_multimap<Key, T, std::hash<Key>, std::equal_to<Key>,
+                            HookAllocator<std::pair<const Key, T>>>;
+using HookString =
+    std::basic_string<char, std::char_traits<char>, HookAllocator<char>>;
+
+// Heap memory held by containers, for Vni_GetMemoryUsage(). Counts the
+// capacity of a container, not its size, and one block per allocation.
+struct HeapTally {
+  // Estimated bookkeeping and rounding of the allocator per block.
+  static constexpr uint64_t kBlockOverhead = 16;
+
+  uint64_t bytes = 0;
+  uint64_t blocks = 0;
+
+  void add_block(size_t size) {
+    if (size > 0) {
+      bytes += size;
+      blocks++;
+    }
+  }
+  template <typename Vector>
+  void add(const Vector& v) {
+    add_block(v.capacity() * sizeof(typename Vector::value_type));
+  }
+  template <typename Allocator>
+  void add(const std::vector<bool, Allocator>& v) {
+    add_block((v.capacity() + 7) / 8);
+  }
+  template <typename Allocator>
+  void add(const std::basic_string<char, std::char_traits<char>, Allocator>&
+               s) {
+    // Short strings live inside the object.
+    const char* object = reinterpret_cast<const char*>(&s);
+    if (s.data() < object || s.data() >= object + sizeof(s)) {
+      add_block(s.capacity() + 1);
+    }
+  }
+  void add(const HeapTally& other) {
+    bytes += other.bytes;
+    blocks += other.blocks;
+  }
+};
+
+}  // namespace vni
@@ -0,0 +1,398 @@
+// vni-repack: rewrites a PAL/VNI project into a load-optimized layout.
+// Frames are recompressed with a configurable match effort or stored
+// uncompressed, and sequences can be reordered for locality. Mapping offsets
+// in the PAL file are rewritten to match the new VNI layout.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "vni_internal.h"
+#include "vni_tool_util.h"
+#include "vni_writer.h"
+
+using namespace vni;
+
+namespace {
+
+enum class Order { File, Refs, Mode };
+
+struct Options {
+  std::string in_pal;
+  std::string in_vni;
+  std::string out_pal;
+  std::string out_vni;
+  VniWriteOptions write;
+  int window_sz = kHeatshrinkWindow;
+  int lookahead_sz = kHeatshrinkLookahead;
+  Order order = Order::File;
+  uint32_t hot = 0;
+  std::vector<uint32_t> raw;
+  bool verify = false;
+  bool prune = false;
+};
+
+bool read_file(const std::string& path, std::string* out) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open()) {
+    return false;
+  }
+  std::ostringstream ss;
+  ss << in.rdbuf();
+  *out = ss.str();
+  return true;
+}
+
+bool write_file(const std::string& path, const std::string& data) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    return false;
+  }
+  out.write(data.data(), static_cast<std::streamsize>(data.size()));
+  return out.good();
+}
+
+// Parses the buffers like Vni_LoadFromPaths does and returns the time spent.
+// Sequence headers are kept so the output carries them over.
+double parse(const std::string& pal_data, const std::string& vni_data,
+             PalFile* pal, VniFile* vni, bool* ok) {
+  auto start = std::chrono::steady_clock::now();
+  std::istringstream pal_in(pal_data);
+  std::istringstream vni_in(vni_data);
+  VniReadOptions options;
+  options.keep_header = true;
+  *ok = read_pal_file(pal_in, pal) && read_vni_file(vni_in, vni, options);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+bool same_bytes(const uint8_t* a, const uint8_t* b, size_t len) {
+  return std::equal(a, a + len, b);
+}
+
+bool same_frames(const FrameSeq& a, const FrameSeq& b) {
+  if (a.frames.size() != b.frames.size() ||
+      a.masks.size() != b.masks.size() || a.size.width != b.size.width ||
+      a.size.height != b.size.height || a.header != b.header) {
+    return false;
+  }
+  for (size_t i = 0; i < a.masks.size(); i++) {
+    if (a.masks[i].size != b.masks[i].size ||
+        !same_bytes(a.data(a.masks[i]), b.data(b.masks[i]), a.masks[i].size)) {
+      return false;
+    }
+  }
+  // Decode frames kept compressed, one at a time.
+  FrameCache cache_a;
+  FrameCache cache_b;
+  for (size_t i = 0; i < a.frames.size(); i++) {
+    const auto& fa = a.frames[i];
+    const auto& fb = b.frames[i];
+    if (fa.delay != fb.delay || fa.hash != fb.hash ||
+        fa.plane_count != fb.plane_count || fa.has_mask != fb.has_mask ||
+        fa.plane_size != fb.plane_size) {
+      return false;
+    }
+    for (size_t p = 0; p < fa.plane_count; p++) {
+      if (a.marker(fa, p, &cache_a) != b.marker(fb, p, &cache_b) ||
+          !same_bytes(a.plane(fa, p, &cache_a), b.plane(fb, p, &cache_b),
+                      fa.plane_size)) {
+        return false;
+      }
+    }
+    if (fa.has_mask && !same_bytes(a.mask(fa, &cache_a), b.mask(fb, &cache_b),
+                                   fa.plane_size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool parse_int(const char* s, int* out) {
+  uint32_t v = 0;
+  if (!parse_u32(s, &v)) {
+    return false;
+  }
+  *out = static_cast<int>(v);
+  return true;
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: vni-repack [options] IN.pal IN.vni OUT.pal OUT.vni\n"
+          "  --window N        heatshrink window bits, must be 10\n"
+          "  --lookahead N     heatshrink lookahead bits, must be 5\n"
+          "  --effort N        match candidates tried per byte (default 256)\n"
+          "  --uncompressed    store all frames uncompressed\n"
+          "  --raw LIST        store these sequence indexes uncompressed\n"
+          "  --hot N           store the N most referenced sequences "
+          "uncompressed\n"
+          "  --order MODE      file (default), refs: most referenced first,\n"
+          "                    mode: grouped by switch mode, then refs\n"
+          "  --prune           drop sequences no mapping references\n"
+          "  --verify          reload the output and compare it to the "
+          "input\n"
+          "VNI files have no room for other window and lookahead sizes.\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opt;
+  std::vector<std::string> positional;
+  auto exit_code = parse_args(
+      "vni-repack", argc, argv, usage, &positional,
+      [&](const std::string& arg, const char* value) {
+        if (arg == "--uncompressed") {
+          opt.write.compress = false;
+        } else if (arg == "--prune") {
+          opt.prune = true;
+        } else if (arg == "--verify") {
+          opt.verify = true;
+        } else if (arg == "--window") {
+          return value_arg(parse_int(value, &opt.window_sz));
+        } else if (arg == "--lookahead") {
+          return value_arg(parse_int(value, &opt.lookahead_sz));
+        } else if (arg == "--effort") {
+          return value_arg(parse_int(value, &opt.write.max_chain) &&
+                           opt.write.max_chain > 0);
+        } else if (arg == "--hot") {
+          return value_arg(parse_u32(value, &opt.hot));
+        } else if (arg == "--raw" && value) {
+          std::stringstream list(value);
+          std::string item;
+          bool ok = true;
+          while (ok && std::getline(list, item, ',')) {
+            uint32_t index = 0;
+            ok = parse_u32(item.c_str(), &index);
+            opt.raw.push_back(index);
+          }
+          return value_arg(ok);
+        } else if (arg == "--order" && value) {
+          std::string order = value;
+          if (order == "file") {
+            opt.order = Order::File;
+          } else if (order == "refs") {
+            opt.order = Order::Refs;
+          } else if (order == "mode") {
+            opt.order = Order::Mode;
+          } else {
+            return Arg::Invalid;
+          }
+          return Arg::Value;
+        } else {
+          return Arg::Invalid;
+        }
+        return Arg::Flag;
+      });
+  if (exit_code) {
+    return *exit_code;
+  }
+  if (positional.size() != 4) {
+    usage();
+    return 1;
+  }
+  opt.in_pal = positional[0];
+  opt.in_vni = positional[1];
+  opt.out_pal = positional[2];
+  opt.out_vni = positional[3];
+  if (opt.window_sz != kHeatshrinkWindow ||
+      opt.lookahead_sz != kHeatshrinkLookahead) {
+    fprintf(stderr, "vni-repack: window must be %d and lookahead %d\n",
+            kHeatshrinkWindow, kHeatshrinkLookahead);
+    return 1;
+  }
+
+  std::string pal_data;
+  std::string vni_data;
+  if (!read_file(opt.in_pal, &pal_data) || !read_file(opt.in_vni, &vni_data)) {
+    fprintf(stderr, "vni-repack: unable to read input files\n");
+    return 1;
+  }
+  PalFile pal;
+  VniFile vni;
+  bool ok = false;
+  double load_before = parse(pal_data, vni_data, &pal, &vni, &ok);
+  if (!ok) {
+    fprintf(stderr, "vni-repack: unable to parse input project\n");
+    return 1;
+  }
+
+  // Reference count and lowest referencing switch mode of every sequence.
+  size_t count = vni.animations.size();
+  std::map<uint32_t, size_t> index_by_offset;
+  for (size_t i = 0; i < count; i++) {
+    index_by_offset[vni.animations[i].offset] = i;
+  }
+  std::vector<uint32_t> refs(count, 0);
+  std::vector<int> mode(count, 0xff);
+  for (const auto& entry : pal.mappings) {
+    const Mapping& mapping = entry.second;
+    if (!mapping.is_animation()) {
+      continue;
+    }
+    auto it = index_by_offset.find(mapping.offset);
+    if (it == index_by_offset.end()) {
+      continue;
+    }
+    refs[it->second]++;
+    mode[it->second] =
+        std::min(mode[it->second], static_cast<int>(mapping.mode));
+  }
+
+  std::vector<size_t> by_refs(count);
+  std::iota(by_refs.begin(), by_refs.end(), 0);
+  std::stable_sort(by_refs.begin(), by_refs.end(),
+                   [&](size_t a, size_t b) { return refs[a] > refs[b]; });
+
+  std::vector<bool> raw(count, false);
+  for (uint32_t index : opt.raw) {
+    if (index < count) {
+      raw[index] = true;
+    }
+  }
+  for (size_t i = 0; i < opt.hot && i < count && refs[by_refs[i]] > 0; i++) {
+    raw[by_refs[i]] = true;
+  }
+
+  std::vector<size_t> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  if (opt.order == Order::Refs) {
+    order = by_refs;
+  } else if (opt.order == Order::Mode) {
+    order = by_refs;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b) { return mode[a] < mode[b]; });
+  }
+
+  // A sequence spans from its offset to the next one in the file.
+  size_t pruned = 0;
+  size_t pruned_bytes = 0;
+  if (opt.prune) {
+    for (auto it = index_by_offset.begin(); it != index_by_offset.end();
+         ++it) {
+      if (refs[it->second] == 0) {
+        auto next = std::next(it);
+        pruned_bytes += (next == index_by_offset.end() ? vni_data.size()
+                                                       : next->first) -
+                        it->first;
+        pruned++;
+      }
+    }
+    order.erase(std::remove_if(order.begin(), order.end(),
+                               [&](size_t index) { return refs[index] == 0; }),
+                order.end());
+  }
+
+  VniFile out_vni;
+  out_vni.version = vni.version;
+  out_vni.dimensions = vni.dimensions;
+  std::vector<uint32_t> old_offsets;
+  for (size_t index : order) {
+    old_offsets.push_back(vni.animations[index].offset);
+    opt.write.uncompressed.push_back(raw[index]);
+    out_vni.animations.push_back(std::move(vni.animations[index]));
+  }
+
+  std::ostringstream vni_out;
+  VniWriteResult result;
+  if (!write_vni_file(vni_out, out_vni, opt.write, &result)) {
+    fprintf(stderr, "vni-repack: unable to serialize VNI\n");
+    return 1;
+  }
+  std::map<uint32_t, uint32_t> new_offset;
+  for (size_t i = 0; i < old_offsets.size(); i++) {
+    new_offset[old_offsets[i]] = result.offsets[i];
+  }
+  size_t dangling = 0;
+  for (auto& entry : pal.mappings) {
+    Mapping& mapping = entry.second;
+    if (!mapping.is_animation()) {
+      continue;
+    }
+    auto it = new_offset.find(mapping.offset);
+    if (it != new_offset.end()) {
+      mapping.offset = it->second;
+    } else {
+      // Offset 0 is the file header and never matches a sequence, so a
+      // dangling mapping can't resolve to a moved sequence by accident.
+      mapping.offset = 0;
+      dangling++;
+    }
+  }
+  std::ostringstream pal_out;
+  if (!write_pal_file(pal_out, pal)) {
+    fprintf(stderr, "vni-repack: unable to serialize PAL\n");
+    return 1;
+  }
+
+  std::string new_pal = pal_out.str();
+  std::string new_vni = vni_out.str();
+  if (!write_file(opt.out_pal, new_pal) || !write_file(opt.out_vni, new_vni)) {
+    fprintf(stderr, "vni-repack: unable to write output files\n");
+    return 1;
+  }
+
+  PalFile check_pal;
+  VniFile check_vni;
+  double load_after = parse(new_pal, new_vni, &check_pal, &check_vni, &ok);
+  if (!ok) {
+    fprintf(stderr, "vni-repack: the repacked project doesn't parse\n");
+    return 1;
+  }
+
+  if (opt.verify) {
+    bool same = check_vni.animations.size() == out_vni.animations.size() &&
+                check_pal.mappings.size() == pal.mappings.size() &&
+                check_pal.masks == pal.masks;
+    for (size_t i = 0; same && i < out_vni.animations.size(); i++) {
+      same = same_frames(check_vni.animations[i], out_vni.animations[i]) &&
+             check_vni.animations[i].offset == result.offsets[i];
+    }
+    for (const auto& entry : pal.mappings) {
+      auto it = check_pal.mappings.find(entry.first);
+      same = same && it != check_pal.mappings.end() &&
+             it->second.mode == entry.second.mode &&
+             it->second.palette_index == entry.second.palette_index &&
+             it->second.offset == entry.second.offset &&
+             it->second.duration == entry.second.duration;
+    }
+    if (!same) {
+      fprintf(stderr, "vni-repack: verification failed\n");
+      return 1;
+    }
+  }
+
+  printf("sequences:          %zu (%zu stored uncompressed)\n", count,
+         static_cast<size_t>(std::count(raw.begin(), raw.end(), true)));
+  printf("frames:             %zu (%zu compressed)\n", result.frames,
+         result.compressed_frames);
+  printf("frame data:         %zu bytes raw, %zu bytes stored\n",
+         result.raw_bytes, result.stored_bytes);
+  printf("vni size:           %zu -> %zu bytes\n", vni_data.size(),
+         new_vni.size());
+  printf("pal size:           %zu -> %zu bytes\n", pal_data.size(),
+         new_pal.size());
+  printf("parse time:         %.3f -> %.3f ms\n", load_before, load_after);
+  if (opt.prune) {
+    printf("pruned:             %zu sequences, %zu bytes\n", pruned,
+           pruned_bytes);
+  }
+  if (dangling > 0) {
+    printf("dangling mappings:  %zu (offset matches no sequence)\n", dangling);
+  }
+  if (opt.verify) {
+    printf("verify:             ok\n");
+  }
+  return 0;
+}
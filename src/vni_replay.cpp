@@ -0,0 +1,263 @@
+// vni-replay: replays a trace recorded with Vni_StartRecording() against a
+// PAL/VNI project. Animation timing runs on the trace's timestamps instead
+// of the wall clock, so a replay produces the same output on every run and
+// build. Reports per-frame latency percentiles and a digest of the output.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "FrameUtil.h"
+#include "vni.h"
+#include "vni_tool_util.h"
+#include "vni_trace.h"
+
+using namespace vni;
+
+namespace {
+
+struct Options {
+  std::string pal;
+  std::string vni;
+  std::string trace;
+  uint32_t runs = 1;
+  uint32_t scaler = 0;
+  uint64_t replace_cache = 0;
+  bool bitplanes = false;
+  bool tick = false;
+  bool json = false;
+};
+
+struct RunResult {
+  uint64_t frames = 0;
+  uint64_t outputs = 0;
+  uint64_t ticks = 0;
+  uint64_t events = 0;
+  uint64_t digest = kDigestSeed;
+  std::vector<uint64_t> latencies;
+};
+
+int64_t virtual_clock(void* user_data) {
+  return *static_cast<const int64_t*>(user_data);
+}
+
+// Digests the output like vni_bench, bitplanes joined into pixels first.
+void digest_output(Vni_Context* ctx, bool bitplanes, std::vector<uint8_t>* buf,
+                   RunResult* result) {
+  if (bitplanes) {
+    const Vni_Planes_Struc* planes = Vni_GetPlanes(ctx);
+    buf->assign(static_cast<size_t>(planes->width) * planes->height, 0);
+    FrameUtil::Helper::Join(buf->data(), static_cast<uint16_t>(planes->width),
+                            static_cast<uint16_t>(planes->height),
+                            planes->bitlen, planes->planes);
+    result->digest = fnv1a(result->digest, buf->data(), buf->size());
+    result->digest = fnv1a(result->digest, planes->palette,
+                           (1u << planes->bitlen) * 3u);
+  } else {
+    const Vni_Frame_Struc* frame = Vni_GetFrame(ctx);
+    result->digest =
+        fnv1a(result->digest, frame->frame,
+              static_cast<size_t>(frame->width) * frame->height);
+    result->digest = fnv1a(result->digest, frame->palette,
+                           (1u << frame->bitlen) * 3u);
+  }
+}
+
+void digest_events(Vni_Context* ctx, RunResult* result) {
+  Vni_Event event;
+  while (Vni_PollEvent(ctx, &event)) {
+    result->digest = fnv1a(result->digest,
+                           reinterpret_cast<const uint8_t*>(&event.checksum),
+                           sizeof(event.checksum));
+    // Deterministic on the virtual clock.
+    result->digest =
+        fnv1a(result->digest,
+              reinterpret_cast<const uint8_t*>(&event.timestamp_ms),
+              sizeof(event.timestamp_ms));
+    result->events++;
+  }
+}
+
+bool replay(const Options& opt, RunResult* result) {
+  TraceReader reader;
+  if (!reader.open(opt.trace)) {
+    fprintf(stderr, "vni-replay: unable to read trace %s\n",
+            opt.trace.c_str());
+    return false;
+  }
+  Vni_Context* ctx =
+      Vni_LoadFromPaths(opt.pal.c_str(),
+                        opt.vni.empty() ? nullptr : opt.vni.c_str(), nullptr,
+                        nullptr);
+  if (!ctx) {
+    fprintf(stderr, "vni-replay: unable to load %s\n", opt.pal.c_str());
+    return false;
+  }
+  int64_t now = 0;
+  Vni_SetClock(ctx, virtual_clock, &now);
+  Vni_SetScalerMode(ctx, opt.scaler);
+  Vni_SetReplaceCacheLimit(ctx, opt.replace_cache);
+  Vni_SetOutputMode(ctx,
+                    opt.bitplanes ? VNI_OUTPUT_BITPLANES : VNI_OUTPUT_INDEXED);
+
+  TraceFrame frame;
+  std::vector<uint8_t> buf;
+  while (reader.next(&frame)) {
+    // Animation frames and palette resets that fall between two inputs,
+    // as a host calling Vni_Tick() at every deadline would see them.
+    for (int64_t deadline = Vni_GetNextDeadline(ctx);
+         opt.tick && deadline >= 0 && deadline <= frame.time_ms;) {
+      now = std::max(now, deadline);
+      if (Vni_Tick(ctx)) {
+        digest_output(ctx, opt.bitplanes, &buf, result);
+        result->ticks++;
+      }
+      int64_t next = Vni_GetNextDeadline(ctx);
+      if (next == deadline) {
+        break;
+      }
+      deadline = next;
+    }
+    now = frame.time_ms;
+
+    auto start = std::chrono::steady_clock::now();
+    uint32_t has_frame = Vni_Colorize(ctx, frame.pixels.data(), frame.width,
+                                      frame.height, frame.bitlen);
+    auto end = std::chrono::steady_clock::now();
+    result->latencies.push_back(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count()));
+    result->frames++;
+    if (has_frame) {
+      digest_output(ctx, opt.bitplanes, &buf, result);
+      result->outputs++;
+    }
+    digest_events(ctx, result);
+  }
+  Vni_Dispose(ctx);
+  if (reader.error()) {
+    fprintf(stderr, "vni-replay: malformed record after %llu frames\n",
+            static_cast<unsigned long long>(result->frames));
+    return false;
+  }
+  return true;
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: vni-replay [options] PROJECT.pal PROJECT.vni TRACE\n"
+          "  --runs N               replay N times, latencies of all runs "
+          "(default 1)\n"
+          "  --tick                 call Vni_Tick() at every deadline between "
+          "frames\n"
+          "  --scaler N             0 = none, 1 = scale2x, 2 = doubled\n"
+          "  --replace-cache BYTES  joined Replace frame cache limit\n"
+          "  --bitplanes            bitplane output instead of indexed "
+          "pixels\n"
+          "  --json                 print one JSON line\n"
+          "Pass - as PROJECT.vni for a project without VNI file. Traces are\n"
+          "recorded with Vni_StartRecording().\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opt;
+  std::vector<std::string> positional;
+  auto exit_code = parse_args(
+      "vni-replay", argc, argv, usage, &positional,
+      [&](const std::string& arg, const char* value) {
+        if (arg == "--tick") {
+          opt.tick = true;
+        } else if (arg == "--bitplanes") {
+          opt.bitplanes = true;
+        } else if (arg == "--json") {
+          opt.json = true;
+        } else if (arg == "--runs") {
+          return value_arg(parse_u32(value, &opt.runs) && opt.runs > 0);
+        } else if (arg == "--scaler") {
+          return value_arg(parse_u32(value, &opt.scaler) && opt.scaler <= 2);
+        } else if (arg == "--replace-cache") {
+          return value_arg(parse_u64(value, &opt.replace_cache));
+        } else {
+          return Arg::Invalid;
+        }
+        return Arg::Flag;
+      });
+  if (exit_code) {
+    return *exit_code;
+  }
+  if (positional.size() != 3) {
+    usage();
+    return 1;
+  }
+  opt.pal = positional[0];
+  opt.vni = positional[1] == "-" ? "" : positional[1];
+  opt.trace = positional[2];
+
+  RunResult first;
+  std::vector<uint64_t> latencies;
+  bool deterministic = true;
+  for (uint32_t run = 0; run < opt.runs; run++) {
+    RunResult result;
+    if (!replay(opt, &result)) {
+      return 1;
+    }
+    latencies.insert(latencies.end(), result.latencies.begin(),
+                     result.latencies.end());
+    if (run == 0) {
+      first = std::move(result);
+    } else if (result.digest != first.digest ||
+               result.outputs != first.outputs) {
+      deterministic = false;
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+  uint64_t total = 0;
+  for (uint64_t ns : latencies) {
+    total += ns;
+  }
+  double mean = latencies.empty() ? 0.0
+                                  : static_cast<double>(total) /
+                                        static_cast<double>(latencies.size());
+
+  if (opt.json) {
+    JsonLine json;
+    json.add_str("trace", opt.trace);
+    json.add_u64("frames", first.frames);
+    json.add_u64("outputs", first.outputs);
+    json.add_u64("ticks", first.ticks);
+    json.add_u64("events", first.events);
+    json.add_u64("runs", opt.runs);
+    add_latency(&json, latencies);
+    json.add_hex("digest", first.digest, 16);
+    json.add_bool("consistent", deterministic);
+    printf("%s\n", json.finish().c_str());
+  } else {
+    printf("frames:         %llu (%llu output, %llu ticks, %llu events)\n",
+           static_cast<unsigned long long>(first.frames),
+           static_cast<unsigned long long>(first.outputs),
+           static_cast<unsigned long long>(first.ticks),
+           static_cast<unsigned long long>(first.events));
+    printf("latency:        mean %.0f ns, p50 %llu, p90 %llu, p99 %llu, "
+           "max %llu\n",
+           mean,
+           static_cast<unsigned long long>(percentile(latencies, 0.50)),
+           static_cast<unsigned long long>(percentile(latencies, 0.90)),
+           static_cast<unsigned long long>(percentile(latencies, 0.99)),
+           static_cast<unsigned long long>(
+               latencies.empty() ? 0 : latencies.back()));
+    printf("digest:         %016llx\n",
+           static_cast<unsigned long long>(first.digest));
+    if (opt.runs > 1) {
+      printf("deterministic:  %s (%u runs)\n", deterministic ? "yes" : "NO",
+             opt.runs);
+    }
+  }
+  return deterministic ? 0 : 1;
+}
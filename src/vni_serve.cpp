@@ -0,0 +1,535 @@
+// vni-serve: loads a PAL/VNI project once and colorizes frames for other
+// processes. Every client gets its own context sharing the loaded project
+// (Vni_Share()) and a shared-memory ring of request slots, see
+// vni_serve_ring.h. Input is colorized in place in the client's ring,
+// wakeups go through an eventfd towards the daemon and a futex back. One
+// thread serves all clients.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "vni.h"
+#include "vni_serve_ring.h"
+#include "vni_tool_util.h"
+
+using namespace vni;
+
+namespace {
+
+constexpr uint64_t kListenTag = UINT64_MAX;
+constexpr uint64_t kSignalTag = UINT64_MAX - 1;
+
+struct Options {
+  std::string socket = "/tmp/vni-serve.sock";
+  std::string pal;
+  std::string vni;
+  uint32_t clients = 16;
+  uint32_t scaler = 0;
+  uint64_t replace_cache = 0;
+  uint64_t frame_cache = 0;
+  bool keep_compressed = false;
+  bool prune = false;
+  bool verbose = false;
+};
+
+struct Client {
+  uint32_t id = 0;
+  int socket = -1;
+  int doorbell = -1;
+  ServeRing* ring = nullptr;
+  size_t ring_bytes = 0;
+  Vni_Context* ctx = nullptr;
+  int64_t now = 0;
+  uint32_t completed = 0;
+  uint64_t requests = 0;
+
+  ~Client() {
+    if (ctx) {
+      Vni_Dispose(ctx);
+    }
+    if (ring) {
+      munmap(ring, ring_bytes);
+    }
+    if (doorbell >= 0) {
+      close(doorbell);
+    }
+    if (socket >= 0) {
+      close(socket);
+    }
+  }
+};
+
+int64_t request_clock(void* user_data) {
+  return static_cast<const Client*>(user_data)->now;
+}
+
+class Server {
+ public:
+  explicit Server(const Options& opt) : opt_(opt) {}
+  ~Server();
+
+  bool start(Vni_Context* project);
+  void run();
+
+ private:
+  // Epoll tags hold the client id, which is never reused, so events still
+  // queued for a dropped client find nothing.
+  static uint64_t tag(const Client& client, bool doorbell) {
+    return (static_cast<uint64_t>(client.id) << 1) | (doorbell ? 1 : 0);
+  }
+  size_t find(uint32_t id) const;
+  void accept_client();
+  bool welcome(Client* client);
+  void reply(int socket, ServeStatus status, uint32_t ring_bytes,
+             const int* fds);
+  void serve(Client* client);
+  void handle(Client* client, ServeSlot* slot);
+  void drop(size_t index, const char* reason);
+
+  const Options& opt_;
+  Vni_Context* project_ = nullptr;
+  int listen_ = -1;
+  int signals_ = -1;
+  int epoll_ = -1;
+  bool running_ = true;
+  uint32_t next_id_ = 1;
+  std::vector<std::unique_ptr<Client>> clients_;
+};
+
+Server::~Server() {
+  clients_.clear();
+  if (listen_ >= 0) {
+    close(listen_);
+    unlink(opt_.socket.c_str());
+  }
+  if (signals_ >= 0) {
+    close(signals_);
+  }
+  if (epoll_ >= 0) {
+    close(epoll_);
+  }
+}
+
+bool Server::start(Vni_Context* project) {
+  project_ = project;
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (opt_.socket.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "vni-serve: socket path too long\n");
+    return false;
+  }
+  std::memcpy(addr.sun_path, opt_.socket.c_str(), opt_.socket.size() + 1);
+
+  // A socket file nobody listens on is left over from a daemon that died.
+  int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (probe >= 0) {
+    bool taken = connect(probe, reinterpret_cast<const sockaddr*>(&addr),
+                         sizeof(addr)) == 0;
+    close(probe);
+    if (taken) {
+      fprintf(stderr, "vni-serve: %s is served by another daemon\n",
+              opt_.socket.c_str());
+      return false;
+    }
+  }
+  unlink(opt_.socket.c_str());
+  listen_ =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (listen_ < 0 ||
+      bind(listen_, reinterpret_cast<const sockaddr*>(&addr),
+           sizeof(addr)) != 0 ||
+      listen(listen_, 16) != 0) {
+    fprintf(stderr, "vni-serve: unable to listen on %s: %s\n",
+            opt_.socket.c_str(), strerror(errno));
+    if (listen_ >= 0) {
+      close(listen_);
+      listen_ = -1;
+    }
+    return false;
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  signals_ = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  epoll_ = epoll_create1(EPOLL_CLOEXEC);
+  if (signals_ < 0 || epoll_ < 0) {
+    fprintf(stderr, "vni-serve: %s\n", strerror(errno));
+    return false;
+  }
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = kListenTag;
+  epoll_ctl(epoll_, EPOLL_CTL_ADD, listen_, &event);
+  event.data.u64 = kSignalTag;
+  epoll_ctl(epoll_, EPOLL_CTL_ADD, signals_, &event);
+  return true;
+}
+
+void Server::run() {
+  epoll_event events[64];
+  while (running_) {
+    int n = epoll_wait(epoll_, events, 64, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "vni-serve: %s\n", strerror(errno));
+      return;
+    }
+    for (int i = 0; i < n; i++) {
+      uint64_t tag = events[i].data.u64;
+      if (tag == kListenTag) {
+        accept_client();
+        continue;
+      }
+      if (tag == kSignalTag) {
+        running_ = false;
+        continue;
+      }
+      size_t index = find(static_cast<uint32_t>(tag >> 1));
+      if (index == clients_.size()) {
+        continue;  // dropped earlier in this batch
+      }
+      Client* client = clients_[index].get();
+      if (tag & 1) {
+        uint64_t count = 0;
+        ssize_t got = read(client->doorbell, &count, sizeof(count));
+        (void)got;
+        serve(client);
+      } else if (client->ring ||
+                 (events[i].events & (EPOLLHUP | EPOLLERR))) {
+        // Clients only talk through the ring once they are welcomed.
+        drop(index, "disconnected");
+      } else if (!welcome(client)) {
+        drop(index, nullptr);
+      }
+    }
+  }
+}
+
+size_t Server::find(uint32_t id) const {
+  for (size_t i = 0; i < clients_.size(); i++) {
+    if (clients_[i] && clients_[i]->id == id) {
+      return i;
+    }
+  }
+  return clients_.size();
+}
+
+void Server::accept_client() {
+  int fd = accept4(listen_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd < 0) {
+    return;
+  }
+  size_t index = 0;
+  while (index < clients_.size() && clients_[index]) {
+    index++;
+  }
+  size_t active = static_cast<size_t>(
+      std::count_if(clients_.begin(), clients_.end(),
+                    [](const std::unique_ptr<Client>& c) { return !!c; }));
+  if (active >= opt_.clients) {
+    reply(fd, ServeStatus::Busy, 0, nullptr);
+    close(fd);
+    return;
+  }
+  if (index == clients_.size()) {
+    clients_.emplace_back();
+  }
+  auto client = std::make_unique<Client>();
+  client->id = next_id_++;
+  client->socket = fd;
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = tag(*client, false);
+  epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event);
+  clients_[index] = std::move(client);
+}
+
+void Server::reply(int socket, ServeStatus status, uint32_t ring_bytes,
+                   const int* fds) {
+  ServeWelcome welcome;
+  welcome.status = status;
+  welcome.ring_bytes = ring_bytes;
+  iovec iov = {&welcome, sizeof(welcome)};
+  alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fds) {
+    std::memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+  }
+  ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+  (void)sent;
+}
+
+// Sets up the ring and context of a client that sent its hello.
+bool Server::welcome(Client* client) {
+  ServeHello hello;
+  ServeRing layout;
+  size_t ring_bytes = 0;
+  ssize_t got = recv(client->socket, &hello, sizeof(hello), MSG_DONTWAIT);
+  if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true;
+  }
+  if (got != static_cast<ssize_t>(sizeof(hello)) ||
+      hello.magic != kServeMagic || hello.version != kServeVersion ||
+      !(ring_bytes = serve_layout(hello.max_width, hello.max_height,
+                                  hello.slots, opt_.scaler ? 2 : 1,
+                                  &layout))) {
+    reply(client->socket, ServeStatus::BadRequest, 0, nullptr);
+    return false;
+  }
+
+  int memfd = memfd_create("vni-serve", MFD_CLOEXEC);
+  if (memfd < 0 || ftruncate(memfd, static_cast<off_t>(ring_bytes)) != 0) {
+    if (memfd >= 0) {
+      close(memfd);
+    }
+    reply(client->socket, ServeStatus::Failed, 0, nullptr);
+    return false;
+  }
+  void* ring = mmap(nullptr, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    memfd, 0);
+  client->doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  client->ctx = Vni_Share(project_);
+  if (ring == MAP_FAILED || client->doorbell < 0 || !client->ctx) {
+    if (ring != MAP_FAILED) {
+      munmap(ring, ring_bytes);
+    }
+    close(memfd);
+    reply(client->socket, ServeStatus::Failed, 0, nullptr);
+    return false;
+  }
+  client->ring = new (ring) ServeRing();
+  client->ring_bytes = ring_bytes;
+  client->ring->magic = kServeMagic;
+  client->ring->version = kServeVersion;
+  client->ring->slots = layout.slots;
+  client->ring->slot_size = layout.slot_size;
+  client->ring->max_width = layout.max_width;
+  client->ring->max_height = layout.max_height;
+  client->ring->input_offset = layout.input_offset;
+  client->ring->output_offset = layout.output_offset;
+  client->ring->output_bytes = layout.output_bytes;
+  client->ring->submitted.store(0, std::memory_order_relaxed);
+  client->ring->completed.store(0, std::memory_order_relaxed);
+  client->ring->client_waiting.store(0, std::memory_order_relaxed);
+
+  Vni_SetClock(client->ctx, request_clock, client);
+  Vni_SetScalerMode(client->ctx, opt_.scaler);
+  Vni_SetReplaceCacheLimit(client->ctx, opt_.replace_cache);
+
+  int fds[2] = {memfd, client->doorbell};
+  reply(client->socket, ServeStatus::Ok, static_cast<uint32_t>(ring_bytes),
+        fds);
+  close(memfd);
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = tag(*client, true);
+  epoll_ctl(epoll_, EPOLL_CTL_ADD, client->doorbell, &event);
+  if (opt_.verbose) {
+    fprintf(stderr, "vni-serve: client %u connected, %ux%u, %u slots\n",
+            client->id, layout.max_width, layout.max_height, layout.slots);
+  }
+  return true;
+}
+
+// Answers every request the client submitted so far, in order.
+void Server::serve(Client* client) {
+  ServeRing* ring = client->ring;
+  uint32_t submitted = ring->submitted.load(std::memory_order_acquire);
+  if (submitted - client->completed > ring->slots) {
+    drop(find(client->id), "overran its ring");
+    return;
+  }
+  while (client->completed != submitted) {
+    handle(client, serve_slot(ring, client->completed));
+    client->requests++;
+    ring->completed.store(++client->completed, std::memory_order_seq_cst);
+    if (ring->client_waiting.load(std::memory_order_seq_cst)) {
+      serve_wake(&ring->completed);
+    }
+  }
+}
+
+void Server::handle(Client* client, ServeSlot* slot) {
+  ServeRing* ring = client->ring;
+  // The client can write the slot at any time, read the request once.
+  ServeOp op = slot->op;
+  uint32_t width = slot->width;
+  uint32_t height = slot->height;
+  uint32_t bitlen = slot->bitlen;
+  client->now = slot->time_ms;
+
+  ServeStatus status = ServeStatus::Ok;
+  uint32_t has_frame = 0;
+  if (op == ServeOp::Colorize) {
+    if (width == 0 || height == 0 || bitlen == 0 || bitlen > 8 ||
+        width > ring->max_width * ring->max_height / height) {
+      status = ServeStatus::BadRequest;
+    } else {
+      has_frame = Vni_Colorize(client->ctx, serve_input(ring, slot), width,
+                               height, static_cast<uint8_t>(bitlen));
+    }
+  } else if (op == ServeOp::Tick) {
+    has_frame = Vni_Tick(client->ctx);
+  } else {
+    status = ServeStatus::BadRequest;
+  }
+
+  if (has_frame) {
+    const Vni_Frame_Struc* frame = Vni_GetFrame(client->ctx);
+    size_t surface = static_cast<size_t>(frame->width) * frame->height;
+    if (!frame->frame || frame->bitlen > 8 || surface > ring->output_bytes) {
+      status = ServeStatus::Failed;
+      has_frame = 0;
+    } else {
+      std::memcpy(serve_output(ring, slot), frame->frame, surface);
+      std::memcpy(slot->palette, frame->palette, (1u << frame->bitlen) * 3u);
+      slot->out_width = frame->width;
+      slot->out_height = frame->height;
+      slot->out_bitlen = frame->bitlen;
+    }
+  }
+  uint32_t events = 0;
+  while (events < kServeMaxEvents &&
+         Vni_PollEvent(client->ctx, &slot->events[events])) {
+    events++;
+  }
+  slot->status = status;
+  slot->has_frame = has_frame;
+  slot->event_count = events;
+  slot->next_deadline = Vni_GetNextDeadline(client->ctx);
+}
+
+void Server::drop(size_t index, const char* reason) {
+  Client* client = clients_[index].get();
+  if (opt_.verbose && reason) {
+    fprintf(stderr, "vni-serve: client %u %s after %llu requests\n",
+            client->id, reason,
+            static_cast<unsigned long long>(client->requests));
+  }
+  epoll_ctl(epoll_, EPOLL_CTL_DEL, client->socket, nullptr);
+  if (client->doorbell >= 0) {
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, client->doorbell, nullptr);
+  }
+  clients_[index].reset();
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: vni-serve [options] PROJECT.pal PROJECT.vni\n"
+          "  --socket PATH          Unix socket to listen on "
+          "(default /tmp/vni-serve.sock)\n"
+          "  --clients N            clients served at once (default 16)\n"
+          "  --scaler N             0 = none, 1 = scale2x, 2 = doubled\n"
+          "  --replace-cache BYTES  joined Replace frame cache limit\n"
+          "  --keep-compressed      keep compressed frames compressed\n"
+          "  --frame-cache BYTES    decoded frame cache per client\n"
+          "  --prune                skip sequences no mapping starts\n"
+          "  --verbose              log clients to stderr\n"
+          "Pass - as PROJECT.vni for a project without VNI file. The\n"
+          "project is loaded once with dedup_planes and shared read-only\n"
+          "by all clients.\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opt;
+  std::vector<std::string> positional;
+  auto exit_code = parse_args(
+      "vni-serve", argc, argv, usage, &positional,
+      [&](const std::string& arg, const char* value) {
+        if (arg == "--keep-compressed") {
+          opt.keep_compressed = true;
+        } else if (arg == "--prune") {
+          opt.prune = true;
+        } else if (arg == "--verbose") {
+          opt.verbose = true;
+        } else if (arg == "--socket") {
+          if (!value) {
+            return Arg::Invalid;
+          }
+          opt.socket = value;
+          return Arg::Value;
+        } else if (arg == "--clients") {
+          return value_arg(parse_u32(value, &opt.clients) && opt.clients > 0);
+        } else if (arg == "--scaler") {
+          return value_arg(parse_u32(value, &opt.scaler) && opt.scaler <= 2);
+        } else if (arg == "--replace-cache") {
+          return value_arg(parse_u64(value, &opt.replace_cache));
+        } else if (arg == "--frame-cache") {
+          return value_arg(parse_u64(value, &opt.frame_cache));
+        } else {
+          return Arg::Invalid;
+        }
+        return Arg::Flag;
+      });
+  if (exit_code) {
+    return *exit_code;
+  }
+  if (positional.size() != 2) {
+    usage();
+    return 1;
+  }
+  opt.pal = positional[0];
+  opt.vni = positional[1] == "-" ? "" : positional[1];
+
+  Vni_Load_Options load = {};
+  load.keep_compressed = opt.keep_compressed ? 1 : 0;
+  load.frame_cache_bytes = opt.frame_cache;
+  load.prune_unreachable = opt.prune ? 1 : 0;
+  load.dedup_planes = 1;
+  Vni_Context* project = Vni_LoadFromPathsWithOptions(
+      opt.pal.c_str(), opt.vni.empty() ? nullptr : opt.vni.c_str(), nullptr,
+      nullptr, &load);
+  if (!project) {
+    fprintf(stderr, "vni-serve: unable to load %s\n", opt.pal.c_str());
+    return 1;
+  }
+  int result = 1;
+  {
+    Server server(opt);
+    if (server.start(project)) {
+      if (opt.verbose) {
+        fprintf(stderr, "vni-serve: serving %s on %s\n", opt.pal.c_str(),
+                opt.socket.c_str());
+      }
+      server.run();
+      result = 0;
+    }
+  }
+  Vni_Dispose(project);
+  return result;
+}
@@ -0,0 +1,319 @@
+// vni-serve-client: replays a trace recorded with Vni_StartRecording()
+// through a running vni-serve daemon, the way vni-replay replays it in
+// process, from one or more connections at once. Reports round-trip
+// latency percentiles and the output digest, which matches vni-replay's
+// for the same trace and options.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vni_serve_ring.h"
+#include "vni_tool_util.h"
+#include "vni_trace.h"
+
+using namespace vni;
+
+namespace {
+
+struct Options {
+  std::string socket = "/tmp/vni-serve.sock";
+  std::string trace;
+  uint32_t clients = 1;
+  uint32_t depth = 1;
+  uint32_t spin = 0;
+  bool tick = false;
+  bool json = false;
+};
+
+struct RunResult {
+  bool ok = false;
+  uint64_t frames = 0;
+  uint64_t outputs = 0;
+  uint64_t ticks = 0;
+  uint64_t events = 0;
+  uint64_t digest = kDigestSeed;
+  std::vector<uint64_t> latencies;
+  // Events of the responses since the last Colorize one, digested after
+  // its output like vni-replay polls them after Vni_Colorize().
+  std::vector<Vni_Event> pending;
+};
+
+uint64_t now_ns() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+void digest_output(const ServeClient& client, const ServeSlot* slot,
+                   RunResult* result) {
+  result->digest =
+      fnv1a(result->digest, client.output(slot),
+            static_cast<size_t>(slot->out_width) * slot->out_height);
+  result->digest =
+      fnv1a(result->digest, slot->palette, (1u << slot->out_bitlen) * 3u);
+}
+
+void digest_events(RunResult* result) {
+  for (const Vni_Event& event : result->pending) {
+    result->digest = fnv1a(result->digest,
+                           reinterpret_cast<const uint8_t*>(&event.checksum),
+                           sizeof(event.checksum));
+    result->digest =
+        fnv1a(result->digest,
+              reinterpret_cast<const uint8_t*>(&event.timestamp_ms),
+              sizeof(event.timestamp_ms));
+    result->events++;
+  }
+  result->pending.clear();
+}
+
+// Waits for the oldest request and folds its response into result.
+const ServeSlot* complete(ServeClient& client,
+                          std::vector<uint64_t>& submitted,
+                          RunResult* result) {
+  const ServeSlot* slot = client.wait();
+  if (!slot) {
+    fprintf(stderr, "vni-serve-client: the daemon went away\n");
+    return nullptr;
+  }
+  result->latencies.push_back(now_ns() - submitted.front());
+  submitted.erase(submitted.begin());
+  if (slot->status != ServeStatus::Ok) {
+    fprintf(stderr, "vni-serve-client: request failed with status %u\n",
+            static_cast<uint32_t>(slot->status));
+    return nullptr;
+  }
+  result->pending.insert(result->pending.end(), slot->events,
+                         slot->events + slot->event_count);
+  if (slot->has_frame) {
+    digest_output(client, slot, result);
+    if (slot->op == ServeOp::Colorize) {
+      result->outputs++;
+    }
+  }
+  return slot;
+}
+
+void replay(const Options& opt, const std::vector<TraceFrame>& frames,
+            uint32_t max_width, uint32_t max_height, RunResult* result) {
+  ServeClient client;
+  client.set_spin(opt.spin);
+  if (!client.connect(opt.socket, max_width, max_height, opt.depth)) {
+    fprintf(stderr, "vni-serve-client: unable to connect to %s\n",
+            opt.socket.c_str());
+    return;
+  }
+  std::vector<uint64_t> submitted;
+  int64_t next_deadline = -1;
+  int64_t now = 0;
+  for (const TraceFrame& frame : frames) {
+    // Ticks need the deadline of the previous response, so --tick runs
+    // one request at a time.
+    for (int64_t deadline = next_deadline;
+         opt.tick && deadline >= 0 && deadline <= frame.time_ms;) {
+      now = std::max(now, deadline);
+      submitted.push_back(now_ns());
+      client.submit(ServeOp::Tick, 0, 0, 0, now);
+      const ServeSlot* slot = complete(client, submitted, result);
+      if (!slot) {
+        return;
+      }
+      if (slot->has_frame) {
+        result->ticks++;
+      }
+      next_deadline = slot->next_deadline;
+      if (next_deadline == deadline) {
+        break;
+      }
+      deadline = next_deadline;
+    }
+    now = frame.time_ms;
+
+    ServeSlot* slot = client.next();
+    if (!slot) {
+      if (!complete(client, submitted, result)) {
+        return;
+      }
+      digest_events(result);
+      slot = client.next();
+    }
+    std::memcpy(client.input(slot), frame.pixels.data(),
+                frame.pixels.size());
+    submitted.push_back(now_ns());
+    client.submit(ServeOp::Colorize, frame.width, frame.height, frame.bitlen,
+                  now);
+    result->frames++;
+    if (opt.tick || client.in_flight() == opt.depth) {
+      const ServeSlot* done = complete(client, submitted, result);
+      if (!done) {
+        return;
+      }
+      next_deadline = done->next_deadline;
+      digest_events(result);
+    }
+  }
+  while (client.in_flight() > 0) {
+    if (!complete(client, submitted, result)) {
+      return;
+    }
+    digest_events(result);
+  }
+  result->ok = true;
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: vni-serve-client [options] TRACE\n"
+          "  --socket PATH   daemon socket (default /tmp/vni-serve.sock)\n"
+          "  --clients N     replay over N connections at once (default 1)\n"
+          "  --depth N       requests in flight per connection (default 1)\n"
+          "  --spin N        polls before sleeping on a response\n"
+          "  --tick          tick at every deadline between frames, one\n"
+          "                  request in flight\n"
+          "  --json          print one JSON line\n"
+          "Start vni-serve with the project the trace was recorded on and\n"
+          "the --scaler and --replace-cache options to compare with\n"
+          "vni-replay.\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opt;
+  std::vector<std::string> positional;
+  auto exit_code = parse_args(
+      "vni-serve-client", argc, argv, usage, &positional,
+      [&](const std::string& arg, const char* value) {
+        if (arg == "--tick") {
+          opt.tick = true;
+        } else if (arg == "--json") {
+          opt.json = true;
+        } else if (arg == "--socket") {
+          if (!value) {
+            return Arg::Invalid;
+          }
+          opt.socket = value;
+          return Arg::Value;
+        } else if (arg == "--clients") {
+          return value_arg(parse_u32(value, &opt.clients) &&
+                           opt.clients > 0 && opt.clients <= 256);
+        } else if (arg == "--depth") {
+          return value_arg(parse_u32(value, &opt.depth) && opt.depth > 0 &&
+                           opt.depth <= kServeMaxSlots);
+        } else if (arg == "--spin") {
+          return value_arg(parse_u32(value, &opt.spin));
+        } else {
+          return Arg::Invalid;
+        }
+        return Arg::Flag;
+      });
+  if (exit_code) {
+    return *exit_code;
+  }
+  if (positional.size() != 1) {
+    usage();
+    return 1;
+  }
+  opt.trace = positional[0];
+  if (opt.tick) {
+    opt.depth = 1;
+  }
+
+  // Decoded up front, so latencies are only the round trips.
+  TraceReader reader;
+  if (!reader.open(opt.trace)) {
+    fprintf(stderr, "vni-serve-client: unable to read trace %s\n",
+            opt.trace.c_str());
+    return 1;
+  }
+  std::vector<TraceFrame> frames;
+  TraceFrame frame;
+  uint32_t max_width = 0;
+  uint32_t max_height = 0;
+  while (reader.next(&frame)) {
+    max_width = std::max(max_width, frame.width);
+    max_height = std::max(max_height, frame.height);
+    frames.push_back(frame);
+  }
+  if (reader.error() || frames.empty()) {
+    fprintf(stderr, "vni-serve-client: malformed or empty trace %s\n",
+            opt.trace.c_str());
+    return 1;
+  }
+
+  std::vector<RunResult> results(opt.clients);
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < opt.clients; i++) {
+    threads.emplace_back(replay, std::cref(opt), std::cref(frames), max_width,
+                         max_height, &results[i]);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<uint64_t> latencies;
+  bool consistent = true;
+  for (const RunResult& result : results) {
+    if (!result.ok) {
+      return 1;
+    }
+    latencies.insert(latencies.end(), result.latencies.begin(),
+                     result.latencies.end());
+    consistent = consistent && result.digest == results[0].digest &&
+                 result.outputs == results[0].outputs;
+  }
+  const RunResult& first = results[0];
+  std::sort(latencies.begin(), latencies.end());
+  uint64_t total = 0;
+  for (uint64_t ns : latencies) {
+    total += ns;
+  }
+  double mean = latencies.empty() ? 0.0
+                                  : static_cast<double>(total) /
+                                        static_cast<double>(latencies.size());
+
+  if (opt.json) {
+    JsonLine json;
+    json.add_str("trace", opt.trace);
+    json.add_u64("frames", first.frames);
+    json.add_u64("outputs", first.outputs);
+    json.add_u64("ticks", first.ticks);
+    json.add_u64("events", first.events);
+    json.add_u64("clients", opt.clients);
+    json.add_u64("depth", opt.depth);
+    add_latency(&json, latencies);
+    json.add_hex("digest", first.digest, 16);
+    json.add_bool("consistent", consistent);
+    printf("%s\n", json.finish().c_str());
+  } else {
+    printf("frames:         %llu (%llu output, %llu ticks, %llu events)\n",
+           static_cast<unsigned long long>(first.frames),
+           static_cast<unsigned long long>(first.outputs),
+           static_cast<unsigned long long>(first.ticks),
+           static_cast<unsigned long long>(first.events));
+    printf("round trip:     mean %.0f ns, p50 %llu, p90 %llu, p99 %llu, "
+           "max %llu\n",
+           mean,
+           static_cast<unsigned long long>(percentile(latencies, 0.50)),
+           static_cast<unsigned long long>(percentile(latencies, 0.90)),
+           static_cast<unsigned long long>(percentile(latencies, 0.99)),
+           static_cast<unsigned long long>(
+               latencies.empty() ? 0 : latencies.back()));
+    printf("digest:         %016llx\n",
+           static_cast<unsigned long long>(first.digest));
+    if (opt.clients > 1) {
+      printf("consistent:     %s (%u clients)\n", consistent ? "yes" : "NO",
+             opt.clients);
+    }
+  }
+  return consistent ? 0 : 1;
+}
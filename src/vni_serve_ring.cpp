@@ -0,0 +1,217 @@
+#include "vni_serve_ring.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace vni {
+
+namespace {
+
+constexpr size_t kServeAlign = 64;
+
+size_t align_up(size_t size) {
+  return (size + kServeAlign - 1) & ~(kServeAlign - 1);
+}
+
+}  // namespace
+
+size_t serve_layout(uint32_t max_width, uint32_t max_height, uint32_t slots,
+                    uint32_t scale, ServeRing* ring) {
+  if (max_width == 0 || max_height == 0 || slots == 0 ||
+      slots > kServeMaxSlots || scale == 0 || scale > 2 ||
+      max_width > kServeMaxSurface / max_height) {
+    return 0;
+  }
+  size_t surface = static_cast<size_t>(max_width) * max_height;
+  size_t input = align_up(sizeof(ServeSlot));
+  size_t output = input + align_up(surface);
+  size_t output_bytes = surface * scale * scale;
+  size_t slot = output + align_up(output_bytes);
+  ring->slots = slots;
+  ring->slot_size = static_cast<uint32_t>(slot);
+  ring->max_width = max_width;
+  ring->max_height = max_height;
+  ring->input_offset = static_cast<uint32_t>(input);
+  ring->output_offset = static_cast<uint32_t>(output);
+  ring->output_bytes = static_cast<uint32_t>(output_bytes);
+  return sizeof(ServeRing) + slot * slots;
+}
+
+void serve_wait(std::atomic<uint32_t>* word, uint32_t value,
+                uint32_t timeout_ms) {
+  timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = static_cast<long>(timeout_ms % 1000) * 1000000;
+  // Not FUTEX_PRIVATE_FLAG, the word is in memory shared with another
+  // process.
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, value,
+          &timeout, nullptr, 0);
+}
+
+void serve_wake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX,
+          nullptr, nullptr, 0);
+}
+
+ServeClient::~ServeClient() { close(); }
+
+bool ServeClient::connect(const std::string& path, uint32_t max_width,
+                          uint32_t max_height, uint32_t slots) {
+  close();
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  socket_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (socket_ < 0 ||
+      ::connect(socket_, reinterpret_cast<const sockaddr*>(&addr),
+                sizeof(addr)) != 0) {
+    close();
+    return false;
+  }
+
+  ServeHello hello;
+  hello.max_width = max_width;
+  hello.max_height = max_height;
+  hello.slots = slots;
+  if (send(socket_, &hello, sizeof(hello), MSG_NOSIGNAL) !=
+      static_cast<ssize_t>(sizeof(hello))) {
+    close();
+    return false;
+  }
+
+  ServeWelcome welcome;
+  iovec iov = {&welcome, sizeof(welcome)};
+  alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t received = recvmsg(socket_, &msg, MSG_CMSG_CLOEXEC);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  int fds[2] = {-1, -1};
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  }
+  doorbell_ = fds[1];
+  if (received != static_cast<ssize_t>(sizeof(welcome)) ||
+      welcome.magic != kServeMagic || welcome.version != kServeVersion ||
+      welcome.status != ServeStatus::Ok || fds[0] < 0 || fds[1] < 0) {
+    if (fds[0] >= 0) {
+      ::close(fds[0]);
+    }
+    close();
+    return false;
+  }
+
+  void* ring = mmap(nullptr, welcome.ring_bytes, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fds[0], 0);
+  ::close(fds[0]);
+  if (ring == MAP_FAILED) {
+    close();
+    return false;
+  }
+  ring_ = static_cast<ServeRing*>(ring);
+  ring_bytes_ = welcome.ring_bytes;
+  submitted_ = ring_->submitted.load(std::memory_order_relaxed);
+  completed_ = submitted_;
+  return true;
+}
+
+void ServeClient::close() {
+  if (ring_) {
+    munmap(ring_, ring_bytes_);
+    ring_ = nullptr;
+  }
+  if (doorbell_ >= 0) {
+    ::close(doorbell_);
+    doorbell_ = -1;
+  }
+  if (socket_ >= 0) {
+    ::close(socket_);
+    socket_ = -1;
+  }
+}
+
+ServeSlot* ServeClient::next() {
+  if (!ring_ || in_flight() >= ring_->slots) {
+    return nullptr;
+  }
+  return serve_slot(ring_, submitted_);
+}
+
+void ServeClient::submit(ServeOp op, uint32_t width, uint32_t height,
+                         uint8_t bitlen, int64_t time_ms) {
+  ServeSlot* slot = next();
+  if (!slot) {
+    return;
+  }
+  slot->op = op;
+  slot->width = width;
+  slot->height = height;
+  slot->bitlen = bitlen;
+  slot->time_ms = time_ms;
+  ring_->submitted.store(++submitted_, std::memory_order_release);
+  uint64_t one = 1;
+  ssize_t written = write(doorbell_, &one, sizeof(one));
+  (void)written;
+}
+
+const ServeSlot* ServeClient::wait() {
+  if (!ring_ || in_flight() == 0) {
+    return nullptr;
+  }
+  uint32_t want = completed_ + 1;
+  auto done = [&]() {
+    return static_cast<int32_t>(
+               ring_->completed.load(std::memory_order_acquire) - want) >= 0;
+  };
+  for (uint32_t i = 0; i < spin_ && !done(); i++) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+  if (!done()) {
+    // The daemon wakes only clients that announced they sleep. Both sides
+    // store before they load with sequential consistency, so either it
+    // sees client_waiting or the check below sees its completion.
+    ring_->client_waiting.store(1, std::memory_order_seq_cst);
+    while (true) {
+      uint32_t completed = ring_->completed.load(std::memory_order_seq_cst);
+      if (static_cast<int32_t>(completed - want) >= 0) {
+        break;
+      }
+      if (daemon_gone()) {
+        ring_->client_waiting.store(0, std::memory_order_relaxed);
+        return nullptr;
+      }
+      serve_wait(&ring_->completed, completed, 100);
+    }
+    ring_->client_waiting.store(0, std::memory_order_relaxed);
+  }
+  return serve_slot(ring_, completed_++);
+}
+
+bool ServeClient::daemon_gone() const {
+  pollfd fd = {socket_, POLLIN, 0};
+  return poll(&fd, 1, 0) > 0;
+}
+
+}  // namespace vni
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "vni.h"
+
+// vni-serve protocol. A client connects to the daemon's Unix socket and
+// sends a ServeHello. The daemon answers with a ServeWelcome and, if it
+// accepts the client, passes two file descriptors along: a memfd holding
+// the client's ServeRing and an eventfd the client writes to after
+// submitting requests. Frames never travel through the socket.
+//
+// The ring is a ServeRing header followed by `slots` slots of slot_size
+// bytes. A slot is a ServeSlot followed by the input pixels at
+// input_offset and the output pixels at output_offset. The client fills
+// the slot at index submitted % slots, increments submitted and signals
+// the eventfd. The daemon colorizes the input in place, writes the
+// response into the same slot and increments completed, waking a client
+// that set client_waiting through a futex on completed. Up to `slots`
+// requests can be in flight.
+
+namespace vni {
+
+constexpr uint32_t kServeMagic = 0x53494e56;  // "VNIS"
+constexpr uint32_t kServeVersion = 1;
+constexpr uint32_t kServeMaxSlots = 64;
+constexpr uint32_t kServeMaxSurface = 1u << 20;
+constexpr uint32_t kServeMaxEvents = 16;
+
+enum class ServeOp : uint32_t {
+  Colorize = 0,  // Vni_Colorize() of the input
+  Tick = 1,      // Vni_Tick()
+};
+
+enum class ServeStatus : uint32_t {
+  Ok = 0,
+  BadRequest = 1,  // malformed hello or slot
+  Busy = 2,        // the daemon has no room for another client
+  Failed = 3,      // out of memory
+};
+
+struct ServeHello {
+  uint32_t magic = kServeMagic;
+  uint32_t version = kServeVersion;
+  uint32_t max_width = 0;
+  uint32_t max_height = 0;
+  uint32_t slots = 0;
+};
+
+struct ServeWelcome {
+  uint32_t magic = kServeMagic;
+  uint32_t version = kServeVersion;
+  ServeStatus status = ServeStatus::Ok;
+  uint32_t ring_bytes = 0;
+};
+
+struct ServeSlot {
+  // Request, written by the client.
+  ServeOp op;
+  uint32_t width;
+  uint32_t height;
+  uint32_t bitlen;
+  int64_t time_ms;  // the context's clock for this request
+
+  // Response, written by the daemon.
+  ServeStatus status;
+  uint32_t has_frame;  // the output below is a new frame
+  uint32_t out_width;
+  uint32_t out_height;
+  uint32_t out_bitlen;
+  uint32_t event_count;  // events of this request, more follow later
+  int64_t next_deadline;  // Vni_GetNextDeadline() after the request
+  Vni_Event events[kServeMaxEvents];
+  uint8_t palette[256 * 3];
+};
+
+struct ServeRing {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t slot_size;
+  uint32_t max_width;
+  uint32_t max_height;
+  uint32_t input_offset;
+  uint32_t output_offset;
+  uint32_t output_bytes;
+
+  // Each counter on its own cache line, written by one side only.
+  alignas(64) std::atomic<uint32_t> submitted;
+  alignas(64) std::atomic<uint32_t> completed;
+  std::atomic<uint32_t> client_waiting;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "ring counters are shared between processes");
+
+// Fills the layout fields of ring for the given limits and returns the
+// size of the whole ring in bytes, or 0 if they are out of range. Output
+// frames are up to scale times as wide and high as the input.
+size_t serve_layout(uint32_t max_width, uint32_t max_height, uint32_t slots,
+                    uint32_t scale, ServeRing* ring);
+
+inline ServeSlot* serve_slot(ServeRing* ring, uint32_t index) {
+  uint8_t* base = reinterpret_cast<uint8_t*>(ring) + sizeof(ServeRing);
+  return reinterpret_cast<ServeSlot*>(
+      base + static_cast<size_t>(index % ring->slots) * ring->slot_size);
+}
+inline uint8_t* serve_input(ServeRing* ring, ServeSlot* slot) {
+  return reinterpret_cast<uint8_t*>(slot) + ring->input_offset;
+}
+inline uint8_t* serve_output(ServeRing* ring, ServeSlot* slot) {
+  return reinterpret_cast<uint8_t*>(slot) + ring->output_offset;
+}
+
+// Process-shared futex on a word of the ring. serve_wait() returns when
+// word no longer holds value, on a wakeup or after timeout_ms.
+void serve_wait(std::atomic<uint32_t>* word, uint32_t value,
+                uint32_t timeout_ms);
+void serve_wake(std::atomic<uint32_t>* word);
+
+// Client side of the protocol: one connection and its ring.
+class ServeClient {
+ public:
+  ServeClient() = default;
+  ~ServeClient();
+
+  ServeClient(const ServeClient&) = delete;
+  ServeClient& operator=(const ServeClient&) = delete;
+
+  // Connects to the daemon at path for frames of up to max_width x
+  // max_height and up to slots requests in flight.
+  bool connect(const std::string& path, uint32_t max_width,
+               uint32_t max_height, uint32_t slots);
+  void close();
+
+  // Polls completed this many times before sleeping on the futex. Spinning
+  // saves the wakeup when the daemon runs on another core.
+  void set_spin(uint32_t iterations) { spin_ = iterations; }
+
+  // The slot of the next request. Write the input pixels straight into its
+  // input() instead of a buffer of your own. Null while all slots are in
+  // flight.
+  ServeSlot* next();
+  uint8_t* input(ServeSlot* slot) { return serve_input(ring_, slot); }
+  const uint8_t* output(const ServeSlot* slot) const {
+    return serve_output(ring_, const_cast<ServeSlot*>(slot));
+  }
+  // Submits the slot returned by next().
+  void submit(ServeOp op, uint32_t width, uint32_t height, uint8_t bitlen,
+              int64_t time_ms);
+  // Waits for the oldest request in flight and returns its slot, which
+  // stays valid until the next submit(). Null if nothing is in flight or
+  // the daemon went away.
+  const ServeSlot* wait();
+
+  uint32_t in_flight() const { return submitted_ - completed_; }
+  uint32_t max_width() const { return ring_ ? ring_->max_width : 0; }
+  uint32_t max_height() const { return ring_ ? ring_->max_height : 0; }
+
+ private:
+  bool daemon_gone() const;
+
+  int socket_ = -1;
+  int doorbell_ = -1;
+  ServeRing* ring_ = nullptr;
+  size_t ring_bytes_ = 0;
+  uint32_t submitted_ = 0;
+  uint32_t completed_ = 0;
+  uint32_t spin_ = 0;
+};
+
+}  // namespace vni
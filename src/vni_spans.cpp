@@ -0,0 +1,111 @@
+#include "vni_spans.h"
+
+#include <stdio.h>
+
+#include "vni_internal.h"
+#include "vni_memory.h"
+
+namespace vni {
+
+const char* span_name(SpanKind kind) {
+  switch (kind) {
+    case SpanKind::Colorize:
+      return "Vni_Colorize";
+    case SpanKind::Tick:
+      return "Vni_Tick";
+    case SpanKind::Split:
+      return "split";
+    case SpanKind::Trigger:
+      return "trigger_animation";
+    case SpanKind::FindMapping:
+      return "find_mapping";
+    case SpanKind::DetectLcm:
+      return "detect_lcm";
+    case SpanKind::DetectFollow:
+      return "detect_follow";
+    case SpanKind::RenderAnimation:
+      return "render_animation";
+    case SpanKind::Render:
+      return "render";
+    case SpanKind::Join:
+      return "join";
+    case SpanKind::Scale:
+      return "scale";
+    case SpanKind::Palette:
+      return "palette";
+    case SpanKind::AnimationStart:
+      return "animation start";
+    case SpanKind::AnimationStop:
+      return "animation stop";
+    case SpanKind::Reload:
+      return "reload";
+  }
+  return "unknown";
+}
+
+#if defined(VNI_ENABLE_TRACING)
+
+void SpanRing::set_enabled(bool enabled) {
+  if (enabled && !events_) {
+    events_.reset(new SpanEvent[kCapacity]);
+  }
+  enabled_.store(enabled, std::memory_order_release);
+}
+
+void SpanRing::tally_memory(HeapTally* tally) const {
+  tally->add_block(events_ ? kCapacity * sizeof(SpanEvent) : 0);
+}
+
+bool SpanRing::flush(const std::string& path) {
+  FILE* out = fopen(path.c_str(), "w");
+  if (!out) {
+    return false;
+  }
+  fprintf(out,
+          "{\"traceEvents\":[\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+          "\"args\":{\"name\":\"Vni_Colorize\"}}");
+  uint32_t tail = tail_.load(std::memory_order_relaxed);
+  uint32_t head = head_.load(std::memory_order_acquire);
+  for (; tail != head; tail++) {
+    const SpanEvent& event = events_[tail % kCapacity];
+    // Trace-event timestamps are in microseconds.
+    double ts = static_cast<double>(event.start_ns) / 1000.0;
+    if (event.kind == SpanKind::AnimationStart) {
+      fprintf(out,
+              ",\n{\"name\":\"%s\",\"cat\":\"vni\",\"ph\":\"i\",\"s\":\"t\","
+              "\"pid\":1,\"tid\":1,\"ts\":%.3f,\"args\":{\"mode\":\"%s\","
+              "\"offset\":%u}}",
+              span_name(event.kind), ts,
+              switch_mode_name(static_cast<SwitchMode>(event.mode)),
+              event.offset);
+    } else if (event.kind == SpanKind::AnimationStop) {
+      fprintf(out,
+              ",\n{\"name\":\"%s\",\"cat\":\"vni\",\"ph\":\"i\",\"s\":\"t\","
+              "\"pid\":1,\"tid\":1,\"ts\":%.3f,\"args\":{\"offset\":%u}}",
+              span_name(event.kind), ts, event.offset);
+    } else if (event.kind == SpanKind::Reload) {
+      fprintf(out,
+              ",\n{\"name\":\"%s\",\"cat\":\"vni\",\"ph\":\"i\",\"s\":\"t\","
+              "\"pid\":1,\"tid\":1,\"ts\":%.3f}",
+              span_name(event.kind), ts);
+    } else {
+      fprintf(out,
+              ",\n{\"name\":\"%s\",\"cat\":\"vni\",\"ph\":\"X\",\"pid\":1,"
+              "\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+              span_name(event.kind), ts,
+              static_cast<double>(event.duration_ns) / 1000.0);
+    }
+  }
+  tail_.store(tail, std::memory_order_release);
+  fprintf(out,
+          "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_spans\":"
+          "%llu}}\n",
+          static_cast<unsigned long long>(
+              dropped_.exchange(0, std::memory_order_relaxed)));
+  return fclose(out) == 0;
+}
+
+#endif
+
+}  // namespace vni
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+// Pipeline spans for Chrome/Perfetto trace-event export. Compiles to nothing
+// unless the library is built with VNI_ENABLE_TRACING (CMake option
+// ENABLE_TRACING, off by default). When compiled in, a span of a context
+// that isn't tracing still tests the enabled flag when it opens and again
+// when it closes, so release builds leave it off.
+
+namespace vni {
+
+enum class SpanKind : uint8_t {
+  Colorize,
+  Tick,
+  Split,
+  Trigger,
+  FindMapping,
+  DetectLcm,
+  DetectFollow,
+  RenderAnimation,
+  Render,
+  Join,
+  Scale,
+  Palette,
+  // Instants, duration_ns is 0.
+  AnimationStart,
+  AnimationStop,
+  Reload,
+};
+
+const char* span_name(SpanKind kind);
+
+#if defined(VNI_ENABLE_TRACING)
+
+struct HeapTally;
+
+struct SpanEvent {
+  uint64_t start_ns = 0;  // std::chrono::steady_clock
+  uint64_t duration_ns = 0;
+  uint32_t offset = 0;  // sequence of AnimationStart/AnimationStop
+  SpanKind kind = SpanKind::Colorize;
+  uint8_t mode = 0;  // switch mode of AnimationStart
+};
+
+inline uint64_t span_clock_ns() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+// Single producer / single consumer buffer of finished spans. The colorizing
+// thread records, Vni_FlushSpanTrace() drains, possibly on another thread.
+// Spans are dropped while the buffer is full. The buffer is allocated when
+// tracing is first enabled.
+class SpanRing {
+ public:
+  static constexpr uint32_t kCapacity = 1u << 16;
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+  void set_enabled(bool enabled);
+
+  void push(const SpanEvent& event) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    if (head - tail >= kCapacity) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    events_[head % kCapacity] = event;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  void instant(SpanKind kind, uint8_t mode, uint32_t offset) {
+    SpanEvent event;
+    event.start_ns = span_clock_ns();
+    event.kind = kind;
+    event.mode = mode;
+    event.offset = offset;
+    push(event);
+  }
+
+  // Writes the buffered spans to path as a trace-event JSON file and
+  // removes them from the buffer.
+  bool flush(const std::string& path);
+  void tally_memory(HeapTally* tally) const;
+
+ private:
+  std::atomic<bool> enabled_{false};
+  std::unique_ptr<SpanEvent[]> events_;
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+  std::atomic<uint64_t> dropped_{0};
+};
+
+class SpanScope {
+ public:
+  SpanScope(SpanRing& ring, SpanKind kind)
+      : ring_(ring.enabled() ? &ring : nullptr), kind_(kind) {
+    if (ring_) {
+      start_ns_ = span_clock_ns();
+    }
+  }
+  ~SpanScope() {
+    if (ring_) {
+      SpanEvent event;
+      event.start_ns = start_ns_;
+      event.duration_ns = span_clock_ns() - start_ns_;
+      event.kind = kind_;
+      ring_->push(event);
+    }
+  }
+
+  SpanScope(const SpanScope&) = delete;
+  SpanScope& operator=(const SpanScope&) = delete;
+
+ private:
+  SpanRing* ring_;
+  SpanKind kind_;
+  uint64_t start_ns_ = 0;
+};
+
+#define VNI_SPAN(ctx, kind) \
+  ::vni::SpanScope vni_span_##kind((ctx)->spans, ::vni::SpanKind::kind)
+#define VNI_SPAN_INSTANT(ctx, kind, mode, offset)                           \
+  do {                                                                      \
+    if ((ctx)->spans.enabled()) {                                           \
+      (ctx)->spans.instant(::vni::SpanKind::kind,                           \
+                           static_cast<uint8_t>(mode), (offset));           \
+    }                                                                       \
+  } while (0)
+
+#else
+
+#define VNI_SPAN(ctx, kind) ((void)(ctx))
+#define VNI_SPAN_INSTANT(ctx, kind, mode, offset) ((void)(ctx))
+
+#endif
+
+}  // namespace vni
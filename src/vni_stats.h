@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+
+// Runtime performance counters. Everything in here compiles to nothing unless
+// the library is built with VNI_ENABLE_STATS (CMake option ENABLE_STATS).
+
+namespace vni {
+
+#if defined(VNI_ENABLE_STATS)
+
+struct StageStats {
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t max_ns = 0;
+
+  void add(uint64_t ns) {
+    count++;
+    total_ns += ns;
+    if (ns > max_ns) {
+      max_ns = ns;
+    }
+  }
+};
+
+struct Stats {
+  uint64_t frames = 0;
+  uint64_t mapping_lookups = 0;
+  uint64_t mapping_hits = 0;
+  uint64_t mapping_misses = 0;
+  uint64_t masked_checksums = 0;
+  uint64_t animation_starts[8] = {};  // indexed by SwitchMode
+  uint64_t lcm_detections = 0;
+  uint64_t follow_detections = 0;
+  uint64_t events = 0;
+  uint64_t events_dropped = 0;
+  uint64_t replace_cache_hits = 0;
+  uint64_t reloads = 0;
+  uint64_t ticks = 0;
+
+  StageStats split;
+  StageStats trigger;
+  StageStats render;
+  StageStats join;
+  StageStats palette;
+};
+
+class StageTimer {
+ public:
+  explicit StageTimer(StageStats& stage)
+      : stage_(stage), start_(std::chrono::steady_clock::now()) {}
+  ~StageTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    stage_.add(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+            .count()));
+  }
+
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+ private:
+  StageStats& stage_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#define VNI_STATS_INC(ctx, counter) ((ctx)->stats.counter++)
+#define VNI_STATS_ADD(ctx, counter, n) ((ctx)->stats.counter += (n))
+#define VNI_STATS_STAGE(ctx, stage) \
+  ::vni::StageTimer vni_stage_timer_##stage((ctx)->stats.stage)
+
+#else
+
+#define VNI_STATS_INC(ctx, counter) ((void)(ctx))
+#define VNI_STATS_ADD(ctx, counter, n) ((void)(ctx))
+#define VNI_STATS_STAGE(ctx, stage) ((void)(ctx))
+
+#endif
+
+}  // namespace vni
@@ -0,0 +1,205 @@
+#pragma once
+
+// Helpers shared by vni_bench and the command line tools: argument parsing,
+// output digests, latency percentiles and JSON lines. Not part of the
+// library.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace vni {
+
+// FNV-1a, the digest of colorized output all tools report.
+constexpr uint64_t kDigestSeed = 0xcbf29ce484222325ull;
+
+inline uint64_t fnv1a(uint64_t hash, const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+inline uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t index =
+      static_cast<size_t>(p * static_cast<double>(sorted.size() - 1));
+  return sorted[index];
+}
+
+// Decimal numbers. s may be null, the value of an option given last.
+inline bool parse_u64(const char* s, uint64_t* out) {
+  if (!s || !*s) {
+    return false;
+  }
+  char* end = nullptr;
+  unsigned long long v = strtoull(s, &end, 10);
+  if (*end != '\0') {
+    return false;
+  }
+  *out = static_cast<uint64_t>(v);
+  return true;
+}
+
+inline bool parse_u32(const char* s, uint32_t* out) {
+  uint64_t v = 0;
+  if (!parse_u64(s, &v) || v > UINT32_MAX) {
+    return false;
+  }
+  *out = static_cast<uint32_t>(v);
+  return true;
+}
+
+// What the option handler of parse_args() made of an argument.
+enum class Arg { Flag, Value, Invalid };
+
+inline Arg value_arg(bool ok) { return ok ? Arg::Value : Arg::Invalid; }
+
+// Walks the command line of a tool. Arguments that don't start with "--"
+// are positional. The others go to option(arg, value), value being the next
+// argument or null. Prints usage() for --help and -h and the argument and
+// usage() for an invalid one and returns the exit code then.
+template <typename Option>
+std::optional<int> parse_args(const char* tool, int argc, char** argv,
+                              void (*usage)(),
+                              std::vector<std::string>* positional,
+                              Option option) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      usage();
+      return 0;
+    }
+    if (arg.rfind("--", 0) != 0) {
+      positional->push_back(arg);
+      continue;
+    }
+    Arg result = option(arg, i + 1 < argc ? argv[i + 1] : nullptr);
+    if (result == Arg::Invalid) {
+      fprintf(stderr, "%s: invalid argument %s\n", tool, arg.c_str());
+      usage();
+      return 1;
+    }
+    if (result == Arg::Value) {
+      i++;
+    }
+  }
+  return std::nullopt;
+}
+
+inline std::string json_string(std::string_view s) {
+  std::string result = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result += escaped;
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+// One JSON object, built member by member. A null key adds an element of
+// the array begun last.
+class JsonLine {
+ public:
+  void add_str(const char* key, std::string_view value) {
+    this->key(key);
+    line_ += json_string(value);
+  }
+  void add_u64(const char* key, uint64_t value) {
+    this->key(key);
+    line_ += std::to_string(value);
+  }
+  void add_i64(const char* key, int64_t value) {
+    this->key(key);
+    line_ += std::to_string(value);
+  }
+  void add_f(const char* key, double value, int precision) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", precision, value);
+    this->key(key);
+    line_ += buf;
+  }
+  void add_bool(const char* key, bool value) {
+    this->key(key);
+    line_ += value ? "true" : "false";
+  }
+  void add_hex(const char* key, uint64_t value, int digits) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), "\"%0*llx\"", digits,
+             static_cast<unsigned long long>(value));
+    this->key(key);
+    line_ += buf;
+  }
+  void begin(const char* key) {
+    this->key(key);
+    line_ += '{';
+    first_ = true;
+  }
+  void end() {
+    line_ += '}';
+    first_ = false;
+  }
+  void begin_array(const char* key) {
+    this->key(key);
+    line_ += '[';
+    first_ = true;
+  }
+  void end_array() {
+    line_ += ']';
+    first_ = false;
+  }
+  std::string finish() { return line_ + '}'; }
+
+ private:
+  void key(const char* key) {
+    if (!first_) {
+      line_ += ',';
+    }
+    first_ = false;
+    if (key) {
+      line_ += '"';
+      line_ += key;
+      line_ += "\":";
+    }
+  }
+
+  std::string line_ = "{";
+  bool first_ = true;
+};
+
+// The latency_ns object of a sorted set of samples.
+inline void add_latency(JsonLine* json, const std::vector<uint64_t>& sorted) {
+  uint64_t total = 0;
+  for (uint64_t ns : sorted) {
+    total += ns;
+  }
+  json->begin("latency_ns");
+  json->add_f("mean",
+              sorted.empty() ? 0.0
+                             : static_cast<double>(total) /
+                                   static_cast<double>(sorted.size()),
+              1);
+  json->add_u64("p50", percentile(sorted, 0.50));
+  json->add_u64("p90", percentile(sorted, 0.90));
+  json->add_u64("p99", percentile(sorted, 0.99));
+  json->add_u64("p999", percentile(sorted, 0.999));
+  json->add_u64("max", sorted.empty() ? 0 : sorted.back());
+  json->end();
+}
+
+}  // namespace vni
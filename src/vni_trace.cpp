@@ -0,0 +1,322 @@
+#include "vni_trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+#include "vni_heatshrink.h"
+#include "vni_internal.h"
+
+namespace vni {
+
+namespace {
+
+constexpr char kTraceMagic[8] = {'V', 'N', 'I', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint8_t kTraceVersion = 1;
+// Key frames are rare, a short match search keeps recording cheap.
+constexpr int kTraceMaxChain = 16;
+constexpr uint32_t kTraceCompressBackoff = 15;
+// Larger frames are rejected as malformed.
+constexpr uint64_t kMaxTraceSurface = 1u << 24;
+
+void put_varint(std::vector<uint8_t>& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<uint8_t>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(v));
+}
+
+bool get_varint(const std::vector<uint8_t>& in, size_t* pos, uint64_t* v) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*pos >= in.size()) {
+      return false;
+    }
+    uint8_t b = in[(*pos)++];
+    value |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *v = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t zigzag(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+int64_t unzigzag(uint64_t v) {
+  return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+// Appends the changed runs of pixels against previous. Gives up and
+// returns false once out reaches limit bytes.
+bool encode_delta(const uint8_t* pixels, const uint8_t* previous, size_t len,
+                  size_t limit, std::vector<uint8_t>& out) {
+  size_t i = 0;
+  while (i < len) {
+    if (out.size() >= limit) {
+      return false;
+    }
+    size_t same = i;
+    while (same < len && pixels[same] == previous[same]) {
+      same++;
+    }
+    if (same == len) {
+      break;
+    }
+    size_t changed = same;
+    while (changed < len && pixels[changed] != previous[changed]) {
+      changed++;
+    }
+    put_varint(out, same - i);
+    put_varint(out, changed - same);
+    out.insert(out.end(), pixels + same, pixels + changed);
+    i = changed;
+  }
+  return out.size() < limit;
+}
+
+// Packs pixels into bitlen bits each. Returns false if a pixel doesn't fit.
+bool pack_pixels(const uint8_t* pixels, size_t len, uint8_t bitlen,
+                 std::vector<uint8_t>& out) {
+  if (bitlen == 0 || bitlen >= 8) {
+    return false;
+  }
+  out.resize((len * bitlen + 7) / 8);
+  uint32_t acc = 0;
+  int bits = 0;
+  uint8_t all = 0;
+  size_t o = 0;
+  for (size_t i = 0; i < len; i++) {
+    all |= pixels[i];
+    acc |= static_cast<uint32_t>(pixels[i]) << bits;
+    bits += bitlen;
+    if (bits >= 8) {
+      out[o++] = static_cast<uint8_t>(acc);
+      acc >>= 8;
+      bits -= 8;
+    }
+  }
+  if (bits > 0) {
+    out[o] = static_cast<uint8_t>(acc);
+  }
+  return (all >> bitlen) == 0;
+}
+
+bool unpack_pixels(const uint8_t* in, size_t size, size_t len, uint8_t bitlen,
+                   std::vector<uint8_t>* pixels) {
+  if (bitlen == 0 || bitlen >= 8 || size != (len * bitlen + 7) / 8) {
+    return false;
+  }
+  pixels->resize(len);
+  const uint32_t mask = (1u << bitlen) - 1;
+  size_t bit = 0;
+  for (size_t i = 0; i < len; i++, bit += bitlen) {
+    uint32_t v = in[bit / 8];
+    if (bit / 8 + 1 < size) {
+      v |= static_cast<uint32_t>(in[bit / 8 + 1]) << 8;
+    }
+    (*pixels)[i] = static_cast<uint8_t>((v >> (bit % 8)) & mask);
+  }
+  return true;
+}
+
+bool apply_delta(const std::vector<uint8_t>& in, size_t pos, size_t end,
+                 std::vector<uint8_t>* pixels) {
+  size_t i = 0;
+  while (pos < end) {
+    uint64_t same = 0;
+    uint64_t changed = 0;
+    if (!get_varint(in, &pos, &same) || !get_varint(in, &pos, &changed) ||
+        same > pixels->size() - i || changed > pixels->size() - i - same ||
+        changed > end - pos) {
+      return false;
+    }
+    i += same;
+    std::memcpy(pixels->data() + i, in.data() + pos, changed);
+    i += changed;
+    pos += changed;
+  }
+  return pos == end;
+}
+
+}  // namespace
+
+bool TraceWriter::open(const std::string& path) {
+  out_.open(path, std::ios::binary | std::ios::trunc);
+  if (!out_.is_open()) {
+    return false;
+  }
+  out_.write(kTraceMagic, sizeof(kTraceMagic));
+  out_.put(static_cast<char>(kTraceVersion));
+  previous_.clear();
+  frames_ = 0;
+  skip_compress_ = 0;
+  return out_.good();
+}
+
+bool TraceWriter::write(int64_t time_ms, const uint8_t* pixels,
+                        uint32_t width, uint32_t height, uint8_t bitlen) {
+  size_t surface = static_cast<size_t>(width) * height;
+  record_.clear();
+  put_varint(record_, zigzag(frames_ == 0 ? time_ms : time_ms - last_time_));
+  put_varint(record_, width);
+  put_varint(record_, height);
+  record_.push_back(bitlen);
+
+  bool packed = pack_pixels(pixels, surface, bitlen, key_);
+  if (!packed) {
+    key_.assign(pixels, pixels + surface);
+  }
+  TraceEncoding encoding =
+      packed ? TraceEncoding::PackedKey : TraceEncoding::Key;
+  payload_.clear();
+  if (frames_ > 0 && width == width_ && height == height_) {
+    if (encode_delta(pixels, previous_.data(), surface, key_.size(),
+                     payload_)) {
+      encoding = TraceEncoding::Delta;
+    }
+  }
+  if (encoding != TraceEncoding::Delta) {
+    // Input that didn't compress usually stays noisy for a while, so a
+    // failed attempt skips the next few key frames.
+    bool compressed = false;
+    if (skip_compress_ > 0) {
+      skip_compress_--;
+    } else {
+      compressed = heatshrink_compress(key_.data(), key_.size(),
+                                       kHeatshrinkWindow, kHeatshrinkLookahead,
+                                       kTraceMaxChain, &payload_) &&
+                   payload_.size() < key_.size();
+      skip_compress_ = compressed ? 0 : kTraceCompressBackoff;
+    }
+    if (compressed) {
+      encoding = packed ? TraceEncoding::PackedKeyCompressed
+                        : TraceEncoding::KeyCompressed;
+    } else {
+      payload_.swap(key_);
+    }
+  }
+  record_.push_back(static_cast<uint8_t>(encoding));
+  put_varint(record_, payload_.size());
+
+  out_.write(reinterpret_cast<const char*>(record_.data()),
+             static_cast<std::streamsize>(record_.size()));
+  out_.write(reinterpret_cast<const char*>(payload_.data()),
+             static_cast<std::streamsize>(payload_.size()));
+
+  previous_.assign(pixels, pixels + surface);
+  width_ = width;
+  height_ = height;
+  last_time_ = time_ms;
+  frames_++;
+  return out_.good();
+}
+
+void TraceWriter::tally_memory(HeapTally* tally) const {
+  tally->add(previous_);
+  tally->add(record_);
+  tally->add(payload_);
+  tally->add(key_);
+  // Estimated file buffer of out_.
+  tally->add_block(out_.is_open() ? BUFSIZ : 0);
+}
+
+bool TraceWriter::close() {
+  out_.close();
+  return !out_.fail();
+}
+
+bool TraceReader::open(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open()) {
+    return false;
+  }
+  data_.assign(std::istreambuf_iterator<char>(in),
+               std::istreambuf_iterator<char>());
+  pos_ = sizeof(kTraceMagic) + 1;
+  first_ = true;
+  error_ = false;
+  return data_.size() >= pos_ &&
+         std::equal(kTraceMagic, kTraceMagic + sizeof(kTraceMagic),
+                    data_.begin()) &&
+         data_[sizeof(kTraceMagic)] == kTraceVersion;
+}
+
+bool TraceReader::next(TraceFrame* frame) {
+  if (pos_ >= data_.size()) {
+    return false;
+  }
+  uint64_t time = 0;
+  uint64_t width = 0;
+  uint64_t height = 0;
+  uint64_t size = 0;
+  error_ = true;
+  if (!get_varint(data_, &pos_, &time) ||
+      !get_varint(data_, &pos_, &width) ||
+      !get_varint(data_, &pos_, &height) || data_.size() - pos_ < 2) {
+    return false;
+  }
+  uint8_t bitlen = data_[pos_++];
+  auto encoding = static_cast<TraceEncoding>(data_[pos_++]);
+  if (!get_varint(data_, &pos_, &size) || size > data_.size() - pos_ ||
+      width == 0 || height == 0 || width > kMaxTraceSurface ||
+      height > kMaxTraceSurface / width) {
+    return false;
+  }
+  size_t surface = static_cast<size_t>(width * height);
+  size_t payload = pos_;
+  pos_ += static_cast<size_t>(size);
+
+  const uint8_t* in = data_.data() + payload;
+  switch (encoding) {
+    case TraceEncoding::Key:
+      if (size != surface) {
+        return false;
+      }
+      frame->pixels.assign(in, in + size);
+      break;
+    case TraceEncoding::KeyCompressed:
+      if (!heatshrink_decompress(in, size, kHeatshrinkWindow,
+                                 kHeatshrinkLookahead, &frame->pixels) ||
+          frame->pixels.size() != surface) {
+        return false;
+      }
+      break;
+    case TraceEncoding::PackedKey:
+      if (!unpack_pixels(in, size, surface, bitlen, &frame->pixels)) {
+        return false;
+      }
+      break;
+    case TraceEncoding::PackedKeyCompressed:
+      if (!heatshrink_decompress(in, size, kHeatshrinkWindow,
+                                 kHeatshrinkLookahead, &scratch_) ||
+          !unpack_pixels(scratch_.data(), scratch_.size(), surface, bitlen,
+                         &frame->pixels)) {
+        return false;
+      }
+      break;
+    case TraceEncoding::Delta:
+      if (first_ || frame->pixels.size() != surface ||
+          frame->width != width || frame->height != height ||
+          !apply_delta(data_, payload, pos_, &frame->pixels)) {
+        return false;
+      }
+      break;
+    default:
+      return false;
+  }
+  frame->time_ms = first_ ? unzigzag(time) : frame->time_ms + unzigzag(time);
+  frame->width = static_cast<uint32_t>(width);
+  frame->height = static_cast<uint32_t>(height);
+  frame->bitlen = bitlen;
+  first_ = false;
+  error_ = false;
+  return true;
+}
+
+}  // namespace vni
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace vni {
+
+struct HeapTally;
+
+// Input traces record every Vni_Colorize() input of a context so it can be
+// replayed with vni-replay. A trace is the magic "VNITRACE" and a version
+// byte, followed by one record per frame:
+//
+//   varint  ms since the previous record, zigzag encoded (the first record
+//           holds the absolute time)
+//   varint  width, varint height
+//   u8      bitlen
+//   u8      TraceEncoding
+//   varint  payload size, payload
+//
+// Key frames hold the pixels, one per byte or, if they all fit, packed
+// into bitlen bits each (least significant bits first), and either may be
+// heatshrink compressed. Delta frames hold the runs of pixels that changed
+// since the previous frame, which must have the same size: pairs of varint
+// unchanged and changed counts, each followed by the changed pixels. Pixels
+// after the last run are unchanged. A frame is stored as a delta only if
+// that is smaller than its key frame.
+enum class TraceEncoding : uint8_t {
+  Key = 0,
+  KeyCompressed = 1,
+  Delta = 2,
+  PackedKey = 3,
+  PackedKeyCompressed = 4,
+};
+
+struct TraceFrame {
+  int64_t time_ms = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint8_t bitlen = 0;
+  std::vector<uint8_t> pixels;  // width * height indexed pixels
+};
+
+class TraceWriter {
+ public:
+  // Creates or truncates path and writes the header.
+  bool open(const std::string& path);
+  // Appends a frame. Returns false if the file can't be written.
+  bool write(int64_t time_ms, const uint8_t* pixels, uint32_t width,
+             uint32_t height, uint8_t bitlen);
+  bool close();
+
+  uint64_t frames() const { return frames_; }
+  void tally_memory(HeapTally* tally) const;
+
+ private:
+  std::ofstream out_;
+  std::vector<uint8_t> previous_;
+  uint32_t width_ = 0;
+  uint32_t height_ = 0;
+  int64_t last_time_ = 0;
+  uint64_t frames_ = 0;
+  uint32_t skip_compress_ = 0;
+  std::vector<uint8_t> record_;
+  std::vector<uint8_t> payload_;
+  std::vector<uint8_t> key_;
+};
+
+class TraceReader {
+ public:
+  // Reads the whole trace at path. Returns false if it can't be read or
+  // isn't a trace.
+  bool open(const std::string& path);
+  // Decodes the next frame into frame, which must be the frame of the
+  // previous call, if any. Returns false at the end of the trace or at a
+  // malformed record, error() tells them apart.
+  bool next(TraceFrame* frame);
+
+  bool error() const { return error_; }
+  size_t size() const { return data_.size(); }
+
+ private:
+  std::vector<uint8_t> data_;
+  size_t pos_ = 0;
+  bool first_ = true;
+  bool error_ = false;
+  std::vector<uint8_t> scratch_;
+};
+
+}  // namespace vni
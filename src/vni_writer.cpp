@@ -0,0 +1,193 @@
+#include "vni_writer.h"
+
+#include <ostream>
+#include <string>
+
+#include "FrameUtil.h"
+#include "vni_heatshrink.h"
+
+namespace vni {
+
+namespace {
+
+constexpr uint16_t kVniWriteVersion = 6;
+
+void write_u8(std::vector<uint8_t>& out, uint8_t v) { out.push_back(v); }
+
+void write_u16_be(std::vector<uint8_t>& out, uint16_t v) {
+  out.push_back(static_cast<uint8_t>(v >> 8));
+  out.push_back(static_cast<uint8_t>(v));
+}
+
+void write_u32_be(std::vector<uint8_t>& out, uint32_t v) {
+  write_u16_be(out, static_cast<uint16_t>(v >> 16));
+  write_u16_be(out, static_cast<uint16_t>(v));
+}
+
+void write_reversed(std::vector<uint8_t>& out, const uint8_t* bytes,
+                    size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    out.push_back(FrameUtil::Helper::ReverseByte(bytes[i]));
+  }
+}
+
+void patch_u32_be(std::vector<uint8_t>& out, size_t pos, uint32_t v) {
+  out[pos + 0] = static_cast<uint8_t>(v >> 24);
+  out[pos + 1] = static_cast<uint8_t>(v >> 16);
+  out[pos + 2] = static_cast<uint8_t>(v >> 8);
+  out[pos + 3] = static_cast<uint8_t>(v);
+}
+
+void write_frame(std::vector<uint8_t>& out, const FrameSeq& seq,
+                 const AnimationFrame& frame, FrameCache* cache,
+                 bool compress, const VniWriteOptions& options,
+                 VniWriteResult* result) {
+  std::vector<uint8_t> planes;
+  for (size_t i = 0; i < frame.plane_count; i++) {
+    write_u8(planes, seq.marker(frame, i, cache));
+    write_reversed(planes, seq.plane(frame, i, cache), frame.plane_size);
+  }
+  if (frame.has_mask) {
+    write_u8(planes, kMaskMarker);
+    write_reversed(planes, seq.mask(frame, cache), frame.plane_size);
+  }
+
+  write_u16_be(out, frame.plane_size);
+  write_u16_be(out, static_cast<uint16_t>(frame.delay));
+  write_u32_be(out, frame.hash);
+  write_u8(out, static_cast<uint8_t>(frame.plane_count +
+                                     (frame.has_mask ? 1 : 0)));
+
+  std::vector<uint8_t> packed;
+  bool packed_ok = compress &&
+                   heatshrink_compress(planes.data(), planes.size(),
+                                       kHeatshrinkWindow, kHeatshrinkLookahead,
+                                       options.max_chain, &packed) &&
+                   packed.size() + 4 < planes.size();
+  result->frames++;
+  result->raw_bytes += planes.size();
+  if (!packed_ok) {
+    write_u8(out, 0);
+    out.insert(out.end(), planes.begin(), planes.end());
+    result->stored_bytes += planes.size();
+    return;
+  }
+
+  write_u8(out, 1);
+  write_u32_be(out, static_cast<uint32_t>(packed.size()));
+  out.insert(out.end(), packed.begin(), packed.end());
+  result->compressed_frames++;
+  result->stored_bytes += packed.size();
+}
+
+void write_frame_seq(std::vector<uint8_t>& out, const FrameSeq& seq,
+                     FrameCache* cache, bool compress,
+                     const VniWriteOptions& options, VniWriteResult* result) {
+  write_u16_be(out, static_cast<uint16_t>(seq.name.size()));
+  out.insert(out.end(), seq.name.begin(), seq.name.end());
+  if (!seq.header.empty()) {
+    out.insert(out.end(), seq.header.begin(), seq.header.end());
+  } else {
+    write_u16_be(out, 0);  // cycles
+    write_u16_be(out, 0);  // hold cycles
+    write_u16_be(out, 0);  // clock from
+    write_u8(out, 0);      // clock small
+    write_u8(out, 0);      // clock in front
+    write_u16_be(out, 0);  // clock offset x
+    write_u16_be(out, 0);  // clock offset y
+    write_u16_be(out, 0);  // refresh delay
+    write_u8(out, 0);      // type
+    write_u8(out, 0);      // fsk
+    write_u16_be(out, static_cast<uint16_t>(seq.frames.size()));
+    write_u16_be(out, 0);  // palette index
+    write_u16_be(out, 0);  // num colors
+    write_u8(out, 0);      // edit mode
+    write_u16_be(out, static_cast<uint16_t>(seq.size.width));
+    write_u16_be(out, static_cast<uint16_t>(seq.size.height));
+    write_u16_be(out, static_cast<uint16_t>(seq.masks.size()));
+    for (const auto& mask : seq.masks) {
+      write_u8(out, 0);  // locked
+      write_u16_be(out, static_cast<uint16_t>(mask.size));
+      write_reversed(out, seq.data(mask), mask.size);
+    }
+    write_u8(out, 0);      // compiled animation
+    write_u16_be(out, 0);  // compiled animation size
+    write_u32_be(out, 0);  // start frame
+  }
+
+  for (const auto& frame : seq.frames) {
+    write_frame(out, seq, frame, cache, compress, options, result);
+  }
+}
+
+}  // namespace
+
+bool write_pal_file(std::ostream& out, const PalFile& pal) {
+  if (pal.palettes.size() > 0xffff || pal.mappings.size() > 0xffff ||
+      pal.masks.size() > 0xff) {
+    return false;
+  }
+  std::vector<uint8_t> data;
+  write_u8(data, pal.version);
+  write_u16_be(data, static_cast<uint16_t>(pal.palettes.size()));
+  for (const auto& palette : pal.palettes) {
+    write_u16_be(data, palette.index);
+    write_u16_be(data, static_cast<uint16_t>(palette.colors.size() / 3));
+    write_u8(data, palette.type);
+    data.insert(data.end(), palette.colors.begin(),
+                palette.colors.begin() + (palette.colors.size() / 3) * 3);
+  }
+  write_u16_be(data, static_cast<uint16_t>(pal.mappings.size()));
+  for (const auto& entry : pal.mappings) {
+    const Mapping& mapping = entry.second;
+    write_u32_be(data, mapping.checksum);
+    write_u8(data, static_cast<uint8_t>(mapping.mode));
+    write_u16_be(data, mapping.palette_index);
+    write_u32_be(data, mapping.mode == SwitchMode::Palette ? mapping.duration
+                                                           : mapping.offset);
+  }
+  write_u8(data, static_cast<uint8_t>(pal.masks.size()));
+  for (const auto& mask : pal.masks) {
+    data.insert(data.end(), mask.begin(), mask.end());
+  }
+  out.write(reinterpret_cast<const char*>(data.data()),
+            static_cast<std::streamsize>(data.size()));
+  return out.good();
+}
+
+bool write_vni_file(std::ostream& out, const VniFile& vni,
+                    const VniWriteOptions& options, VniWriteResult* result) {
+  if (vni.animations.size() > 0xffff) {
+    return false;
+  }
+  VniWriteResult local;
+  if (!result) {
+    result = &local;
+  }
+  *result = VniWriteResult();
+  // Decodes frames kept compressed, one at a time.
+  FrameCache cache;
+
+  std::vector<uint8_t> data = {'V', 'P', 'I', 'N'};
+  write_u16_be(data, kVniWriteVersion);
+  write_u16_be(data, static_cast<uint16_t>(vni.animations.size()));
+  size_t table = data.size();
+  for (size_t i = 0; i < vni.animations.size(); i++) {
+    write_u32_be(data, 0);
+  }
+  for (size_t i = 0; i < vni.animations.size(); i++) {
+    uint32_t offset = static_cast<uint32_t>(data.size());
+    result->offsets.push_back(offset);
+    patch_u32_be(data, table + i * 4, offset);
+    bool compress =
+        options.compress &&
+        !(i < options.uncompressed.size() && options.uncompressed[i]);
+    write_frame_seq(data, vni.animations[i], &cache, compress, options,
+                    result);
+  }
+  out.write(reinterpret_cast<const char*>(data.data()),
+            static_cast<std::streamsize>(data.size()));
+  return out.good();
+}
+
+}  // namespace vni
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <iosfwd>
+#include <vector>
+
+#include "vni_internal.h"
+
+namespace vni {
+
+struct VniWriteOptions {
+  bool compress = true;
+  int max_chain = 256;
+  // Sequences (by index) whose frames are always stored uncompressed.
+  std::vector<bool> uncompressed;
+};
+
+struct VniWriteResult {
+  std::vector<uint32_t> offsets;  // new file offset of every sequence
+  size_t frames = 0;
+  size_t compressed_frames = 0;
+  size_t raw_bytes = 0;
+  size_t stored_bytes = 0;
+};
+
+// Serializes a PAL file in the layout read_pal_file() understands.
+bool write_pal_file(std::ostream& out, const PalFile& pal);
+
+// Serializes a version 6 VNI file in the layout read_vni_file() understands.
+// Sequence headers are copied from FrameSeq::header if the sequences were
+// read with VniReadOptions::keep_header, otherwise the fields the reader
+// skips are written as zero. Frames that can't be compressed or don't
+// shrink are stored uncompressed.
+bool write_vni_file(std::ostream& out, const VniFile& vni,
+                    const VniWriteOptions& options, VniWriteResult* result);
+
+}  // namespace vni